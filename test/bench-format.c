@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Number formatter benchmark.
+ *
+ * Checks fmt_double() against snprintf("%.*f") for a few million
+ * random values and some edge cases, then times three ways of
+ * writing a complete sample as query parameters: "%f" as the upload
+ * services used to, "%.*f" with each field's precision, and
+ * fmt_param(). The only differences allowed are values exactly half
+ * way between two results, which fmt_double() rounds away from zero,
+ * and negative zero, which it writes without the sign.
+ *
+ *   make test/bench-format && test/bench-format [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "wfp.h"
+
+#define CHECK_VALUES 2000000
+
+int debug;
+int verbose;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Is the difference between fmt_double() and snprintf() one of the
+ * allowed ones?
+ */
+static int allowed(double v, int prec, const char *want)
+{
+	double scaled = fabs(v) * pow(10, prec);
+
+	if (fabs(scaled - floor(scaled) - 0.5) < 1e-6)
+		return 1;
+	return (want[0] == '-') && (atof(want) == 0.0);
+}
+
+static int check_one(double v, int prec, int size, const char *expect)
+{
+	char got[64], want[64];
+	int len, want_len;
+
+	len = fmt_double(got, size, v, prec);
+	want_len = snprintf(want, size, "%.*f", prec, v);
+	if (expect && strcmp(got, expect)) {
+		printf("fmt_double(%.17g, %d) = \"%s\", expected \"%s\"\n",
+				v, prec, got, expect);
+		return 1;
+	}
+	if (expect)
+		return 0;
+	if (strcmp(got, want) && !allowed(v, prec, want)) {
+		printf("fmt_double(%.17g, %d) = \"%s\", snprintf gives \"%s\"\n",
+				v, prec, got, want);
+		return 1;
+	}
+	if ((len != want_len) && !allowed(v, prec, want)) {
+		printf("fmt_double(%.17g, %d) returned %d, snprintf %d\n",
+				v, prec, len, want_len);
+		return 1;
+	}
+	return 0;
+}
+
+static int check(void)
+{
+	int bad = 0;
+	double v;
+	long i;
+
+	srand(1);
+	for (i = 0; i < CHECK_VALUES; i++) {
+		v = (rand() / (double)RAND_MAX - 0.5) * pow(10, rand() % 8);
+		bad += check_one(v, rand() % 5, 64, NULL);
+		if (bad > 10)
+			break;
+	}
+
+	bad += check_one(123.456, 2, 4, "123");		/* truncated */
+	bad += check_one(-0.04, 1, 64, "0.0");
+	bad += check_one(-29.92, 2, 64, "-29.92");
+	bad += check_one(0.125, 2, 64, "0.13");
+	bad += check_one(1e20, 2, 64, NULL);
+	bad += check_one(NAN, 1, 64, NULL);
+	bad += check_one(INFINITY, 1, 64, NULL);
+	bad += check_one(1013.25, 0, 64, "1013");
+
+	if (bad)
+		printf("%d mismatches\n", bad);
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	weather_data_t wd;
+	struct cfg_info cfg;
+	char names[WD_VALUES][40];
+	char buf[2048];
+	long iterations = 200000;
+	long i;
+	int f;
+	int len;
+	double start, printf_time, prec_time, fmt_time;
+	volatile int sink = 0;
+
+	if (argc > 1)
+		iterations = atol(argv[1]);
+
+	if (check())
+		return 1;
+
+	memset(&wd, 0, sizeof(wd));
+	memset(&cfg, 0, sizeof(cfg));
+	for (f = 0; f < WD_VALUES; f++) {
+		wd.value[f] = (f + 1) * 3.14159;
+		snprintf(names[f], sizeof(names[f]), "&%s=", wd_fields[f].name);
+	}
+	format_config(&cfg);
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		for (len = 0, f = 0; f < WD_VALUES; f++)
+			len += sprintf(buf + len, "&%s=%f", wd_fields[f].name,
+					wd.value[f]);
+		sink += len;
+	}
+	printf_time = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		for (len = 0, f = 0; f < WD_VALUES; f++)
+			len += snprintf(buf + len, sizeof(buf) - len, "&%s=%.*f",
+					wd_fields[f].name, cfg.precision[f], wd.value[f]);
+		sink += len;
+	}
+	prec_time = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		for (len = 0, f = 0; f < WD_VALUES; f++)
+			len += fmt_param(buf + len, sizeof(buf) - len, names[f], &cfg,
+					&wd, f);
+		sink += len;
+	}
+	fmt_time = now() - start;
+
+	printf("%ld x %d fields\n", iterations, WD_VALUES);
+	printf("sprintf %%f:   %8.0f ns/sample\n",
+			printf_time / iterations * 1e9);
+	printf("snprintf %%.*f: %8.0f ns/sample\n",
+			prec_time / iterations * 1e9);
+	printf("fmt_param:    %8.0f ns/sample (%.1fx)\n",
+			fmt_time / iterations * 1e9, printf_time / fmt_time);
+
+	return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Parser microbenchmark.
+ *
+ * Decodes a set of packets captured from a hub, once with
+ * wf_packet_scan() and once the way wfpublish used to, with a full
+ * cJSON parse and walking the tree for the values. Both decodes are
+ * checked against each other before timing.
+ *
+ *   make test/bench-parse && test/bench-parse [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "wfp.h"
+#include "cJSON.h"
+
+static const char *packets[] = {
+	"{\"serial_number\":\"AR-00004049\",\"type\":\"obs_air\","
+		"\"hub_sn\":\"HB-00000001\",\"obs\":[[1493164835,835.0,10.0,45,0,0,"
+		"3.46,1]],\"firmware_revision\":17}",
+	"{\"serial_number\":\"SK-00008453\",\"type\":\"obs_sky\","
+		"\"hub_sn\":\"HB-00000001\",\"obs\":[[1493321340,9000,10,0.0,2.6,"
+		"4.6,7.4,187,3.12,1,130,null,0,3]],\"firmware_revision\":29}",
+	"{\"serial_number\":\"SK-00008453\",\"type\":\"rapid_wind\","
+		"\"hub_sn\":\"HB-00000001\",\"ob\":[1493322445,2.3,128]}",
+	"{\"serial_number\":\"SK-00008453\",\"type\":\"rapid_wind\","
+		"\"hub_sn\":\"HB-00000001\",\"ob\":[1493322448,2.1,131]}",
+	"{\"serial_number\":\"ACU-1274\",\"type\":\"obs_tower\","
+		"\"obs\":[[1493322450,0,21.5,40]]}",
+	"{\"serial_number\":\"AR-00004049\",\"type\":\"evt_strike\","
+		"\"hub_sn\":\"HB-00000001\",\"evt\":[1493322445,27,3848]}",
+	"{\"serial_number\":\"AR-00004049\",\"type\":\"device_status\","
+		"\"hub_sn\":\"HB-00000001\",\"timestamp\":1510855923,"
+		"\"uptime\":2189,\"voltage\":3.50,\"firmware_revision\":17,"
+		"\"rssi\":-17,\"hub_rssi\":-87,\"sensor_status\":0,\"debug\":0}",
+	"{\"serial_number\":\"HB-00000001\",\"type\":\"hub_status\","
+		"\"firmware_revision\":\"35\",\"uptime\":1670133,\"rssi\":-62,"
+		"\"timestamp\":1495724691,\"reset_flags\":\"BOR,PIN,POR\","
+		"\"seq\":48,\"fs\":[1,0,15675411,524288],\"radio_stats\":[2,1,0,3],"
+		"\"mqtt_stats\":[1,0]}",
+};
+
+#define PACKETS (sizeof(packets) / sizeof(packets[0]))
+
+static const char *type_names[] = {
+	"unknown", "obs_air", "obs_sky", "obs_tower", "rapid_wind",
+	"evt_strike", "evt_precip", "device_status", "hub_status"
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The old path. Returns the sum of the observation values so the
+ * work can't be optimized away.
+ */
+static double cjson_decode(const char *msg, struct wf_packet *pkt)
+{
+	cJSON *root, *item, *obs, *row;
+	double sum = 0;
+	int i, j, n;
+
+	memset(pkt, 0, sizeof(*pkt));
+	root = cJSON_Parse(msg);
+	if (!root)
+		return NAN;
+
+	item = cJSON_GetObjectItemCaseSensitive(root, "type");
+	if (cJSON_IsString(item)) {
+		for (i = 1; i < (int)(sizeof(type_names) / sizeof(type_names[0])); i++)
+			if (strcmp(item->valuestring, type_names[i]) == 0)
+				pkt->type = i;
+	}
+	item = cJSON_GetObjectItemCaseSensitive(root, "serial_number");
+	if (cJSON_IsString(item))
+		strncpy(pkt->serial_number, item->valuestring,
+				sizeof(pkt->serial_number) - 1);
+
+	obs = cJSON_GetObjectItemCaseSensitive(root, "obs");
+	if (obs) {
+		n = cJSON_GetArraySize(obs);
+		for (i = 0; (i < n) && (i < WF_MAX_ROWS); i++) {
+			row = cJSON_GetArrayItem(obs, i);
+			pkt->cols[i] = cJSON_GetArraySize(row);
+			for (j = 0; (j < pkt->cols[i]) && (j < WF_MAX_VALUES); j++) {
+				item = cJSON_GetArrayItem(row, j);
+				pkt->obs[i][j] = cJSON_IsNumber(item) ?
+					item->valuedouble : 0;
+				sum += pkt->obs[i][j];
+			}
+			pkt->rows++;
+		}
+	}
+
+	obs = cJSON_GetObjectItemCaseSensitive(root, "ob");
+	if (!obs)
+		obs = cJSON_GetObjectItemCaseSensitive(root, "evt");
+	if (obs) {
+		pkt->cols[0] = cJSON_GetArraySize(obs);
+		for (j = 0; (j < pkt->cols[0]) && (j < WF_MAX_VALUES); j++) {
+			item = cJSON_GetArrayItem(obs, j);
+			pkt->obs[0][j] = cJSON_IsNumber(item) ? item->valuedouble : 0;
+			sum += pkt->obs[0][j];
+		}
+		pkt->rows = 1;
+	}
+
+	item = cJSON_GetObjectItemCaseSensitive(root, "uptime");
+	if (cJSON_IsNumber(item))
+		pkt->uptime = item->valuedouble;
+
+	cJSON_Delete(root);
+	return sum;
+}
+
+static double scan_decode(const char *msg, int len, struct wf_packet *pkt)
+{
+	double sum = 0;
+	int i, j;
+
+	if (wf_packet_scan(msg, len, pkt))
+		return NAN;
+	for (i = 0; i < pkt->rows; i++)
+		for (j = 0; j < pkt->cols[i]; j++)
+			sum += pkt->obs[i][j];
+	return sum;
+}
+
+/*
+ * Both decoders have to agree before the timing means anything.
+ */
+static int check(const int *len)
+{
+	struct wf_packet a, b;
+	unsigned int p;
+	int i, j;
+	int bad = 0;
+
+	for (p = 0; p < PACKETS; p++) {
+		cjson_decode(packets[p], &a);
+		if (isnan(scan_decode(packets[p], len[p], &b))) {
+			printf("FAIL: scanner rejected %s\n", type_names[a.type]);
+			bad++;
+			continue;
+		}
+		if ((a.type != b.type) || strcmp(a.serial_number, b.serial_number) ||
+				(a.rows != b.rows) || (a.uptime != b.uptime)) {
+			printf("FAIL: %s header differs\n", type_names[a.type]);
+			bad++;
+			continue;
+		}
+		for (i = 0; i < a.rows; i++) {
+			for (j = 0; j < a.cols[i]; j++) {
+				if (a.obs[i][j] != b.obs[i][j]) {
+					printf("FAIL: %s value %d differs: %g %g\n",
+							type_names[a.type], j, a.obs[i][j], b.obs[i][j]);
+					bad++;
+				}
+			}
+		}
+	}
+
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	struct wf_packet pkt;
+	int len[PACKETS];
+	long iterations = 200000;
+	long i;
+	unsigned int p;
+	double start, scan_time, cjson_time;
+	volatile double sink = 0;
+
+	if (argc > 1)
+		iterations = atol(argv[1]);
+
+	for (p = 0; p < PACKETS; p++)
+		len[p] = strlen(packets[p]);
+
+	if (check(len))
+		return 1;
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		for (p = 0; p < PACKETS; p++)
+			sink += cjson_decode(packets[p], &pkt);
+	cjson_time = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		for (p = 0; p < PACKETS; p++)
+			sink += scan_decode(packets[p], len[p], &pkt);
+	scan_time = now() - start;
+
+	printf("%ld x %d packets\n", iterations, (int)PACKETS);
+	printf("cJSON:          %8.0f ns/packet\n",
+			cjson_time / (iterations * PACKETS) * 1e9);
+	printf("wf_packet_scan: %8.0f ns/packet (%.1fx)\n",
+			scan_time / (iterations * PACKETS) * 1e9, cjson_time / scan_time);
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Loopback receive benchmark.
+ *
+ * Sends a burst of hub packets over loopback as fast as it can and
+ * reads them back, first with a read() per packet as wfpublish used
+ * to, then with recvmmsg() batches the way udp_receive() does. For
+ * each it shows the receive syscalls per packet and how many packets
+ * the kernel dropped because the receive buffer was full.
+ *
+ *   test/bench-udp [packets] [batch] [receive buffer bytes]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PACKET_SIZE 1024
+#define BATCH_MAX 64
+#define CONTROL_SIZE (CMSG_SPACE(sizeof(struct timespec)) + \
+		CMSG_SPACE(sizeof(uint32_t)))
+#define IDLE_WAIT 200			/* msec without packets before giving up */
+
+static const char *packets[] = {
+	"{\"serial_number\":\"SK-00008453\",\"type\":\"rapid_wind\","
+		"\"hub_sn\":\"HB-00000001\",\"ob\":[1493322445,2.3,128]}",
+	"{\"serial_number\":\"AR-00004049\",\"type\":\"obs_air\","
+		"\"hub_sn\":\"HB-00000001\",\"obs\":[[1493164835,835.0,10.0,45,0,0,"
+		"3.46,1]],\"firmware_revision\":17}",
+	"{\"serial_number\":\"SK-00008453\",\"type\":\"obs_sky\","
+		"\"hub_sn\":\"HB-00000001\",\"obs\":[[1493321340,9000,10,0.0,2.6,"
+		"4.6,7.4,187,3.12,1,130,null,0,3]],\"firmware_revision\":29}",
+	"{\"serial_number\":\"ACU-1274\",\"type\":\"obs_tower\","
+		"\"obs\":[[1493322450,0,21.5,40]]}",
+};
+
+#define PACKETS (sizeof(packets) / sizeof(packets[0]))
+
+struct burst {
+	struct sockaddr_in to;
+	long count;
+};
+
+struct result {
+	long packets;
+	long calls;
+	uint32_t dropped;
+	double seconds;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *sender(void *arg)
+{
+	struct burst *b = (struct burst *)arg;
+	const char *p;
+	long i;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return NULL;
+
+	for (i = 0; i < b->count; i++) {
+		p = packets[i % PACKETS];
+		sendto(fd, p, strlen(p), 0, (struct sockaddr *)&b->to,
+				sizeof(b->to));
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static int open_receiver(struct sockaddr_in *addr, int rcvbuf)
+{
+	socklen_t len = sizeof(*addr);
+	int one = 1;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) ||
+			getsockname(fd, (struct sockaddr *)addr, &len)) {
+		perror("bind");
+		exit(1);
+	}
+
+	if (rcvbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+
+	return fd;
+}
+
+/*
+ * The kernel's count of packets dropped on this socket.
+ */
+static uint32_t drops(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	uint32_t count = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) &&
+				(cmsg->cmsg_type == SO_RXQ_OVFL))
+			memcpy(&count, CMSG_DATA(cmsg), sizeof(count));
+	}
+
+	return count;
+}
+
+/*
+ * Receive until the sender is done and the socket has been quiet
+ * for IDLE_WAIT. batch 0 reads a packet at a time with read().
+ */
+static void run(long count, int batch, int rcvbuf, struct result *r)
+{
+	static char line[BATCH_MAX][PACKET_SIZE + 1];
+	static char control[BATCH_MAX][CONTROL_SIZE];
+	struct mmsghdr msgs[BATCH_MAX];
+	struct iovec iov[BATCH_MAX];
+	struct sockaddr_in addr;
+	struct pollfd pfd;
+	struct burst b;
+	pthread_t thread;
+	double start;
+	int fd;
+	int n;
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	fd = open_receiver(&addr, rcvbuf);
+	b.to = addr;
+	b.count = count;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	start = now();
+	pthread_create(&thread, NULL, sender, &b);
+
+	while (poll(&pfd, 1, IDLE_WAIT) > 0) {
+		if (batch == 0) {
+			while (read(fd, line[0], PACKET_SIZE) >= 0) {
+				r->calls++;
+				r->packets++;
+			}
+			r->calls++;		/* the one that said EAGAIN */
+			continue;
+		}
+
+		do {
+			for (i = 0; i < batch; i++) {
+				iov[i].iov_base = line[i];
+				iov[i].iov_len = PACKET_SIZE;
+				memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+				msgs[i].msg_hdr.msg_control = control[i];
+				msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+			}
+			n = recvmmsg(fd, msgs, batch, MSG_DONTWAIT, NULL);
+			r->calls++;
+			if (n > 0) {
+				r->packets += n;
+				r->dropped = drops(&msgs[n - 1].msg_hdr);
+			}
+		} while (n == batch);
+	}
+
+	r->seconds = now() - start - IDLE_WAIT / 1000.0;
+	pthread_join(thread, NULL);
+
+	/* read() can't see the drop count, it's whatever didn't arrive */
+	if (batch == 0)
+		r->dropped = count - r->packets;
+
+	close(fd);
+}
+
+static void report(const char *name, long count, struct result *r)
+{
+	printf("%-14s %8ld received %6.3f calls/packet %6u dropped (%.1f%%) "
+			"%.0f packets/s\n", name, r->packets,
+			r->packets ? (double)r->calls / r->packets : 0.0, r->dropped,
+			100.0 * r->dropped / count, r->packets / r->seconds);
+}
+
+int main(int argc, char **argv)
+{
+	struct result r;
+	long count = 100000;
+	int batch = 16;
+	int rcvbuf = 0;
+	char name[32];
+
+	if (argc > 1)
+		count = atol(argv[1]);
+	if (argc > 2)
+		batch = atoi(argv[2]);
+	if (argc > 3)
+		rcvbuf = atoi(argv[3]);
+	if ((batch < 1) || (batch > BATCH_MAX))
+		batch = 16;
+
+	printf("%ld packets, receive buffer %s\n", count,
+			rcvbuf ? argv[3] : "default");
+
+	run(count, 0, rcvbuf, &r);
+	report("read()", count, &r);
+
+	run(count, batch, rcvbuf, &r);
+	snprintf(name, sizeof(name), "recvmmsg(%d)", batch);
+	report(name, count, &r);
+
+	return 0;
+}
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Stream fan-out load test.
+ *
+ * Opens a number of /stream connections to a running wfpublish with
+ * the httpd service enabled, then sends rapid_wind packets to it on
+ * the hub port. Each packet carries its own sequence number as the
+ * time, so every event a client reads back can be matched with the
+ * moment it was sent. Shows how many clients got each event and how
+ * long the fan-out took.
+ *
+ * The server only starts listening once it has a sample to serve, so
+ * an air and a sky observation are sent first.
+ *
+ *   test/load-stream [clients] [events] [host] [port]
+ *
+ * The defaults are 1000 clients, 100 events and 127.0.0.1:8080. The
+ * packets always go to 127.0.0.1:50222. Run wfpublish with an open
+ * files limit above the number of clients.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define HUB_PORT 50222
+#define CONNECTING_MAX 64		/* below the server's listen backlog */
+#define CONNECT_WAIT 10			/* seconds to get every client streaming */
+#define EVENT_GAP 50			/* msec between events */
+#define DRAIN_WAIT 2000			/* msec to wait for the last event */
+#define BUFFER_SIZE 4096
+#define SEQ_BASE 1000000000L	/* event time of the first event */
+
+enum state {
+	STATE_IDLE = 0,
+	STATE_CONNECTING,		/* request sent, waiting for the headers */
+	STATE_STREAMING,
+	STATE_CLOSED
+};
+
+struct client {
+	int fd;
+	enum state state;
+	char buf[BUFFER_SIZE];
+	int len;
+	long received;
+};
+
+static struct client *clients;
+static int nclients;
+static int epfd;
+static int connecting;
+static int streaming;
+static int closed;
+
+static double *sent_at;		/* per event */
+static long *delivered;		/* per event */
+static double *latency;		/* every delivery, msec */
+static long nlatency;
+static int nevents;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void client_close(struct client *c)
+{
+	if (c->state == STATE_CONNECTING)
+		connecting--;
+	else if (c->state == STATE_STREAMING)
+		streaming--;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->state = STATE_CLOSED;
+	closed++;
+}
+
+static void client_open(struct client *c, struct sockaddr_in *addr,
+		const char *host)
+{
+	struct epoll_event ev;
+	char req[256];
+	int len;
+
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (c->fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	/*
+	 * A blocking connect on loopback returns as soon as the kernel
+	 * has queued the connection, keeping no more than CONNECTING_MAX
+	 * of them unanswered stays inside the listen backlog.
+	 */
+	c->state = STATE_CONNECTING;
+	connecting++;
+	if (connect(c->fd, (struct sockaddr *)addr, sizeof(*addr))) {
+		client_close(c);
+		return;
+	}
+
+	len = snprintf(req, sizeof(req), "GET /stream HTTP/1.1\r\n"
+			"Host: %s\r\n\r\n", host);
+	if (write(c->fd, req, len) != len) {
+		client_close(c);
+		return;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/*
+ * Send an observation and wait for the server to start listening.
+ */
+static int server_ready(int fd, struct sockaddr_in *hub,
+		struct sockaddr_in *addr)
+{
+	char packet[256];
+	long t = time(NULL);
+	double deadline = now() + CONNECT_WAIT;
+	int probe;
+	int ok;
+
+	snprintf(packet, sizeof(packet), "{\"serial_number\":\"AR-00004049\","
+			"\"type\":\"obs_air\",\"hub_sn\":\"HB-00000001\","
+			"\"obs\":[[%ld,835.0,10.0,45,0,0,3.46,1]]}", t);
+	sendto(fd, packet, strlen(packet), 0, (struct sockaddr *)hub,
+			sizeof(*hub));
+	snprintf(packet, sizeof(packet), "{\"serial_number\":\"SK-00008453\","
+			"\"type\":\"obs_sky\",\"hub_sn\":\"HB-00000001\","
+			"\"obs\":[[%ld,9000,10,0.0,2.6,4.6,7.4,187,3.12,1,130,null,0,3]]}",
+			t);
+	sendto(fd, packet, strlen(packet), 0, (struct sockaddr *)hub,
+			sizeof(*hub));
+
+	do {
+		if ((probe = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+			return 0;
+		ok = !connect(probe, (struct sockaddr *)addr, sizeof(*addr));
+		close(probe);
+		if (ok)
+			return 1;
+		usleep(100000);
+	} while (now() < deadline);
+
+	return 0;
+}
+
+/*
+ * Pick the events out of what the client has read so far.
+ */
+static void client_events(struct client *c, double t)
+{
+	char *p = c->buf;
+	char *end;
+	long seq;
+
+	while ((end = memmem(p, c->len - (p - c->buf), "\n\n", 2))) {
+		*end = '\0';
+		if (strncmp(p, "event: rapid_wind\n", 18) == 0 &&
+				(p = strstr(p, "\"time\":"))) {
+			seq = strtol(p + 7, NULL, 10) - SEQ_BASE;
+			if ((seq >= 0) && (seq < nevents) && sent_at[seq]) {
+				delivered[seq]++;
+				latency[nlatency++] = (t - sent_at[seq]) * 1000.0;
+				c->received++;
+			}
+		}
+		p = end + 2;
+	}
+
+	c->len -= p - c->buf;
+	memmove(c->buf, p, c->len);
+}
+
+static void client_read(struct client *c, double t)
+{
+	char *end;
+	ssize_t n;
+
+	n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1);
+	if (n <= 0) {
+		if ((n < 0) && (errno == EAGAIN))
+			return;
+		client_close(c);
+		return;
+	}
+	c->len += n;
+	c->buf[c->len] = '\0';
+
+	if (c->state == STATE_CONNECTING) {
+		if (!(end = strstr(c->buf, "\r\n\r\n"))) {
+			if (c->len >= (int)sizeof(c->buf) - 1)
+				client_close(c);
+			return;
+		}
+		if (strncmp(c->buf, "HTTP/1.1 200", 12) != 0) {
+			client_close(c);
+			return;
+		}
+		c->state = STATE_STREAMING;
+		connecting--;
+		streaming++;
+		end += 4;
+		c->len -= end - c->buf;
+		memmove(c->buf, end, c->len);
+	}
+
+	client_events(c, t);
+	if (c->len >= (int)sizeof(c->buf) - 1)
+		client_close(c);
+}
+
+static void poll_clients(int msec)
+{
+	struct epoll_event ev[256];
+	double t;
+	int n;
+	int i;
+
+	n = epoll_wait(epfd, ev, 256, msec);
+	t = now();
+	for (i = 0; i < n; i++)
+		client_read((struct client *)ev[i].data.ptr, t);
+}
+
+static int compare(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(double p)
+{
+	long i;
+
+	if (!nlatency)
+		return 0.0;
+	i = (long)(p * (nlatency - 1));
+	return latency[i];
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	struct sockaddr_in addr, hub;
+	struct rlimit rl;
+	char packet[256];
+	long complete = 0;
+	long missed = 0;
+	double start, deadline;
+	int port = 8080;
+	int opened = 0;
+	int refused;
+	int fd;
+	int i;
+
+	nclients = (argc > 1) ? atoi(argv[1]) : 1000;
+	nevents = (argc > 2) ? atoi(argv[2]) : 100;
+	if (argc > 3)
+		host = argv[3];
+	if (argc > 4)
+		port = atoi(argv[4]);
+	if ((nclients < 1) || (nevents < 1)) {
+		fprintf(stderr, "usage: %s [clients] [events] [host] [port]\n",
+				argv[0]);
+		return 1;
+	}
+
+	/* Room for every client plus a few of our own. */
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && (rl.rlim_cur < nclients + 16u)) {
+		rl.rlim_cur = (rl.rlim_max < nclients + 16u) ? rl.rlim_max :
+			nclients + 16u;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		fprintf(stderr, "%s is not an IPv4 address\n", host);
+		return 1;
+	}
+
+	memset(&hub, 0, sizeof(hub));
+	hub.sin_family = AF_INET;
+	hub.sin_port = htons(HUB_PORT);
+	hub.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	clients = calloc(nclients, sizeof(*clients));
+	sent_at = calloc(nevents, sizeof(*sent_at));
+	delivered = calloc(nevents, sizeof(*delivered));
+	latency = calloc((size_t)nclients * nevents, sizeof(*latency));
+	if (!clients || !sent_at || !delivered || !latency) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	epfd = epoll_create1(0);
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((epfd < 0) || (fd < 0)) {
+		perror("socket");
+		return 1;
+	}
+
+	if (!server_ready(fd, &hub, &addr)) {
+		fprintf(stderr, "Nothing listening on %s:%d\n", host, port);
+		return 1;
+	}
+
+	/* Get everyone streaming. */
+	start = now();
+	deadline = start + CONNECT_WAIT;
+	while (((opened < nclients) || connecting) && (now() < deadline)) {
+		while ((opened < nclients) && (connecting < CONNECTING_MAX))
+			client_open(&clients[opened++], &addr, host);
+		poll_clients(10);
+	}
+	printf("%d clients streaming, %d refused or closed, %d timed out, "
+			"%.2f s to connect\n", streaming, closed, connecting,
+			now() - start);
+	refused = closed;
+	if (!streaming)
+		return 1;
+
+	/* Send the events, reading as we go. */
+	start = now();
+	for (i = 0; i < nevents; i++) {
+		snprintf(packet, sizeof(packet), "{\"serial_number\":\"SK-00008453\","
+				"\"type\":\"rapid_wind\",\"hub_sn\":\"HB-00000001\","
+				"\"ob\":[%ld,2.3,128]}", SEQ_BASE + i);
+		sent_at[i] = now();
+		sendto(fd, packet, strlen(packet), 0, (struct sockaddr *)&hub,
+				sizeof(hub));
+
+		deadline = sent_at[i] + EVENT_GAP / 1000.0;
+		while (now() < deadline)
+			poll_clients((int)((deadline - now()) * 1000.0) + 1);
+	}
+
+	deadline = now() + DRAIN_WAIT / 1000.0;
+	while ((nlatency < (long)streaming * nevents) && (now() < deadline))
+		poll_clients(10);
+
+	for (i = 0; i < nevents; i++) {
+		if (delivered[i] >= streaming)
+			complete++;
+		missed += (delivered[i] < streaming) ? streaming - delivered[i] : 0;
+	}
+
+	qsort(latency, nlatency, sizeof(*latency), compare);
+	printf("%d events, %ld reached every client, %ld deliveries, "
+			"%ld missing, %d clients dropped\n", nevents, complete, nlatency,
+			missed, closed - refused);
+	printf("latency ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+			percentile(0.50), percentile(0.90), percentile(0.99),
+			percentile(1.0));
+
+	close(fd);
+	close(epfd);
+	for (i = 0; i < nclients; i++)
+		if (clients[i].state != STATE_CLOSED)
+			close(clients[i].fd);
+	free(clients);
+	free(sent_at);
+	free(delivered);
+	free(latency);
+	return 0;
+}
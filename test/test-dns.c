@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Host name cache test with a stub resolver.
+ *
+ * getaddrinfo() and freeaddrinfo() are replaced here, so the cache
+ * in wfp-dns.c is tested without a network: each stub name has its
+ * own behaviour and every query is counted. Covers hits and misses,
+ * IPv4 and IPv6 results with the port set, background prefetch,
+ * failures being cached, old addresses served while an expired name
+ * is refreshed, and lookups from several threads at once.
+ *
+ *   test/test-dns
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "wfp.h"
+
+#define TTL 2					/* seconds, short so expiry can be tested */
+
+int debug = 0;
+int verbose = 0;
+
+static int failures;
+static int queries_a;
+static int queries_b;
+static int queries_fail;
+static int queries_slow;
+
+/*
+ * Stub resolver.
+ *   a.example     192.0.2.1 and 2001:db8::1
+ *   b.example     192.0.2.n, n goes up by one each query
+ *   slow.example  192.0.2.9 after 300ms
+ *   anything else fails
+ */
+static struct addrinfo *stub_addr(int family, const char *text,
+		struct addrinfo *next)
+{
+	struct addrinfo *ai;
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+
+	ai = calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_in6));
+	ai->ai_family = family;
+	ai->ai_socktype = SOCK_STREAM;
+	ai->ai_addr = (struct sockaddr *)(ai + 1);
+	if (family == AF_INET) {
+		sin = (struct sockaddr_in *)ai->ai_addr;
+		sin->sin_family = AF_INET;
+		inet_pton(AF_INET, text, &sin->sin_addr);
+		ai->ai_addrlen = sizeof(struct sockaddr_in);
+	} else {
+		sin6 = (struct sockaddr_in6 *)ai->ai_addr;
+		sin6->sin6_family = AF_INET6;
+		inet_pton(AF_INET6, text, &sin6->sin6_addr);
+		ai->ai_addrlen = sizeof(struct sockaddr_in6);
+	}
+	ai->ai_next = next;
+	return ai;
+}
+
+int getaddrinfo(const char *node, const char *service,
+		const struct addrinfo *hints, struct addrinfo **res)
+{
+	char text[32];
+	int n;
+
+	if (strcmp(node, "a.example") == 0) {
+		__atomic_add_fetch(&queries_a, 1, __ATOMIC_RELAXED);
+		*res = stub_addr(AF_INET, "192.0.2.1",
+				stub_addr(AF_INET6, "2001:db8::1", NULL));
+		return 0;
+	}
+	if (strcmp(node, "b.example") == 0) {
+		n = __atomic_add_fetch(&queries_b, 1, __ATOMIC_RELAXED);
+		snprintf(text, sizeof(text), "192.0.2.%d", n);
+		*res = stub_addr(AF_INET, text, NULL);
+		return 0;
+	}
+	if (strcmp(node, "slow.example") == 0) {
+		__atomic_add_fetch(&queries_slow, 1, __ATOMIC_RELAXED);
+		usleep(300000);
+		*res = stub_addr(AF_INET, "192.0.2.9", NULL);
+		return 0;
+	}
+
+	__atomic_add_fetch(&queries_fail, 1, __ATOMIC_RELAXED);
+	return EAI_NONAME;
+}
+
+void freeaddrinfo(struct addrinfo *res)
+{
+	struct addrinfo *next;
+
+	while (res) {
+		next = res->ai_next;
+		free(res);
+		res = next;
+	}
+}
+
+static void check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok:  " : "FAIL:", what);
+	if (!ok)
+		failures++;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The IPv4 address in addr as text.
+ */
+static const char *ipv4(struct dns_addr *addr, char *buf)
+{
+	inet_ntop(AF_INET, &((struct sockaddr_in *)&addr->sa)->sin_addr, buf,
+			INET_ADDRSTRLEN);
+	return buf;
+}
+
+static void *lookup_thread(void *arg)
+{
+	struct dns_addr addr[DNS_MAX_ADDRS];
+	long bad = 0;
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		if (dns_lookup("a.example", 80, addr, DNS_MAX_ADDRS) != 2)
+			bad++;
+	}
+
+	return (void *)bad;
+}
+
+int main(void)
+{
+	struct dns_addr addr[DNS_MAX_ADDRS];
+	struct dns_stats st;
+	pthread_t threads[8];
+	char buf[INET6_ADDRSTRLEN];
+	void *bad;
+	long total = 0;
+	double start;
+	int count;
+	int i;
+
+	dns_start(TTL);
+
+	/* A miss, then a hit that doesn't query again */
+	count = dns_lookup("a.example", 80, addr, DNS_MAX_ADDRS);
+	check(count == 2, "a.example has two addresses");
+	check((addr[0].sa.ss_family == AF_INET) &&
+			(addr[1].sa.ss_family == AF_INET6), "IPv4 and IPv6");
+	check((ntohs(((struct sockaddr_in *)&addr[0].sa)->sin_port) == 80) &&
+			(ntohs(((struct sockaddr_in6 *)&addr[1].sa)->sin6_port) == 80),
+			"port set on both");
+	count = dns_lookup("a.example", 443, addr, 1);
+	check((count == 1) &&
+			(ntohs(((struct sockaddr_in *)&addr[0].sa)->sin_port) == 443),
+			"cached lookup limited to max, with its own port");
+	check(queries_a == 1, "second lookup answered from the cache");
+
+	/* Prefetched names are resolved without the caller waiting */
+	dns_prefetch("slow.example");
+	usleep(500000);
+	start = now();
+	count = dns_lookup("slow.example", 80, addr, DNS_MAX_ADDRS);
+	check((count == 1) && (now() - start < 0.1),
+			"prefetched name doesn't wait on the resolver");
+
+	/* Failures are remembered for a while */
+	count = dns_lookup("nowhere.example", 80, addr, DNS_MAX_ADDRS);
+	count += dns_lookup("nowhere.example", 80, addr, DNS_MAX_ADDRS);
+	check((count == 0) && (queries_fail == 1), "failure is cached");
+
+	/* A name in use is refreshed in the background as it expires */
+	dns_lookup("b.example", 80, addr, DNS_MAX_ADDRS);
+	check(strcmp(ipv4(&addr[0], buf), "192.0.2.1") == 0, "b.example first query");
+	usleep((TTL + 1) * 1000000 + 500000);
+	check(queries_b == 2, "name in use refreshed before it's needed");
+
+	/* One that isn't keeps its old address until it's looked up */
+	sleep(TTL + 1);
+	check(queries_b == 2, "unused name left to expire");
+	start = now();
+	dns_lookup("b.example", 80, addr, DNS_MAX_ADDRS);
+	check((strcmp(ipv4(&addr[0], buf), "192.0.2.2") == 0) &&
+			(now() - start < 0.1), "expired name served from the cache");
+	usleep(1500000);
+	dns_lookup("b.example", 80, addr, DNS_MAX_ADDRS);
+	check(strcmp(ipv4(&addr[0], buf), "192.0.2.3") == 0,
+			"then refreshed in the background");
+
+	/* Lots of lookups from several threads at once */
+	for (i = 0; i < 8; i++)
+		pthread_create(&threads[i], NULL, lookup_thread, NULL);
+	for (i = 0; i < 8; i++) {
+		pthread_join(threads[i], &bad);
+		total += (long)bad;
+	}
+	check(total == 0, "80000 lookups from 8 threads");
+
+	dns_stats(&st);
+	printf("hits %lu misses %lu refreshes %lu failures %lu entries %d\n",
+			st.hits, st.misses, st.refreshes, st.failures, st.entries);
+	check((st.misses == 3) && (st.entries == 4),
+			"one miss per name that wasn't prefetched");
+
+	dns_stop();
+
+	if (failures)
+		printf("%d FAILED\n", failures);
+	return failures ? 1 : 0;
+}
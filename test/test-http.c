@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * HTTP client test against a mock server.
+ *
+ * A small server on a loopback port answers the way the upload sites
+ * can: keep-alive responses, chunked bodies, errors, closing the
+ * connection with and without saying so, and dropping a request
+ * without an answer. Each case checks the status http_get() returns
+ * and whether the connection was reused. Then it times uploads on a
+ * kept connection against a new connection for each.
+ *
+ *   test/test-http [uploads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "wfp.h"
+
+int debug = 0;
+int verbose = 0;
+
+static int listen_fd;
+static int port;
+static int connections;			/* accepted by the mock server */
+static int dropped;				/* "drop" requests not answered yet */
+static int failures;
+
+static const char ok[] =
+	"HTTP/1.1 200 OK\r\nContent-Length: 7\r\n\r\nsuccess";
+static const char chunked[] =
+	"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+	"4\r\nsucc\r\n3\r\ness\r\n0\r\n\r\n";
+static const char unavailable[] =
+	"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 4\r\n\r\nbusy";
+static const char closing[] =
+	"HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 7\r\n\r\nsuccess";
+
+/*
+ * Read one request's headers. Returns 0 at end of file.
+ */
+static int read_request(int fd, char *buf, int size)
+{
+	int len = 0;
+	int n;
+
+	while (len < size - 1) {
+		n = recv(fd, buf + len, size - 1 - len, 0);
+		if (n <= 0)
+			return 0;
+		len += n;
+		buf[len] = '\0';
+		if (strstr(buf, "\r\n\r\n"))
+			return len;
+	}
+
+	return 0;
+}
+
+/*
+ * The path says how to answer:
+ *   /ok, /chunked, /fail  answer and keep the connection
+ *   /close                answer with "Connection: close" and close
+ *   /idle                 answer, then close without saying so
+ *   /drop                 close without answering, the first time
+ */
+static void *mock_server(void *arg)
+{
+	char buf[2048];
+	const char *reply;
+	int fd;
+	int end;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		__atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+		while (read_request(fd, buf, sizeof(buf))) {
+			end = 0;
+			if (strncmp(buf, "GET /chunked ", 13) == 0) {
+				reply = chunked;
+			} else if (strncmp(buf, "GET /fail ", 10) == 0) {
+				reply = unavailable;
+			} else if (strncmp(buf, "GET /close ", 11) == 0) {
+				reply = closing;
+				end = 1;
+			} else if (strncmp(buf, "GET /idle ", 10) == 0) {
+				reply = ok;
+				end = 1;
+			} else if ((strncmp(buf, "GET /drop ", 10) == 0) &&
+					__atomic_load_n(&dropped, __ATOMIC_RELAXED)) {
+				__atomic_sub_fetch(&dropped, 1, __ATOMIC_RELAXED);
+				break;
+			} else {
+				reply = ok;
+			}
+			if (send(fd, reply, strlen(reply), MSG_NOSIGNAL) < 0)
+				break;
+			if (end)
+				break;
+		}
+		close(fd);
+	}
+
+	return NULL;
+}
+
+static void start_server(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((listen_fd < 0) ||
+			bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(listen_fd, 16) ||
+			getsockname(listen_fd, (struct sockaddr *)&addr, &len)) {
+		perror("mock server");
+		exit(1);
+	}
+	port = ntohs(addr.sin_port);
+
+	pthread_create(&thread, NULL, mock_server, NULL);
+	pthread_detach(thread);
+}
+
+/*
+ * Upload path and check the status and how many new connections
+ * it took.
+ */
+static void expect(struct http_conn *c, const char *path, int status,
+		int new_connections)
+{
+	int before = __atomic_load_n(&connections, __ATOMIC_RELAXED);
+	int got;
+	int opened;
+
+	got = http_get(c, path, "wfp-test");
+	opened = __atomic_load_n(&connections, __ATOMIC_RELAXED) - before;
+
+	if ((got != status) || (opened != new_connections)) {
+		printf("FAIL: %-8s status %d (want %d), %d new connections "
+				"(want %d)\n", path, got, status, opened, new_connections);
+		failures++;
+	} else {
+		printf("ok:   %-8s status %d, %d new connections\n", path, got,
+				opened);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	struct http_conn *c;
+	double start, kept, fresh;
+	int uploads = 2000;
+	int i;
+
+	if (argc > 1)
+		uploads = atoi(argv[1]);
+
+	dns_start(0);
+	start_server();
+
+	c = http_open("127.0.0.1", port);
+	expect(c, "ok", 200, 1);
+	expect(c, "ok", 200, 0);
+	expect(c, "chunked", 200, 0);
+	expect(c, "ok", 200, 0);
+	expect(c, "fail", 503, 0);
+	expect(c, "ok", 200, 0);
+	expect(c, "close", 200, 0);
+	expect(c, "ok", 200, 1);
+	expect(c, "idle", 200, 0);
+	usleep(50000);			/* let the close arrive */
+	expect(c, "ok", 200, 1);
+	dropped = 1;
+	expect(c, "drop", 200, 1);
+	expect(c, "ok", 200, 0);
+	http_close(c);
+
+	/* Latency per upload, keeping the connection and not */
+	c = http_open("127.0.0.1", port);
+	start = now();
+	for (i = 0; i < uploads; i++)
+		http_get(c, "ok", "wfp-test");
+	kept = now() - start;
+	http_close(c);
+
+	start = now();
+	for (i = 0; i < uploads; i++) {
+		c = http_open("127.0.0.1", port);
+		http_get(c, "ok", "wfp-test");
+		http_close(c);
+	}
+	fresh = now() - start;
+
+	printf("%d uploads: %.1f usec each kept open, %.1f usec with a new "
+			"connection each\n", uploads, kept / uploads * 1e6,
+			fresh / uploads * 1e6);
+
+	dns_stop();
+
+	if (failures)
+		printf("%d FAILED\n", failures);
+	return failures ? 1 : 0;
+}
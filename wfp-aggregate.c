@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Windowed aggregation of weather samples.
+ *
+ * A service can ask for the average of the last N seconds of data
+ * (its "window") rather than the latest sample. CWOP, for example,
+ * wants a 10 minute average every 10 minutes.
+ *
+ * Each field has a way of being combined: averaged, the maximum,
+ * the latest value, or, for wind direction, a vector average
+ * weighted by wind speed so that 350 and 10 degrees average to
+ * north and not south.
+ *
+ * The window is split into a fixed number of buckets. Samples are
+ * added to the current bucket, and old buckets are simply reused as
+ * time moves on, so adding a sample is O(1) and the memory used
+ * doesn't depend on the window size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "wfp.h"
+
+extern int debug;
+
+#define AGG_BUCKETS 10
+
+enum agg_kind {
+	AGG_LAST,		/* value from the latest sample */
+	AGG_MEAN,		/* average over the window */
+	AGG_MAX,		/* highest value in the window */
+	AGG_AT_MAX,		/* value from the sample where ref was highest */
+	AGG_VECTOR		/* direction, vector averaged and weighted by ref */
+};
+
+#define NO_REF -1
+
+static const struct {
+	enum wd_field field;
+	enum agg_kind kind;
+	int ref;				/* field, or NO_REF */
+} agg_fields[] = {
+	{ WD_PRESSURE,           AGG_MEAN,   NO_REF },
+	{ WD_PRESSURE_SEALEVEL,  AGG_MEAN,   NO_REF },
+	{ WD_TEMPERATURE,        AGG_MEAN,   NO_REF },
+	{ WD_HUMIDITY,           AGG_MEAN,   NO_REF },
+	{ WD_WINDSPEED,          AGG_MEAN,   NO_REF },
+	{ WD_WINDDIRECTION,      AGG_VECTOR, WD_WINDSPEED },
+	{ WD_GUSTSPEED,          AGG_MAX,    NO_REF },
+	{ WD_GUSTDIRECTION,      AGG_AT_MAX, WD_GUSTSPEED },
+	{ WD_ILLUMINATION,       AGG_MEAN,   NO_REF },
+	{ WD_DISTANCE,           AGG_LAST,   NO_REF },
+	{ WD_SOLAR,              AGG_MEAN,   NO_REF },
+	{ WD_UV,                 AGG_MEAN,   NO_REF },
+	{ WD_RAIN,               AGG_LAST,   NO_REF },
+	{ WD_DEWPOINT,           AGG_MEAN,   NO_REF },
+	{ WD_HEATINDEX,          AGG_MEAN,   NO_REF },
+	{ WD_WINDCHILL,          AGG_MEAN,   NO_REF },
+	{ WD_FEELSLIKE,          AGG_MEAN,   NO_REF },
+};
+
+#define AGG_FIELDS (sizeof(agg_fields) / sizeof(agg_fields[0]))
+
+/*
+ * Running statistics for one field. For AGG_MEAN a is the sum, for
+ * AGG_MAX it's the maximum. For AGG_AT_MAX a is the value and b the
+ * ref value it was taken at. For AGG_VECTOR a and b are the summed
+ * east and north components.
+ */
+struct agg_stat {
+	double a;
+	double b;
+};
+
+struct agg_bucket {
+	long slot;			/* time / width when this bucket was filled */
+	int count;
+	struct agg_stat stat[AGG_FIELDS];
+};
+
+/*
+ * One extra bucket so that a window that ends on a bucket boundary
+ * still covers the full window.
+ */
+struct aggregate {
+	int width;			/* seconds per bucket */
+	int span;			/* buckets in the window */
+	struct agg_bucket bucket[AGG_BUCKETS + 1];
+	struct wd_snapshot *last;
+};
+
+/*
+ * Fold one sample (or one bucket's worth of samples) into stat.
+ */
+static void stat_merge(struct agg_stat *st, int count, unsigned int i,
+		double a, double b)
+{
+	switch (agg_fields[i].kind) {
+		case AGG_MEAN:
+		case AGG_VECTOR:
+			st->a += a;
+			st->b += b;
+			break;
+		case AGG_MAX:
+			if ((count == 0) || (a > st->a))
+				st->a = a;
+			break;
+		case AGG_AT_MAX:
+			if ((count == 0) || (b > st->b)) {
+				st->a = a;
+				st->b = b;
+			}
+			break;
+		case AGG_LAST:
+			break;
+	}
+}
+
+/*
+ * Add a sample to the service's window.
+ */
+void aggregate_add(struct service_info *s, struct wd_snapshot *snap)
+{
+	struct aggregate *agg = s->agg;
+	struct agg_bucket *b;
+	time_t now = time(NULL);
+	double v, r;
+	long slot;
+	unsigned int i;
+
+	if (!agg) {
+		agg = calloc(1, sizeof(struct aggregate));
+		if (!agg) {
+			fprintf(stderr, "Failed to allocate aggregate for %s\n",
+					s->service);
+			return;
+		}
+		agg->width = (s->window + AGG_BUCKETS - 1) / AGG_BUCKETS;
+		if (agg->width < 1)
+			agg->width = 1;
+		agg->span = (s->window + agg->width - 1) / agg->width;
+		s->agg = agg;
+	}
+
+	slot = now / agg->width;
+	b = &agg->bucket[slot % (AGG_BUCKETS + 1)];
+	if (b->slot != slot) {
+		memset(b, 0, sizeof(struct agg_bucket));
+		b->slot = slot;
+	}
+
+	for (i = 0; i < AGG_FIELDS; i++) {
+		v = snap->data->value[agg_fields[i].field];
+		r = (agg_fields[i].ref != NO_REF) ?
+				snap->data->value[agg_fields[i].ref] : 0;
+
+		if (agg_fields[i].kind == AGG_VECTOR)
+			stat_merge(&b->stat[i], b->count, i,
+					r * sin(v * M_PI / 180), r * cos(v * M_PI / 180));
+		else
+			stat_merge(&b->stat[i], b->count, i, v, r);
+	}
+	b->count++;
+
+	if (agg->last)
+		snapshot_put(agg->last);
+	agg->last = snapshot_hold(snap);
+}
+
+/*
+ * Build the aggregate of the service's window and queue it for the
+ * service. If nothing came in during the window, there's nothing
+ * to send.
+ */
+void aggregate_send(struct service_info *s)
+{
+	struct aggregate *agg = s->agg;
+	struct agg_stat total[AGG_FIELDS];
+	struct agg_bucket *b;
+	struct wd_snapshot *snap;
+	weather_data_t wd;
+	long slot;
+	int count = 0;
+	double deg;
+	unsigned int i;
+	int j;
+
+	if (!agg || !agg->last) {
+		if (debug)
+			printf("** Skipping %s send, no data\n", s->service);
+		return;
+	}
+
+	memset(total, 0, sizeof(total));
+	slot = time(NULL) / agg->width;
+	for (j = 0; j <= AGG_BUCKETS; j++) {
+		b = &agg->bucket[j];
+		if ((b->count == 0) || (b->slot < slot - agg->span) ||
+				(b->slot > slot))
+			continue;
+
+		for (i = 0; i < AGG_FIELDS; i++)
+			stat_merge(&total[i], count, i, b->stat[i].a, b->stat[i].b);
+		count += b->count;
+	}
+
+	if (count == 0) {
+		if (debug)
+			printf("** Skipping %s send, no data in window\n", s->service);
+		return;
+	}
+
+	/* Start from the latest sample and fill in the aggregates */
+	wd = *agg->last->data;
+	for (i = 0; i < AGG_FIELDS; i++) {
+		switch (agg_fields[i].kind) {
+			case AGG_MEAN:
+				wd.value[agg_fields[i].field] = total[i].a / count;
+				break;
+			case AGG_MAX:
+			case AGG_AT_MAX:
+				wd.value[agg_fields[i].field] = total[i].a;
+				break;
+			case AGG_VECTOR:
+				/* If it was calm the whole time, keep the last direction */
+				if ((total[i].a != 0) || (total[i].b != 0)) {
+					deg = atan2(total[i].a, total[i].b) * 180 / M_PI;
+					if (deg < 0)
+						deg += 360;
+					wd.value[agg_fields[i].field] = deg;
+				}
+				break;
+			case AGG_LAST:
+				break;
+		}
+	}
+	strncpy(wd.wind_dir, DegreesToCardinal(wd.winddirection), 3);
+
+	snap = snapshot_create(&wd, UNITS_BIT(s->units));
+	if (snap) {
+		send_to(s, snap);
+		snapshot_put(snap);
+	}
+}
+
+void aggregate_free(struct service_info *s)
+{
+	if (!s->agg)
+		return;
+
+	if (s->agg->last)
+		snapshot_put(s->agg->last);
+	free(s->agg);
+	s->agg = NULL;
+}
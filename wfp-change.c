@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Change detection.
+ *
+ * Each service remembers the last values it sent. Before a sample
+ * is handed to the service's update function it's compared with
+ * them and every field that has moved by more than its deadband
+ * gets its bit set in the "changed" mask (WD_BIT(WD_TEMPERATURE)
+ * etc.). Publishers can use the mask to only send what changed, and
+ * services with "skip_unchanged" aren't called at all when nothing
+ * did.
+ *
+ * Deadbands are in metric units, whatever units the service sends.
+ * The defaults are in the field list (wfp.h) and they can be set
+ * per service with a "deadband" object, i.e.
+ * "deadband" : { "temperature" : 0.5 }. The tower sensors are
+ * covered by a single bit ("sensors"), set when any of their values
+ * change.
+ *
+ * The last sent values are only updated when the service says the
+ * send worked, so a value that creeps up in steps smaller than the
+ * deadband is still sent once it has moved far enough.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cJSON.h"
+#include "wfp.h"
+
+struct change_state {
+	int valid;				/* something has been sent */
+	double deadband[WD_FIELDS];
+	double last[WD_FIELDS];
+	double pending[WD_FIELDS];
+	uint64_t pending_mask;
+};
+
+/*
+ * The tower sensors don't have fields of their own, a checksum of
+ * their values stands in for them.
+ */
+static double sensors_sum(const weather_data_t *wd)
+{
+	struct sensor_list *list;
+	uint32_t sum = 0;
+	double v[4];
+
+	for (list = wd->tower_list; list; list = list->next) {
+		v[0] = list->sensor->temperature;
+		v[1] = list->sensor->humidity;
+		v[2] = list->sensor->temperature_high;
+		v[3] = list->sensor->temperature_low;
+		sum ^= checksum(list->sensor->location,
+				strlen(list->sensor->location));
+		sum = sum * 31 + checksum(v, sizeof(v));
+	}
+
+	return sum;
+}
+
+/*
+ * Create the change state for a service, reading its deadbands.
+ */
+struct change_state *change_create(struct cfg_info *cfg)
+{
+	struct change_state *cs;
+	cJSON *bands, *item;
+	int i;
+
+	cs = calloc(1, sizeof(struct change_state));
+	if (!cs)
+		return NULL;
+
+	for (i = 0; i < WD_VALUES; i++)
+		cs->deadband[i] = wd_fields[i].deadband;
+
+	bands = cJSON_GetObjectItemCaseSensitive(cfg->options, "deadband");
+	cJSON_ArrayForEach(item, bands) {
+		if (strcmp(item->string, "sensors") == 0)
+			i = WD_SENSORS;
+		else if ((i = wd_field_lookup(item->string)) < 0) {
+			fprintf(stderr, "Unknown field %s in deadband\n", item->string);
+			continue;
+		}
+		if (cJSON_IsNumber(item))
+			cs->deadband[i] = item->valuedouble;
+	}
+
+	return cs;
+}
+
+void change_free(struct change_state *cs)
+{
+	free(cs);
+}
+
+/*
+ * Compare a sample with what was last sent and return the mask of
+ * fields that changed. Everything has changed if nothing has been
+ * sent yet.
+ */
+uint64_t change_detect(struct change_state *cs, const weather_data_t *wd)
+{
+	uint64_t mask = 0;
+	double v, l;
+	int i;
+
+	for (i = 0; i < WD_VALUES; i++) {
+		v = wd->value[i];
+		l = cs->last[i];
+		cs->pending[i] = v;
+		if (isnan(v) || isnan(l)) {
+			if (isnan(v) != isnan(l))
+				mask |= WD_BIT(i);
+		} else if (fabs(v - l) > cs->deadband[i]) {
+			mask |= WD_BIT(i);
+		}
+	}
+
+	cs->pending[WD_SENSORS] = sensors_sum(wd);
+	if (cs->pending[WD_SENSORS] != cs->last[WD_SENSORS])
+		mask |= WD_BIT(WD_SENSORS);
+
+	if (!cs->valid)
+		mask = WD_ALL;
+
+	cs->pending_mask = mask;
+	return mask;
+}
+
+/*
+ * The sample last passed to change_detect() was sent. Remember the
+ * fields that changed as the new baseline.
+ */
+void change_commit(struct change_state *cs)
+{
+	int i;
+
+	for (i = 0; i < WD_FIELDS; i++) {
+		if (cs->pending_mask & WD_BIT(i))
+			cs->last[i] = cs->pending[i];
+	}
+	cs->valid = 1;
+	cs->pending_mask = 0;
+}
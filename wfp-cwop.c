@@ -20,6 +20,7 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -29,69 +30,138 @@
 #include <netdb.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <math.h>
 #include "wfp.h"
 
-extern void send_url(char *host, int port, char *url, char *ident, int resp);
+#define APRS_PORT 14580
+#define APRS_TIMEOUT 10000	/* msec to wait for the server */
 
 extern int debug;
 extern int verbose;
 
-static weather_data_t ws;
-static int count = 0;
+static int aprs_fd = -1;
+
+static void aprs_close(void)
+{
+	if (aprs_fd >= 0)
+		close(aprs_fd);
+	aprs_fd = -1;
+}
+
+/*
+ * Read a line from the server, waiting up to APRS_TIMEOUT. The
+ * server only sends short lines so this reads a byte at a time
+ * rather than buffering across lines.
+ */
+static int aprs_readline(char *line, int len)
+{
+	struct pollfd pfd;
+	int n = 0;
+	int ret;
+
+	pfd.fd = aprs_fd;
+	pfd.events = POLLIN;
+
+	while (n < len - 1) {
+		ret = poll(&pfd, 1, APRS_TIMEOUT);
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret <= 0)
+			return -1;
+		if (recv(aprs_fd, &line[n], 1, 0) != 1)
+			return -1;
+		if (line[n] == '\n')
+			break;
+		n++;
+	}
+
+	line[n] = '\0';
+	if ((n > 0) && (line[n - 1] == '\r'))
+		line[n - 1] = '\0';
+	return n;
+}
+
+/*
+ * Connect to the APRS-IS server and log in. The server sends a
+ * banner, then answers the login with a "# logresp" line. Once that
+ * arrives the server will accept packets.
+ */
+static int aprs_login(struct cfg_info *cfg)
+{
+	char line[512];
+
+	/* The socket is non-blocking, the login and reports are small */
+	aprs_fd = tcp_connect(cfg->host, APRS_PORT, APRS_TIMEOUT);
+	if (aprs_fd < 0)
+		return -1;
+
+	snprintf(line, sizeof(line),
+			"user %s pass -1 vers linux-acu-link 1.00\r\n", cfg->name);
+	if (send(aprs_fd, line, strlen(line), MSG_NOSIGNAL) < 0)
+		goto fail;
+
+	/* Skip the banner and any other comments until the response */
+	while (aprs_readline(line, sizeof(line)) >= 0) {
+		if (verbose > 1)
+			fprintf(stderr, "CWOP: %s\n", line);
+		if (strncmp(line, "# logresp", 9) == 0)
+			return 0;
+	}
+
+	fprintf(stderr, "ERROR: CWOP login to %s failed\n", cfg->host);
+fail:
+	aprs_close();
+	return -1;
+}
+
+/*
+ * Is the session still open? The server sends "#" comment lines as
+ * keepalives while we're idle, read and discard them. If the server
+ * has closed the connection, we'll see that here.
+ */
+static int aprs_alive(void)
+{
+	char buf[1024];
+	int n;
+
+	while ((n = recv(aprs_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+		;
+
+	return ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)));
+}
 
 /*
  * CWOP publisher
  *
  * Unlike other services, publishing to CWOP involves sending a
  * formated string directly over tcp.  Not http protocol invloved.
+ * We log in to an APRS-IS server, wait for it to accept the login
+ * and send the packet. With "keepalive" set the session is kept
+ * open for the next send instead of logging in each time.
  *
  * CWOP also limits the frequency that data can be sent to a
- * minimum of 10 minutes.  This will batch up the request
- * and send 'average' data at 10 minute intervals.
+ * minimum of 10 minutes.  The service is scheduled every 10
+ * minutes and is sent the 'average' data for the interval.
  */
-void send_to_cwop(struct cfg_info *cfg, struct station_info *station,
-				weather_data_t *wd)
+int send_to_cwop(struct cfg_info *cfg, struct station_info *station,
+				const weather_data_t *wd, uint64_t changed)
 {
 	char *request;
 	struct timeval start, end;
 	char *ts_start, *ts_end;
-	time_t t = time(NULL);
-	struct tm* lt = localtime(&t);
-	struct tm* gm = gmtime(&t);
+	time_t t = wd->time ? wd->time : time(NULL);
+	struct tm gm;
 	int humidity;
-	char ident[50];
+	int ret = -1;
 
 	/*
 	 * CWOP wants data in SI untis, except for pressure which is in
-	 * 10ths of millibars.
+	 * 10ths of millibars. The data comes in those units, see
+	 * cwop_setup().
 	 */
-	unit_convert(wd, NO_PRESSURE);
-
-	/* First, is it time to send? */
-	if ((lt->tm_min % 10) != 0) {
-		/* would like to create average */
-		ws.pressure += (wd->pressure * 10); /*  1/10ths of millibars */
-		ws.windspeed += wd->windspeed;
-		ws.winddirection += wd->winddirection;
-		ws.temperature += wd->temperature;
-		ws.humidity += wd->humidity;
-		ws.solar += wd->solar;
-		if (wd->gustspeed > ws.gustspeed)
-			ws.gustspeed = wd->gustspeed;
-		ws.rainfall_1hr = wd->rainfall_1hr;
-		ws.rainfall_day = wd->rainfall_day;
-		count++;
-		pthread_exit(NULL);
-		return;
-	}
-
-	/* ignore case where first data comes right on 10 minute */
-	if (count == 0) {
-		printf("** Skipping CWOP send, count == 0\n");
-		pthread_exit(NULL);
-		return;
-	}
+	gmtime_r(&t, &gm);
 
 	gettimeofday(&start, NULL);
 
@@ -102,7 +172,7 @@ void send_to_cwop(struct cfg_info *cfg, struct station_info *station,
 	}
 
 	/* Humidity needs some special handling */
-	humidity = (int)round(ws.humidity / count);
+	humidity = (int)round(wd->humidity);
 	if (humidity == 100)
 		humidity = 0;
 
@@ -126,33 +196,39 @@ void send_to_cwop(struct cfg_info *cfg, struct station_info *station,
 			"400\r\n",  /* hardware type */
 
 			cfg->name,
-			gm->tm_mday, gm->tm_hour, gm->tm_min,
+			gm.tm_mday, gm.tm_hour, gm.tm_min,
 			station->latitude, station->longitude,
-			(int)round(ws.winddirection / count),
-			(int)round(ws.windspeed / count),
-			(int)round(ws.gustspeed),
-			(int)round(ws.temperature / count),
-			(int)round(ws.rainfall_1hr * 100),
-			(int)round(ws.rainfall_day * 100),
+			(int)round(wd->winddirection),
+			(int)round(wd->windspeed),
+			(int)round(wd->gustspeed),
+			(int)round(wd->temperature),
+			(int)round(wd->rainfall_1hr * 100),
+			(int)round(wd->rainfall_day * 100),
 			humidity,
-			(int)round(ws.pressure / count),
-			(int)round(ws.solar / count)
+			(int)round(wd->pressure * 10), /*  1/10ths of millibars */
+			(int)round(wd->solar)
 			);
 
 	if (verbose > 1)
 		fprintf(stderr, "CWOP: %s\n", request);
 
+	/* Log in, unless we kept the last session open */
+	if ((aprs_fd >= 0) && !aprs_alive())
+		aprs_close();
+	if ((aprs_fd >= 0) || (aprs_login(cfg) == 0)) {
+		if (send(aprs_fd, request, strlen(request), MSG_NOSIGNAL) < 0) {
+			fprintf(stderr, "ERROR: CWOP send failed: %m\n");
+			aprs_close();
+		} else {
+			ret = 0;
+		}
+	}
 
-	sprintf(ident, "user %s pass -1 vers linux-acu-link 1.00\r\n", cfg->name);
-	send_url(cfg->host, 14580, request, ident, 0);
+	if (!cfg_int(cfg, "keepalive", 0))
+		aprs_close();
 
-	/* Open a socket and send the data */
 	free(request);
 
-	/* Clear data */
-	count = 0;
-	memset(&ws, 0, sizeof(weather_data_t));
-
 	gettimeofday(&end, NULL);
 	if (verbose || debug) {
 		long diff;
@@ -166,18 +242,45 @@ void send_to_cwop(struct cfg_info *cfg, struct station_info *station,
 		free(ts_end);
 	}
 
-	return;
+	return ret;
+}
+
+static void cwop_cleanup(void)
+{
+	aprs_close();
 }
 
 static const struct publisher_funcs cwop_funcs = {
 	.init = NULL,
 	.update = send_to_cwop,
-	.cleanup = NULL
+	.cleanup = cwop_cleanup
 };
 
 void cwop_setup(struct service_info *sinfo)
 {
 	sinfo->funcs = cwop_funcs;
+	sinfo->units = UNITS_CWOP;
+
+	/* CWOP wants data no more often than every 10 minutes */
+	if (sinfo->interval < 0)
+		sinfo->interval = 600;
+	if (sinfo->align < 0)
+		sinfo->align = 1;
+
+	/*
+	 * Keep reports that fail, but don't flood APRS-IS with the
+	 * backlog when it's back, replayed reports count against the
+	 * same 10 minutes.
+	 */
+	if (sinfo->spool < 0)
+		sinfo->spool = 1;
+	if (sinfo->replay_interval <= 0)
+		sinfo->replay_interval = (sinfo->interval > 600) ?
+			sinfo->interval : 600;
+
+	/* Look the host up ahead of the first report, if it's going to be used */
+	if (sinfo->enabled)
+		dns_prefetch(sinfo->cfg.host);
 	return;
 }
 
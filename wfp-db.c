@@ -30,34 +30,246 @@
 #include <netdb.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <math.h>
 #include <mysql/mysql.h>
 #include "wfp.h"
 
 extern char *time_stamp(int gmt, int mode);
 
+#define DB_MAX_BATCH 64			/* most rows held waiting for the database */
+#define DB_BACKOFF_MIN 5		/* seconds before the first reconnect */
+#define DB_BACKOFF_MAX 300
+
+static const struct {
+	const char *column;
+	enum wd_field field;
+} db_columns[] = {
+	{ "pressure",       WD_PRESSURE },
+	{ "temperature",    WD_TEMPERATURE },
+	{ "humidity",       WD_HUMIDITY },
+	{ "windspeed",      WD_WINDSPEED },
+	{ "winddirection",  WD_WINDDIRECTION },
+	{ "gustspeed",      WD_GUSTSPEED },
+	{ "gustdirection",  WD_GUSTDIRECTION },
+	{ "rainfall_1min",  WD_RAIN },
+	{ "rainfall_1hr",   WD_RAINFALL_1HR },
+	{ "rainfall_day",   WD_RAINFALL_DAY },
+	{ "rainfall_month", WD_RAINFALL_MONTH },
+	{ "rainfall_year",  WD_RAINFALL_YEAR },
+	{ "dewpoint",       WD_DEWPOINT },
+	{ "heatindex",      WD_HEATINDEX },
+};
+
+#define DB_COLUMNS (sizeof(db_columns) / sizeof(db_columns[0]))
+#define DB_PARAMS (DB_COLUMNS + 1)	/* and the observation time, if stored */
+
 static int debug;
 
+/*
+ * The connection and statements belong to the mysql service's send
+ * thread, they're only touched from send_to_db() and db_cleanup().
+ */
+static struct cfg_info *db_cfg;
+static MYSQL *sql = NULL;
+static MYSQL_STMT *batch_stmt = NULL;	/* inserts batch_size rows */
+static MYSQL_STMT *row_stmt = NULL;		/* inserts one row */
+static MYSQL_BIND binds[DB_MAX_BATCH * DB_PARAMS];
+static double rows[DB_MAX_BATCH][DB_COLUMNS];
+static long long row_time[DB_MAX_BATCH];
+static int nrows = 0;
+static int batch_size = 1;
+static const char *time_column = NULL;
+static unsigned int nparams = DB_COLUMNS;	/* binds per row */
+static int backoff = 0;
+static time_t retry_at = 0;
+
 static int db_query(MYSQL *sql, char *query_str, char *msg);
 static int connect_to_database(MYSQL *sql, char *db_host, char *db_name,
 		char *db_user, char *db_pass);
 
+/*
+ * Prepare "insert into weather_log (...) values (?,...),(?,...)" for
+ * count rows. The parameters are bound straight to the rows buffer,
+ * with "time_column" set the last one in each row is the time the
+ * sample was taken.
+ */
+static MYSQL_STMT *db_prepare(int count)
+{
+	MYSQL_STMT *stmt;
+	char *query;
+	char *p;
+	unsigned int i;
+	int r;
+
+	query = malloc(64 + (time_column ? strlen(time_column) : 0) +
+			DB_COLUMNS * 20 +
+			count * (DB_COLUMNS * 2 + 20));
+	if (!query)
+		return NULL;
+
+	p = query + sprintf(query, "insert into weather_log (");
+	for (i = 0; i < DB_COLUMNS; i++)
+		p += sprintf(p, "%s%s", i ? "," : "", db_columns[i].column);
+	if (time_column)
+		p += sprintf(p, ",%s", time_column);
+	p += sprintf(p, ") values ");
+	for (r = 0; r < count; r++) {
+		p += sprintf(p, "%s(", r ? "," : "");
+		for (i = 0; i < DB_COLUMNS; i++)
+			p += sprintf(p, "%s?", i ? "," : "");
+		p += sprintf(p, "%s)", time_column ? ",from_unixtime(?)" : "");
+	}
+
+	stmt = mysql_stmt_init(sql);
+	if (stmt && mysql_stmt_prepare(stmt, query, strlen(query))) {
+		fprintf(stderr, "Failed to prepare insert: %s\n",
+				mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		stmt = NULL;
+	}
+
+	free(query);
+	return stmt;
+}
+
+static void db_disconnect(void)
+{
+	if (batch_stmt)
+		mysql_stmt_close(batch_stmt);
+	if (row_stmt)
+		mysql_stmt_close(row_stmt);
+	if (sql)
+		mysql_close(sql);
+	batch_stmt = NULL;
+	row_stmt = NULL;
+	sql = NULL;
+}
+
+/*
+ * Connection failed, wait a bit longer each time before trying
+ * again.
+ */
+static void db_retry_later(void)
+{
+	db_disconnect();
+
+	backoff = backoff ? backoff * 2 : DB_BACKOFF_MIN;
+	if (backoff > DB_BACKOFF_MAX)
+		backoff = DB_BACKOFF_MAX;
+	retry_at = time(NULL) + backoff;
+
+	fprintf(stderr, "Database unavailable, retrying in %d seconds "
+			"(%d rows waiting)\n", backoff, nrows);
+}
+
+static int db_connect(void)
+{
+	if ((sql = mysql_init(NULL)) == NULL) {
+		fprintf(stderr, "Failed to initialize MySQL interface.\n");
+		return -1;
+	}
+
+	if (!connect_to_database(sql, db_cfg->host, db_cfg->extra, db_cfg->name,
+				db_cfg->pass))
+		goto fail;
+
+	/* Rows are written in transactions, see db_flush() */
+	mysql_autocommit(sql, 0);
+
+	row_stmt = db_prepare(1);
+	if (!row_stmt)
+		goto fail;
+	if (batch_size > 1) {
+		batch_stmt = db_prepare(batch_size);
+		if (!batch_stmt)
+			goto fail;
+	}
+
+	backoff = 0;
+	return 0;
+
+fail:
+	db_retry_later();
+	return -1;
+}
+
+/*
+ * Write the waiting rows in one transaction. Full batches go as
+ * multi-row inserts, anything left over a row at a time. If anything
+ * fails, the rows are kept and written after reconnecting.
+ */
+static int db_flush(void)
+{
+	MYSQL_STMT *stmt = batch_stmt;
+	int i = 0;
+
+	while (batch_stmt && (nrows - i >= batch_size)) {
+		if (mysql_stmt_bind_param(stmt, &binds[i * nparams]) ||
+				mysql_stmt_execute(stmt))
+			goto fail;
+		i += batch_size;
+	}
+
+	stmt = row_stmt;
+	for (; i < nrows; i++) {
+		if (mysql_stmt_bind_param(stmt, &binds[i * nparams]) ||
+				mysql_stmt_execute(stmt))
+			goto fail;
+	}
+
+	if (mysql_commit(sql)) {
+		fprintf(stderr, "Failed to commit records: %s\n", mysql_error(sql));
+		db_retry_later();
+		return -1;
+	}
+
+	if (debug)
+		printf("Wrote %d rows to the database\n", nrows);
+	nrows = 0;
+	return 0;
+
+fail:
+	fprintf(stderr, "Failed to insert records: %s\n",
+			mysql_stmt_error(stmt));
+	mysql_rollback(sql);
+	db_retry_later();
+	return -1;
+}
+
+/*
+ * Write whatever rows are waiting, connecting first if it's time to
+ * try again. Returns 0 once there's nothing left waiting.
+ */
+static int db_write(struct cfg_info *cfg)
+{
+	if (!sql && (time(NULL) >= retry_at))
+		db_connect();
+	if (sql && nrows)
+		db_flush();
+	return nrows ? -1 : 0;
+}
+
 /*
  * Store data in a MYSQL (or compatible) database
+ *
+ * Rows are buffered and written "batch" rows at a time. Until then
+ * they're held, and the send thread calls db_write() after "flush"
+ * seconds for whatever is waiting. If the database is down, up to
+ * DB_MAX_BATCH rows are held until it's back, after that the sample
+ * is refused so it's spooled.
  */
-void send_to_db(struct cfg_info *cfg, struct station_info *station,
-				weather_data_t *wd)
+int send_to_db(struct cfg_info *cfg, struct station_info *station,
+				const weather_data_t *wd, uint64_t changed)
 {
 	struct timeval start, end;
 	char *ts_start, *ts_end;
-	char *query;
-	int ret;
-	MYSQL *sql;
+	time_t now = time(NULL);
+	unsigned int i;
+	int ret = 0;
 
 	gettimeofday(&start, NULL);
 
-	if (!cfg->metric)
-		unit_convert(wd, CONVERT_ALL);
 
 	if (debug) {
 		ts_start = time_stamp(0, 1);
@@ -65,54 +277,27 @@ void send_to_db(struct cfg_info *cfg, struct station_info *station,
 		free(ts_start);
 	}
 
-	/* Initialize and open connection to database */
-	if ((sql = mysql_init(NULL)) == NULL) {
-		fprintf(stderr, "Failed to initialize MySQL interface.\n");
-		goto end;
+	if (nrows == DB_MAX_BATCH) {
+		/* Still can't write, let the spool hold this one */
+		if (db_write(cfg)) {
+			ret = -1;
+			goto end;
+		}
 	}
 
-	ret = connect_to_database(sql, cfg->host, cfg->extra, cfg->name, cfg->pass);
-	if (!ret)
-		goto end;
+	for (i = 0; i < DB_COLUMNS; i++)
+		rows[nrows][i] = wd->value[db_columns[i].field];
+	row_time[nrows] = wd->time ? wd->time : now;
+	nrows++;
 
+	if (nrows >= batch_size)
+		db_write(cfg);
 
-	/* Generate the sql statment to update the database. */
-	ret = asprintf(&query, "insert into weather_log set "
-			"pressure=\"%f\","
-			"temperature=\"%f\","
-			"humidity=\"%f\","
-			"windspeed=\"%f\","
-			"winddirection=\"%f\","
-			"gustspeed=\"%f\","
-			"gustdirection=\"%f\","
-			"rainfall_1min=\"%f\","
-			"rainfall_1hr=\"%f\","
-			"rainfall_day=\"%f\","
-			"rainfall_month=\"%f\","
-			"rainfall_year=\"%f\","
-			"dewpoint=\"%f\","
-			"heatindex=\"%f\"",
-			wd->pressure,
-			wd->temperature,
-			wd->humidity,
-			wd->windspeed,
-			wd->winddirection,
-			wd->gustspeed,
-			wd->rain,
-			wd->rainfall_1hr,
-			wd->rainfall_day,
-			wd->rainfall_month,
-			wd->rainfall_year,
-			wd->winddirection,
-			wd->dewpoint,
-			wd->heatindex);
-
-	db_query(sql, query, "Failed to update record");
-	free(query);
+	/* Anything not written yet is held for the next flush */
+	if (nrows)
+		ret = 1;
 
 end:
-	mysql_close(sql);
-
 	gettimeofday(&end, NULL);
 	if (debug) {
 		long diff;
@@ -126,7 +311,7 @@ end:
 		free(ts_end);
 	}
 
-	return;
+	return ret;
 }
 
 /*
@@ -135,10 +320,15 @@ end:
 static int connect_to_database(MYSQL *sql, char *db_host, char *db_name,
 		char *db_user, char *db_pass)
 {
-	my_bool reconnect = 1;
+	unsigned int timeout = 10;
 
 	printf("Connecting to database %s:%s\n", db_host, db_name);
-	mysql_options(sql, MYSQL_OPT_RECONNECT, &reconnect);
+
+	/*
+	 * Don't let the client library reconnect on its own, that would
+	 * silently drop the prepared statements. We reconnect ourselves.
+	 */
+	mysql_options(sql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
 
 	if (!mysql_real_connect(sql, db_host, db_user, db_pass, NULL, 0, NULL, 0)) {
 		fprintf(stderr, "Failed to connect to database: Error: %s\n",
@@ -260,19 +450,64 @@ void rainfall_data_get(MYSQL *sql, double *minute, double *hour, double *day,
 
 static int db_init(struct cfg_info *cfg, int d)
 {
+	unsigned int r, i;
+
 	debug = d;
+	db_cfg = cfg;
+
+	batch_size = cfg_int(cfg, "batch", 1);
+	if (batch_size < 1)
+		batch_size = 1;
+	if (batch_size > DB_MAX_BATCH)
+		batch_size = DB_MAX_BATCH;
+
+	/* Only stored if the table has a column for it. */
+	time_column = cfg_string(cfg, "time_column", NULL);
+	if (time_column && !time_column[0])
+		time_column = NULL;
+	nparams = time_column ? DB_PARAMS : DB_COLUMNS;
+
+	for (r = 0; r < DB_MAX_BATCH; r++) {
+		for (i = 0; i < DB_COLUMNS; i++) {
+			binds[r * nparams + i].buffer_type = MYSQL_TYPE_DOUBLE;
+			binds[r * nparams + i].buffer = &rows[r][i];
+		}
+		if (time_column) {
+			binds[r * nparams + i].buffer_type = MYSQL_TYPE_LONGLONG;
+			binds[r * nparams + i].buffer = &row_time[r];
+		}
+	}
+
 	return 0;
 }
 
+/*
+ * The send thread has already had the last try at writing the held
+ * rows, and spooled them if that failed.
+ */
+static void db_cleanup(void)
+{
+	nrows = 0;
+	db_disconnect();
+}
+
 static const struct publisher_funcs mysql_funcs = {
 	.init = db_init,
 	.update = send_to_db,
-	.cleanup = NULL
+	.flush = db_write,
+	.cleanup = db_cleanup
 };
 
 void mysql_setup(struct service_info *sinfo)
 {
 	sinfo->funcs = mysql_funcs;
+
+	/* Rows that don't fit in the batch buffer go to the spool */
+	if (sinfo->spool < 0)
+		sinfo->spool = 1;
+	if (sinfo->replay_interval <= 0)
+		sinfo->replay_interval = 1;
+	sinfo->flush_time = cfg_int(&sinfo->cfg, "flush", 60);
 	return;
 }
 
@@ -42,8 +42,8 @@
  * interactive view.  However, this could eventually be used
  * to provide some type of GUI output.
  */
-static void display_wd(struct cfg_info *cfg, struct station_info *station,
-					weather_data_t *wd)
+static int display_wd(struct cfg_info *cfg, struct station_info *station,
+					const weather_data_t *wd, uint64_t changed)
 {
 	struct sensor_list *list = wd->tower_list;
 	char t_str[4];
@@ -60,7 +60,6 @@ static void display_wd(struct cfg_info *cfg, struct station_info *station,
 		sprintf(p_str, " mb");
 		sprintf(d_str, " km");
 	} else {
-		unit_convert(wd, CONVERT_ALL);
 		sprintf(t_str, "°F");
 		sprintf(s_str, " mph");
 		sprintf(r_str, " in");
@@ -84,8 +83,11 @@ static void display_wd(struct cfg_info *cfg, struct station_info *station,
 	printf("Dew point:      %5.1f%s       Windchill:   %5.1f%s       Heat index: %5.1f%s\n\n",
 			wd->dewpoint, t_str, wd->windchill, t_str, wd->heatindex, t_str);
 
-	printf("Pressure:      %6.1f%-6s   Humidity:    %5.1f%%        Feels like: %5.1f%s\n\n",
+	printf("Pressure:      %6.1f%-6s   Humidity:    %5.1f%%        Feels like: %5.1f%s\n",
 			wd->pressure, p_str, wd->humidity, wd->feelslike, t_str);
+	printf("Tendency:      %+6.2f%-6s   %s (%.0f)\n\n",
+			wd->pressure_change, p_str, tendency_name((int)wd->tendency),
+			wd->tendency);
 
 	printf("Wind speed:     %5.1f%s     Wind dir:    %5.0f° (%s)\n",
 			wd->windspeed, s_str, wd->winddirection, wd->wind_dir);
@@ -102,7 +104,7 @@ static void display_wd(struct cfg_info *cfg, struct station_info *station,
 			wd->rainfall_day, r_str, wd->rainfall_month, r_str,
 			wd->rainfall_year, r_str);
 
-	printf("Pressure trend: %7s       Lighting:    %5d         Distance:  %5.1f%s\n\n",
+	printf("Pressure trend: %7s       Lighting:    %5.0f         Distance:  %5.1f%s\n\n",
 			trend, wd->strikes, wd->distance, d_str);
 
 	while(list) {
@@ -117,7 +119,7 @@ static void display_wd(struct cfg_info *cfg, struct station_info *station,
 
 	printf("-------------------------------------------------------------------------------\n");
 
-	return;
+	return 0;
 }
 
 static int display_init(struct cfg_info *cfg, int d)
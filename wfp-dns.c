@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Host name cache shared by the publishers.
+ *
+ * Host names are resolved with getaddrinfo(), so both IPv4 and IPv6
+ * addresses are returned, and cached for "dns_ttl" seconds. A
+ * background thread resolves names the services will need
+ * (dns_prefetch()) and refreshes names that are in use shortly
+ * before they expire. If an entry does expire, the old addresses
+ * are still returned while it's refreshed in the background, so
+ * only the very first lookup of a name ever waits on DNS.
+ *
+ * getaddrinfo() doesn't tell us the record's TTL so the same TTL is
+ * used for every name.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include "wfp.h"
+
+#define DNS_MAX_HOSTS 16
+#define DNS_MAX_NAME 256
+#define DNS_DEFAULT_TTL 300
+#define DNS_NEGATIVE_TTL 30		/* retry failed names after this */
+#define DNS_REFRESH_AHEAD 30	/* refresh names in use this long before expiry */
+
+extern int verbose;
+
+struct dns_entry {
+	char host[DNS_MAX_NAME];
+	struct dns_addr addr[DNS_MAX_ADDRS];
+	int count;				/* 0 if the name didn't resolve */
+	time_t expires;
+	int used;				/* looked up since the last refresh */
+	int queued;				/* waiting for the background thread */
+};
+
+static struct dns_entry cache[DNS_MAX_HOSTS];
+static struct dns_stats stats;
+static int ttl = DNS_DEFAULT_TTL;
+static int running = 0;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Call getaddrinfo(). Ports are filled in by dns_lookup(), so the
+ * addresses are stored with a port of 0.
+ */
+static int dns_query(const char *host, struct dns_addr *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	int count = 0;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	if ((err = getaddrinfo(host, NULL, &hints, &res)) != 0) {
+		if (verbose)
+			fprintf(stderr, "DNS: failed to resolve %s: %s\n", host,
+					gai_strerror(err));
+		return 0;
+	}
+
+	for (ai = res; ai && (count < DNS_MAX_ADDRS); ai = ai->ai_next) {
+		if ((ai->ai_family != AF_INET) && (ai->ai_family != AF_INET6))
+			continue;
+		memcpy(&addr[count].sa, ai->ai_addr, ai->ai_addrlen);
+		addr[count].len = ai->ai_addrlen;
+		count++;
+	}
+	freeaddrinfo(res);
+
+	return count;
+}
+
+static struct dns_entry *dns_find(const char *host)
+{
+	int i;
+
+	for (i = 0; i < DNS_MAX_HOSTS; i++) {
+		if (strcmp(cache[i].host, host) == 0)
+			return &cache[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Find a free entry for host, or reuse the one that expires first.
+ */
+static struct dns_entry *dns_new(const char *host)
+{
+	struct dns_entry *e = &cache[0];
+	int i;
+
+	for (i = 0; i < DNS_MAX_HOSTS; i++) {
+		if (cache[i].host[0] == '\0') {
+			e = &cache[i];
+			break;
+		}
+		if (cache[i].expires < e->expires)
+			e = &cache[i];
+	}
+
+	if (e->host[0] == '\0')
+		stats.entries++;
+
+	memset(e, 0, sizeof(struct dns_entry));
+	strncpy(e->host, host, DNS_MAX_NAME - 1);
+	return e;
+}
+
+/*
+ * Store the result of a query. Called with the lock held.
+ */
+static void dns_store(struct dns_entry *e, struct dns_addr *addr, int count)
+{
+	time_t now = time(NULL);
+
+	if (count > 0) {
+		memcpy(e->addr, addr, count * sizeof(struct dns_addr));
+		e->count = count;
+		e->expires = now + ttl;
+	} else {
+		stats.failures++;
+		/* Keep serving the old addresses if we had some */
+		e->expires = now + DNS_NEGATIVE_TTL;
+	}
+}
+
+static void set_port(struct dns_addr *addr, int port)
+{
+	if (addr->sa.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&addr->sa)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in *)&addr->sa)->sin_port = htons(port);
+}
+
+/*
+ * Look up host, filling in up to max addresses with the port set.
+ * Returns the number of addresses or 0 if the name doesn't resolve.
+ */
+int dns_lookup(const char *host, int port, struct dns_addr *addr, int max)
+{
+	struct dns_addr found[DNS_MAX_ADDRS];
+	struct dns_entry *e;
+	int count;
+	int i;
+
+	if (strlen(host) >= DNS_MAX_NAME)
+		return 0;
+
+	pthread_mutex_lock(&lock);
+	e = dns_find(host);
+	if (e && (e->count || (e->expires > time(NULL)))) {
+		stats.hits++;
+		e->used = 1;
+		if ((e->expires <= time(NULL)) && !e->queued) {
+			e->queued = 1;
+			pthread_cond_signal(&wake);
+		}
+		count = (e->count < max) ? e->count : max;
+		memcpy(addr, e->addr, count * sizeof(struct dns_addr));
+		pthread_mutex_unlock(&lock);
+	} else {
+		stats.misses++;
+		pthread_mutex_unlock(&lock);
+
+		/* Not cached yet, this one has to wait */
+		count = dns_query(host, found);
+
+		pthread_mutex_lock(&lock);
+		if (!(e = dns_find(host)))
+			e = dns_new(host);
+		dns_store(e, found, count);
+		e->used = 1;
+		pthread_mutex_unlock(&lock);
+
+		if (count > max)
+			count = max;
+		memcpy(addr, found, count * sizeof(struct dns_addr));
+	}
+
+	for (i = 0; i < count; i++)
+		set_port(&addr[i], port);
+
+	return count;
+}
+
+/*
+ * Ask for host to be resolved in the background so that it's
+ * already cached when it's needed.
+ */
+void dns_prefetch(const char *host)
+{
+	if (!host || (host[0] == '\0') || (strlen(host) >= DNS_MAX_NAME))
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (!dns_find(host)) {
+		dns_new(host)->queued = 1;
+		pthread_cond_signal(&wake);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Background thread. Resolves queued names and refreshes the ones
+ * in use before they expire. Names that aren't being used are left
+ * to expire and are refreshed the next time they're looked up.
+ */
+static void *dns_thread(void *arg)
+{
+	struct dns_addr found[DNS_MAX_ADDRS];
+	struct timespec ts;
+	char host[DNS_MAX_NAME];
+	struct dns_entry *e;
+	time_t now;
+	int ahead;
+	int count;
+	int i;
+
+	/* Short TTLs shouldn't turn into constant refreshing */
+	ahead = (ttl / 4 < DNS_REFRESH_AHEAD) ? ttl / 4 : DNS_REFRESH_AHEAD;
+
+	pthread_mutex_lock(&lock);
+	while (running) {
+		now = time(NULL);
+		for (i = 0; (i < DNS_MAX_HOSTS) && running; i++) {
+			e = &cache[i];
+			if (e->host[0] == '\0')
+				continue;
+			if (!e->queued && !(e->used && (e->expires -
+						(e->count ? ahead : 0) <= now)))
+				continue;
+
+			strcpy(host, e->host);
+			e->queued = 0;
+			e->used = 0;
+			pthread_mutex_unlock(&lock);
+
+			count = dns_query(host, found);
+
+			pthread_mutex_lock(&lock);
+			/* The entry may have been reused while unlocked */
+			if ((e = dns_find(host)) != NULL) {
+				dns_store(e, found, count);
+				stats.refreshes++;
+			}
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&wake, &lock, &ts);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/*
+ * Start the background thread. t is the cache time in seconds, 0
+ * for the default.
+ */
+int dns_start(int t)
+{
+	int err;
+
+	if (t > 0)
+		ttl = t;
+
+	running = 1;
+	if ((err = pthread_create(&thread, NULL, dns_thread, NULL))) {
+		fprintf(stderr, "Failed to start DNS thread: %s\n", strerror(err));
+		running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void dns_stop(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+}
+
+void dns_stats(struct dns_stats *st)
+{
+	pthread_mutex_lock(&lock);
+	*st = stats;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Main event loop.
+ *
+ * A small epoll based loop that runs on the main thread. It watches
+ * the UDP socket, timers (timerfd) and signals (signalfd) and calls
+ * a handler function when one is ready. Everything that drives the
+ * publishing (receiving packets, deciding when to send, checking
+ * for stuck services) happens here, on one thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include "wfp.h"
+
+#define MAX_HANDLERS 16
+
+enum handler_type {
+	HANDLER_FD = 0,
+	HANDLER_TIMER,
+	HANDLER_SIGNAL
+};
+
+struct event_handler {
+	int fd;
+	enum handler_type type;
+	event_cb cb;
+	void *arg;
+};
+
+static int epfd = -1;
+static int running = 0;
+static struct event_handler handlers[MAX_HANDLERS];
+
+int event_init(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_HANDLERS; i++)
+		handlers[i].fd = -1;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		fprintf(stderr, "Failed to create event loop: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int add_handler(int fd, enum handler_type type, event_cb cb, void *arg)
+{
+	struct epoll_event ev;
+	int i;
+
+	for (i = 0; i < MAX_HANDLERS; i++) {
+		if (handlers[i].fd == -1)
+			break;
+	}
+
+	if (i == MAX_HANDLERS) {
+		fprintf(stderr, "Too many event handlers\n");
+		return -1;
+	}
+
+	handlers[i].fd = fd;
+	handlers[i].type = type;
+	handlers[i].cb = cb;
+	handlers[i].arg = arg;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &handlers[i];
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		fprintf(stderr, "Failed to add event handler: %s\n", strerror(errno));
+		handlers[i].fd = -1;
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Call cb whenever fd is readable.
+ */
+int event_add(int fd, event_cb cb, void *arg)
+{
+	return add_handler(fd, HANDLER_FD, cb, arg);
+}
+
+/*
+ * Call cb every msec milliseconds. Returns the timer's fd, which
+ * can be passed to event_remove().
+ */
+int event_timer(int msec, event_cb cb, void *arg)
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create timer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	its.it_interval.tv_sec = msec / 1000;
+	its.it_interval.tv_nsec = (msec % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	timerfd_settime(fd, 0, &its, NULL);
+
+	if (add_handler(fd, HANDLER_TIMER, cb, arg) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Call cb when signo is received. The signal is blocked for the
+ * whole process so this needs to be called before any threads are
+ * started.
+ */
+int event_signal(int signo, event_cb cb, void *arg)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, signo);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create signal handler: %s\n",
+				strerror(errno));
+		return -1;
+	}
+
+	if (add_handler(fd, HANDLER_SIGNAL, cb, arg) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void event_remove(int fd)
+{
+	int i;
+
+	for (i = 0; i < MAX_HANDLERS; i++) {
+		if (handlers[i].fd != fd)
+			continue;
+
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		if (handlers[i].type != HANDLER_FD)
+			close(fd);
+		handlers[i].fd = -1;
+		break;
+	}
+}
+
+/*
+ * Run the loop until event_stop() is called.
+ */
+void event_run(void)
+{
+	struct epoll_event events[MAX_HANDLERS];
+	struct event_handler *h;
+	struct signalfd_siginfo si;
+	uint64_t expired;
+	int n;
+	int i;
+
+	running = 1;
+	while (running) {
+		n = epoll_wait(epfd, events, MAX_HANDLERS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Event loop failed: %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n && running; i++) {
+			h = (struct event_handler *)events[i].data.ptr;
+			if (h->fd == -1)
+				continue;
+
+			/* Timers and signals need to be read to re-arm them */
+			if (h->type == HANDLER_TIMER) {
+				if (read(h->fd, &expired, sizeof(expired)) < 0)
+					continue;
+			} else if (h->type == HANDLER_SIGNAL) {
+				if (read(h->fd, &si, sizeof(si)) < 0)
+					continue;
+			}
+
+			(h->cb)(h->fd, h->arg);
+		}
+	}
+}
+
+void event_stop(void)
+{
+	running = 0;
+}
+
+void event_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_HANDLERS; i++) {
+		if (handlers[i].fd != -1)
+			event_remove(handlers[i].fd);
+	}
+
+	if (epfd >= 0)
+		close(epfd);
+	epfd = -1;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * The weather value registry.
+ *
+ * wd_fields[] describes every value in weather_data_t: its name (as
+ * used in the JSON output, MQTT topics and config options), what it
+ * measures, how many decimal places it's normally shown with and its
+ * default change deadband. It's built from WD_FIELD_LIST in wfp.h so
+ * it can't get out of step with the structure.
+ */
+
+#include <string.h>
+#include "wfp.h"
+
+#define FIELD_INFO(m, e, u, p, d) [WD_##e] = { #m, u, p, d },
+
+const struct wd_field_info wd_fields[WD_VALUES] = {
+	WD_FIELD_LIST(FIELD_INFO)
+};
+
+/* Indexed by enum wd_unit, metric then imperial */
+static const char *unit_labels[UNIT_CLASSES][2] = {
+	[UNIT_NONE]      = { "",     "" },
+	[UNIT_TEMP]      = { "°C",   "°F" },
+	[UNIT_HUMIDITY]  = { "%",    "%" },
+	[UNIT_PRESSURE]  = { "mbar", "inHg" },
+	[UNIT_SPEED]     = { "m/s",  "mph" },
+	[UNIT_DIRECTION] = { "°",    "°" },
+	[UNIT_LIGHT]     = { "lx",   "lx" },
+	[UNIT_SOLAR]     = { "W/m²", "W/m²" },
+	[UNIT_COUNT]     = { "",     "" },
+	[UNIT_DISTANCE]  = { "km",   "mi" },
+	[UNIT_RAIN]      = { "mm",   "in" },
+};
+
+/*
+ * Field number for a name, or -1.
+ */
+int wd_field_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < WD_VALUES; i++) {
+		if (strcmp(wd_fields[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *wd_unit_label(enum wd_unit unit, int imperial)
+{
+	return unit_labels[unit][imperial ? 1 : 0];
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Number formatting for the publishers.
+ *
+ * Every value a publisher sends has a known number of decimal places
+ * (the field list in wfp.h, or the service's "precision" option), so
+ * rather than going through printf's general purpose %f, which is
+ * locale dependent and sends six decimals, the value is scaled to an
+ * integer and its digits written out directly. Values too large for
+ * that (more than 15 significant digits), NaN and infinities are
+ * left to snprintf().
+ *
+ * Rounding is half away from zero on the scaled value, and a value
+ * that rounds to zero is written without a sign.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "cJSON.h"
+#include "wfp.h"
+
+#define FMT_MAX_PRECISION 9
+#define FMT_MAX_SCALED 1e15		/* exactly representable, with room to spare */
+
+static const double pow10[FMT_MAX_PRECISION + 1] = {
+	1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+/*
+ * Copy a formatted number into buf, snprintf() style.
+ */
+static int fmt_copy(char *buf, int size, const char *s, int len)
+{
+	if (size > 0) {
+		if (len >= size) {
+			memcpy(buf, s, size - 1);
+			buf[size - 1] = '\0';
+		} else {
+			memcpy(buf, s, len + 1);
+		}
+	}
+	return len;
+}
+
+/*
+ * Format v with prec decimal places. Returns the length of the
+ * number, which like snprintf() may be more than fit in buf.
+ */
+int fmt_double(char *buf, int size, double v, int prec)
+{
+	char tmp[32];
+	char *p = tmp + sizeof(tmp);
+	unsigned long long n;
+	double scaled;
+	int neg = 0;
+	int len;
+	int i;
+
+	if (prec < 0)
+		prec = 0;
+	if (prec > FMT_MAX_PRECISION)
+		prec = FMT_MAX_PRECISION;
+
+	scaled = fabs(v) * pow10[prec];
+	if (!(scaled < FMT_MAX_SCALED)) {
+		len = snprintf(tmp, sizeof(tmp), "%.*f", prec, v);
+		if (len >= (int)sizeof(tmp))
+			return snprintf(buf, size > 0 ? size : 0, "%.*f", prec, v);
+		return fmt_copy(buf, size, tmp, len);
+	}
+
+	n = (unsigned long long)(scaled + 0.5);
+	if (n && (v < 0))
+		neg = 1;
+
+	/* Digits are written backwards from the end of tmp */
+	*--p = '\0';
+	for (i = 0; i < prec; i++) {
+		*--p = '0' + n % 10;
+		n /= 10;
+	}
+	if (prec)
+		*--p = '.';
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	if (neg)
+		*--p = '-';
+
+	return fmt_copy(buf, size, p, tmp + sizeof(tmp) - 1 - p);
+}
+
+/*
+ * Format field f of wd with the service's precision.
+ */
+int fmt_field(char *buf, int size, const struct cfg_info *cfg,
+		const weather_data_t *wd, enum wd_field f)
+{
+	return fmt_double(buf, size, wd->value[f], cfg->precision[f]);
+}
+
+/*
+ * Append "<name><value>" for a URL query string, i.e. "&tempf=" and
+ * the temperature.
+ */
+int fmt_param(char *buf, int size, const char *name,
+		const struct cfg_info *cfg, const weather_data_t *wd, enum wd_field f)
+{
+	int len = fmt_copy(buf, size, name, strlen(name));
+
+	return len + fmt_field(buf + len, size - len, cfg, wd, f);
+}
+
+/*
+ * Set the service's precisions, the defaults from the field list
+ * and any set with "precision", i.e. "precision" : { "pressure" : 3 }.
+ */
+void format_config(struct cfg_info *cfg)
+{
+	cJSON *prec, *item;
+	int i;
+
+	for (i = 0; i < WD_VALUES; i++)
+		cfg->precision[i] = wd_fields[i].precision;
+
+	prec = cJSON_GetObjectItemCaseSensitive(cfg->options, "precision");
+	cJSON_ArrayForEach(item, prec) {
+		if ((i = wd_field_lookup(item->string)) < 0) {
+			fprintf(stderr, "Unknown field %s in precision\n", item->string);
+			continue;
+		}
+		if (cJSON_IsNumber(item) && (item->valueint >= 0) &&
+				(item->valueint <= FMT_MAX_PRECISION))
+			cfg->precision[i] = item->valueint;
+	}
+}
@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Observation history
+ *
+ * Samples are stored one minute apart in a file per (UTC) day in the
+ * directory given as the service's host. Each file is a fixed size
+ * and memory mapped, only the current day's file stays mapped.
+ *
+ * Values are stored as scaled integers, i.e. temperature in 1/100
+ * degree. Each hour has a 32 bit base value per field and the minutes
+ * are 16 bit differences from it, stored a field at a time so that a
+ * range query over one field reads contiguous memory. Hour and day
+ * rollups (min, max and mean) are updated as each minute is written.
+ *
+ * All values are metric, the "metric" setting is ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wfp.h"
+
+#define HIST_MAGIC 0x54534857		/* "WHST" */
+#define HIST_VERSION 1
+#define HIST_MISSING INT16_MIN
+#define HIST_MINUTES 1440
+
+enum hist_kind {
+	HIST_MEAN,		/* average of the samples in the minute */
+	HIST_LAST,		/* latest sample in the minute */
+	HIST_MAX,		/* highest sample in the minute */
+	HIST_DIR		/* direction, rollups are vector averaged */
+};
+
+/* The order is the order they're stored in */
+static const struct {
+	enum wd_field field;
+	double scale;		/* stored value is value * scale */
+	enum hist_kind kind;
+} hist_fields[] = {
+	{ WD_TEMPERATURE,        100, HIST_MEAN },
+	{ WD_HUMIDITY,           10,  HIST_MEAN },
+	{ WD_PRESSURE,           10,  HIST_MEAN },
+	{ WD_PRESSURE_SEALEVEL,  10,  HIST_MEAN },
+	{ WD_DEWPOINT,           100, HIST_MEAN },
+	{ WD_FEELSLIKE,          100, HIST_MEAN },
+	{ WD_WINDSPEED,          100, HIST_MEAN },
+	{ WD_WINDDIRECTION,      10,  HIST_DIR },
+	{ WD_GUSTSPEED,          100, HIST_MAX },
+	{ WD_GUSTDIRECTION,      10,  HIST_DIR },
+	{ WD_ILLUMINATION,       0.1, HIST_MEAN },
+	{ WD_SOLAR,              1,   HIST_MEAN },
+	{ WD_UV,                 100, HIST_MEAN },
+	{ WD_RAIN,               100, HIST_LAST },
+	{ WD_RAINFALL_DAY,       100, HIST_LAST },
+	{ WD_DISTANCE,           10,  HIST_LAST },
+	{ WD_TREND,              1,   HIST_LAST },
+};
+
+#define HIST_FIELDS (sizeof(hist_fields) / sizeof(hist_fields[0]))
+
+/*
+ * For HIST_DIR fields sum and sum2 are the summed east and north
+ * components, otherwise sum is the sum of the values.
+ */
+struct hist_rollup {
+	float min;
+	float max;
+	double sum;
+	double sum2;
+	uint32_t count;
+	uint32_t pad;
+};
+
+struct hist_hour {
+	int32_t base[HIST_FIELDS];
+	int16_t delta[HIST_FIELDS][60];
+	struct hist_rollup roll[HIST_FIELDS];
+};
+
+struct hist_segment {
+	uint32_t magic;
+	uint32_t version;
+	int64_t day;				/* start of the day */
+	uint32_t fields;
+	uint32_t pad;
+	uint8_t present[HIST_MINUTES / 8];
+	struct hist_hour hour[24];
+	struct hist_rollup roll[HIST_FIELDS];
+};
+
+/* The minute being collected */
+struct hist_minute {
+	long minute;				/* time / 60 */
+	int count;
+	double v[HIST_FIELDS];
+	int n[HIST_FIELDS];
+};
+
+static int debug;
+static char *hist_dir = NULL;
+static int keep_days = 0;
+static struct hist_segment *seg = NULL;
+static struct hist_minute cur;
+
+static char *seg_path(time_t day)
+{
+	struct tm gt;
+	char *path;
+
+	gmtime_r(&day, &gt);
+	path = malloc(strlen(hist_dir) + 32);
+	if (path)
+		sprintf(path, "%s/%04d-%02d-%02d.wfh", hist_dir, gt.tm_year + 1900,
+				gt.tm_mon + 1, gt.tm_mday);
+	return path;
+}
+
+/*
+ * Map the segment for day, read only for queries. Returns NULL if
+ * there's no history for that day.
+ */
+static struct hist_segment *seg_map(time_t day, int write)
+{
+	struct hist_segment *s;
+	struct stat st;
+	char *path;
+	int fd;
+
+	if (!(path = seg_path(day)))
+		return NULL;
+	if (write)
+		mkdir(hist_dir, 0755);
+
+	fd = open(path, (write ? (O_RDWR | O_CREAT) : O_RDONLY) | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		if (write)
+			fprintf(stderr, "Failed to open history %s: %s\n", path,
+					strerror(errno));
+		free(path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || ((st.st_size != sizeof(struct hist_segment)) &&
+				(!write || ftruncate(fd, sizeof(struct hist_segment))))) {
+		if (write)
+			fprintf(stderr, "Failed to size history %s: %s\n", path,
+					strerror(errno));
+		close(fd);
+		free(path);
+		return NULL;
+	}
+
+	s = mmap(NULL, sizeof(struct hist_segment),
+			write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		fprintf(stderr, "Failed to map history %s: %s\n", path,
+				strerror(errno));
+		free(path);
+		return NULL;
+	}
+
+	if ((s->magic != HIST_MAGIC) || (s->version != HIST_VERSION) ||
+			(s->fields != HIST_FIELDS) || (s->day != day)) {
+		if (!write) {
+			munmap(s, sizeof(struct hist_segment));
+			free(path);
+			return NULL;
+		}
+		if (st.st_size != 0)
+			fprintf(stderr, "Ignoring unusable history %s\n", path);
+
+		/* New file (or one we can't use), start the day over */
+		memset(s, 0, sizeof(struct hist_segment));
+		s->magic = HIST_MAGIC;
+		s->version = HIST_VERSION;
+		s->day = day;
+		s->fields = HIST_FIELDS;
+	}
+
+	free(path);
+	return s;
+}
+
+static void seg_unmap(struct hist_segment *s, int write)
+{
+	if (write)
+		msync(s, sizeof(struct hist_segment), MS_ASYNC);
+	munmap(s, sizeof(struct hist_segment));
+}
+
+/*
+ * Remove days that are older than the "days" setting.
+ */
+static void seg_expire(time_t day)
+{
+	struct dirent *de;
+	struct tm gt;
+	time_t oldest;
+	char name[32];
+	char *path;
+	DIR *dir;
+
+	if (keep_days <= 0)
+		return;
+
+	oldest = day - (time_t)keep_days * 86400;
+	gmtime_r(&oldest, &gt);
+	sprintf(name, "%04d-%02d-%02d.wfh", gt.tm_year + 1900, gt.tm_mon + 1,
+			gt.tm_mday);
+
+	if (!(dir = opendir(hist_dir)))
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if ((strlen(de->d_name) != strlen(name)) ||
+				(strcmp(de->d_name + 10, ".wfh") != 0) ||
+				(strcmp(de->d_name, name) >= 0))
+			continue;
+		path = malloc(strlen(hist_dir) + strlen(de->d_name) + 2);
+		sprintf(path, "%s/%s", hist_dir, de->d_name);
+		if (debug)
+			printf("Removing old history %s\n", path);
+		unlink(path);
+		free(path);
+	}
+	closedir(dir);
+}
+
+static void rollup_add(struct hist_rollup *r, unsigned int f, double v)
+{
+	if ((r->count == 0) || (v < r->min))
+		r->min = v;
+	if ((r->count == 0) || (v > r->max))
+		r->max = v;
+	if (hist_fields[f].kind == HIST_DIR) {
+		r->sum += sin(v * M_PI / 180);
+		r->sum2 += cos(v * M_PI / 180);
+	} else {
+		r->sum += v;
+	}
+	r->count++;
+}
+
+static double rollup_mean(struct hist_rollup *r, unsigned int f)
+{
+	double deg;
+
+	if (hist_fields[f].kind != HIST_DIR)
+		return r->sum / r->count;
+
+	deg = atan2(r->sum, r->sum2) * 180 / M_PI;
+	return (deg < 0) ? deg + 360 : deg;
+}
+
+/*
+ * Write the collected minute to its day's segment and update the
+ * rollups.
+ */
+static void minute_write(struct hist_minute *m)
+{
+	struct hist_hour *h;
+	time_t day = (m->minute / HIST_MINUTES) * 86400;
+	int slot = m->minute % HIST_MINUTES;
+	int first;
+	double v;
+	long scaled;
+	unsigned int f;
+	int i;
+
+	if (!seg || (seg->day != day)) {
+		if (seg)
+			seg_unmap(seg, 1);
+		if (!(seg = seg_map(day, 1)))
+			return;
+		seg_expire(day);
+	}
+
+	h = &seg->hour[slot / 60];
+
+	/* The first minute in the hour sets the base */
+	first = 1;
+	for (i = slot - slot % 60; i < slot - slot % 60 + 60; i++) {
+		if ((i != slot) && (seg->present[i / 8] & (1 << (i % 8))))
+			first = 0;
+	}
+
+	for (f = 0; f < HIST_FIELDS; f++) {
+		if (m->n[f] == 0) {
+			h->delta[f][slot % 60] = HIST_MISSING;
+			continue;
+		}
+
+		v = m->v[f];
+		if (hist_fields[f].kind == HIST_MEAN)
+			v /= m->n[f];
+		scaled = lround(v * hist_fields[f].scale);
+
+		if (first)
+			h->base[f] = scaled;
+		if ((scaled - h->base[f] <= HIST_MISSING) ||
+				(scaled - h->base[f] > INT16_MAX)) {
+			/* Too far from the base to store */
+			h->delta[f][slot % 60] = HIST_MISSING;
+			continue;
+		}
+		h->delta[f][slot % 60] = scaled - h->base[f];
+
+		rollup_add(&h->roll[f], f, v);
+		rollup_add(&seg->roll[f], f, v);
+	}
+
+	seg->present[slot / 8] |= 1 << (slot % 8);
+}
+
+/*
+ * Add a sample to the minute it was taken in. Samples are collected
+ * until one for a later minute arrives.
+ */
+static int send_to_history(struct cfg_info *cfg, struct station_info *station,
+				const weather_data_t *wd, uint64_t changed)
+{
+	time_t t = wd->time ? wd->time : time(NULL);
+	unsigned int f;
+	double v;
+
+	if (cur.count && (cur.minute != t / 60)) {
+		minute_write(&cur);
+		memset(&cur, 0, sizeof(cur));
+	}
+	cur.minute = t / 60;
+	cur.count++;
+
+	for (f = 0; f < HIST_FIELDS; f++) {
+		v = wd->value[hist_fields[f].field];
+		if (isnan(v))
+			continue;
+
+		switch (hist_fields[f].kind) {
+			case HIST_MEAN:
+				cur.v[f] += v;
+				break;
+			case HIST_MAX:
+				if ((cur.n[f] == 0) || (v > cur.v[f]))
+					cur.v[f] = v;
+				break;
+			case HIST_LAST:
+			case HIST_DIR:
+				cur.v[f] = v;
+				break;
+		}
+		cur.n[f]++;
+	}
+
+	return 0;
+}
+
+/*
+ * Look up a field by name, -1 if it isn't stored.
+ */
+static int hist_field(const char *name)
+{
+	unsigned int f;
+	int field;
+
+	if ((field = wd_field_lookup(name)) < 0)
+		return -1;
+
+	for (f = 0; f < HIST_FIELDS; f++) {
+		if (hist_fields[f].field == (enum wd_field)field)
+			return f;
+	}
+	return -1;
+}
+
+static void point_set(struct hist_point *p, time_t t, struct hist_rollup *r,
+		unsigned int f)
+{
+	p->time = t;
+	p->min = r->min;
+	p->max = r->max;
+	p->mean = rollup_mean(r, f);
+	p->count = r->count;
+}
+
+/*
+ * Get the history of field from the time range [from, to). step is
+ * 60 for the minute values, 3600 for the hourly rollups or 86400 for
+ * the daily rollups. Periods with no data are skipped.
+ *
+ * Returns the number of points filled in, or -1 if the history
+ * isn't enabled, the field isn't stored or step isn't supported.
+ *
+ * Safe to call from any thread, each day is mapped just long enough
+ * to copy out what's needed.
+ */
+int history_query(const char *field, time_t from, time_t to, int step,
+		struct hist_point *out, int max)
+{
+	struct hist_segment *s;
+	struct hist_hour *h;
+	time_t day, t;
+	int count = 0;
+	int f;
+	int i;
+
+	if (!hist_dir || ((f = hist_field(field)) < 0))
+		return -1;
+	if ((step != 60) && (step != 3600) && (step != 86400))
+		return -1;
+
+	for (day = from - from % 86400; (day < to) && (count < max); day += 86400) {
+		if (!(s = seg_map(day, 0)))
+			continue;
+
+		if (step == 86400) {
+			if ((day >= from) && s->roll[f].count)
+				point_set(&out[count++], day, &s->roll[f], f);
+			seg_unmap(s, 0);
+			continue;
+		}
+
+		for (i = 0; (i < HIST_MINUTES) && (count < max); i += step / 60) {
+			t = day + i * 60;
+			if ((t < from) || (t >= to))
+				continue;
+			h = &s->hour[i / 60];
+
+			if (step == 3600) {
+				if (h->roll[f].count)
+					point_set(&out[count++], t, &h->roll[f], f);
+				continue;
+			}
+
+			if (!(s->present[i / 8] & (1 << (i % 8))) ||
+					(h->delta[f][i % 60] == HIST_MISSING))
+				continue;
+			out[count].time = t;
+			out[count].mean = (h->base[f] + h->delta[f][i % 60]) /
+				hist_fields[f].scale;
+			out[count].min = out[count].max = out[count].mean;
+			out[count].count = 1;
+			count++;
+		}
+		seg_unmap(s, 0);
+	}
+
+	return count;
+}
+
+static int history_init(struct cfg_info *cfg, int d)
+{
+	debug = d;
+
+	hist_dir = strdup((cfg->host && cfg->host[0]) ? cfg->host : "history");
+	keep_days = cfg_int(cfg, "days", 0);
+
+	memset(&cur, 0, sizeof(cur));
+	return 0;
+}
+
+static void history_cleanup(void)
+{
+	if (cur.count)
+		minute_write(&cur);
+	memset(&cur, 0, sizeof(cur));
+
+	if (seg)
+		seg_unmap(seg, 1);
+	seg = NULL;
+}
+
+static const struct publisher_funcs history_funcs = {
+	.init = history_init,
+	.update = send_to_history,
+	.cleanup = history_cleanup
+};
+
+void history_setup(struct service_info *sinfo)
+{
+	sinfo->funcs = history_funcs;
+
+	/*
+	 * init is called for disabled services too, leave hist_dir
+	 * unset so httpd's /history doesn't serve an old directory.
+	 */
+	if (!sinfo->enabled)
+		sinfo->funcs.init = NULL;
+	return;
+}
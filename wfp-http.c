@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Small HTTP/1.1 client for the upload services.
+ *
+ * Each service keeps one connection open to its host and reuses it
+ * for every upload, so an upload is one round trip instead of a DNS
+ * lookup, a TCP handshake, the request and a close.
+ *
+ * http_get() waits for the response and returns its status, so a
+ * service knows straight away whether the upload worked and can
+ * spool the sample if it didn't. If the server has closed the idle
+ * connection, or closes it before answering, the request is sent
+ * again once on a new connection.
+ *
+ * A connection is only used from one thread (the service's send
+ * thread) so there's no locking here.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "wfp.h"
+
+#define HTTP_CONNECT_TIMEOUT 5000	/* msec */
+#define HTTP_READ_TIMEOUT 10000		/* msec */
+#define HTTP_BUFSIZE 4096
+
+extern int debug;
+extern int verbose;
+
+struct http_conn {
+	char *host;
+	int port;
+	int fd;
+	int keep_alive;			/* server will keep the connection open */
+	int len;
+	int pos;
+	char buf[HTTP_BUFSIZE];
+};
+
+static void http_disconnect(struct http_conn *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+	c->pos = 0;
+}
+
+/*
+ * Wait for the socket to be ready. Returns 0 when it is or -1 on
+ * timeout or error.
+ */
+static int http_poll(int fd, short events, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = fd;
+	pfd.events = events;
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while ((ret < 0) && (errno == EINTR));
+
+	if (ret == 0)
+		errno = ETIMEDOUT;
+	return (ret > 0) ? 0 : -1;
+}
+
+/*
+ * Connect to one of host's addresses, giving each one timeout msec
+ * to answer. Returns a non-blocking socket or -1. Also used for the
+ * CWOP connection.
+ */
+int tcp_connect(const char *host, int port, int timeout)
+{
+	struct dns_addr addr[DNS_MAX_ADDRS];
+	socklen_t len;
+	int count;
+	int err;
+	int fd = -1;
+	int i;
+
+	count = dns_lookup(host, port, addr, DNS_MAX_ADDRS);
+	if (count == 0) {
+		fprintf(stderr, "ERROR: Failed to resolve %s\n", host);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		fd = socket(addr[i].sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK |
+				SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			continue;
+
+		if ((connect(fd, (struct sockaddr *)&addr[i].sa,
+						addr[i].len) == 0) ||
+				((errno == EINPROGRESS) &&
+				 (http_poll(fd, POLLOUT, timeout) == 0))) {
+			len = sizeof(err);
+			if ((getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0) &&
+					(err == 0))
+				return fd;
+			errno = err;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	fprintf(stderr, "ERROR: Failed to connect to %s: %m\n", host);
+	return -1;
+}
+
+static int http_connect(struct http_conn *c)
+{
+	int one = 1;
+
+	c->fd = tcp_connect(c->host, c->port, HTTP_CONNECT_TIMEOUT);
+	if (c->fd < 0)
+		return -1;
+
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->keep_alive = 1;
+
+	if (verbose > 1)
+		fprintf(stderr, "HTTP: connected to %s:%d\n", c->host, c->port);
+	return 0;
+}
+
+static int http_write(struct http_conn *c, const char *data, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = send(c->fd, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) &&
+					(http_poll(c->fd, POLLOUT, HTTP_READ_TIMEOUT) == 0))
+				continue;
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Read more data into the buffer. Returns the number of bytes read,
+ * 0 if the server closed the connection or -1 on error.
+ */
+static int http_fill(struct http_conn *c)
+{
+	int n;
+
+	if (c->pos > 0) {
+		memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+		c->len -= c->pos;
+		c->pos = 0;
+	}
+
+	if (c->len == HTTP_BUFSIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	while (1) {
+		n = recv(c->fd, c->buf + c->len, HTTP_BUFSIZE - c->len, 0);
+		if (n >= 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if ((errno != EAGAIN) ||
+				(http_poll(c->fd, POLLIN, HTTP_READ_TIMEOUT) < 0))
+			return -1;
+	}
+
+	c->len += n;
+	return n;
+}
+
+/*
+ * Get the next header line, without the line ending.
+ */
+static char *http_line(struct http_conn *c)
+{
+	char *line;
+	char *eol;
+
+	while (!(eol = memchr(c->buf + c->pos, '\n', c->len - c->pos))) {
+		if (http_fill(c) <= 0)
+			return NULL;
+	}
+
+	line = c->buf + c->pos;
+	c->pos = eol - c->buf + 1;
+	if ((eol > line) && (*(eol - 1) == '\r'))
+		eol--;
+	*eol = '\0';
+	return line;
+}
+
+/*
+ * Discard len bytes of body, or everything up to the close if len
+ * is negative.
+ */
+static int http_skip(struct http_conn *c, long len)
+{
+	int n;
+
+	while (len != 0) {
+		if (c->pos == c->len) {
+			n = http_fill(c);
+			if (n < 0)
+				return -1;
+			if (n == 0)
+				return (len < 0) ? 0 : -1;
+		}
+
+		n = c->len - c->pos;
+		if ((len > 0) && (n > len))
+			n = len;
+		if (verbose > 1)
+			fprintf(stderr, "%.*s", n, c->buf + c->pos);
+		c->pos += n;
+		if (len > 0)
+			len -= n;
+	}
+
+	return 0;
+}
+
+static int http_chunked(struct http_conn *c)
+{
+	char *line;
+	long size;
+
+	do {
+		if (!(line = http_line(c)))
+			return -1;
+		size = strtol(line, NULL, 16);
+		if ((size > 0) && http_skip(c, size))
+			return -1;
+		if (!(line = http_line(c)))
+			return -1;
+	} while (size > 0);
+
+	return 0;
+}
+
+/*
+ * Read one response. Returns the status code or -1 if the
+ * connection failed before the whole response came in.
+ */
+static int http_response(struct http_conn *c)
+{
+	char *line;
+	long length = -1;
+	int chunked = 0;
+	int status;
+	int minor = 0;
+
+	if (!(line = http_line(c)))
+		return -1;
+
+	if (sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2) {
+		fprintf(stderr, "ERROR: %s: bad response: %s\n", c->host, line);
+		return -1;
+	}
+	if (verbose > 1)
+		fprintf(stderr, "\n%s returned: %s\n", c->host, line);
+
+	/* HTTP/1.0 servers close unless asked not to */
+	c->keep_alive = (minor > 0);
+
+	while ((line = http_line(c)) && (*line != '\0')) {
+		if (strncasecmp(line, "Content-Length:", 15) == 0)
+			length = strtol(line + 15, NULL, 10);
+		else if ((strncasecmp(line, "Transfer-Encoding:", 18) == 0) &&
+				strcasestr(line + 18, "chunked"))
+			chunked = 1;
+		else if (strncasecmp(line, "Connection:", 11) == 0)
+			c->keep_alive = (strcasestr(line + 11, "close") == NULL);
+	}
+	if (!line)
+		return -1;
+
+	if ((status == 204) || (status == 304) || ((status / 100) == 1))
+		length = 0;
+
+	if (chunked) {
+		if (http_chunked(c))
+			return -1;
+	} else if (length < 0) {
+		c->keep_alive = 0;
+		if (http_skip(c, -1))
+			return -1;
+	} else if (http_skip(c, length)) {
+		return -1;
+	}
+
+	return status;
+}
+
+/*
+ * Has the server closed an idle connection?
+ */
+static int http_idle_closed(struct http_conn *c)
+{
+	struct pollfd pfd;
+
+	pfd.fd = c->fd;
+	pfd.events = POLLIN | POLLRDHUP;
+	return (poll(&pfd, 1, 0) > 0);
+}
+
+/*
+ * Create a connection to host. Nothing is sent until the first
+ * http_get().
+ */
+struct http_conn *http_open(const char *host, int port)
+{
+	struct http_conn *c;
+
+	c = calloc(1, sizeof(struct http_conn));
+	if (!c)
+		return NULL;
+
+	c->host = strdup(host);
+	c->port = port;
+	c->fd = -1;
+
+	return c;
+}
+
+/*
+ * GET path from the connection's host. Returns the response's
+ * status code or -1 if there wasn't one.
+ */
+int http_get(struct http_conn *c, const char *path, const char *agent)
+{
+	char *req;
+	int status = -1;
+	int tries;
+	int len;
+
+	len = strlen(path) + strlen(c->host) + strlen(agent) + 80;
+	req = malloc(len);
+	if (!req)
+		return -1;
+	len = snprintf(req, len, "GET /%s HTTP/1.1\r\nHost: %s\r\n"
+			"User-Agent: %s\r\nConnection: keep-alive\r\n\r\n",
+			path, c->host, agent);
+
+	/* Anything waiting on an idle connection means it's been closed */
+	if ((c->fd >= 0) && http_idle_closed(c))
+		http_disconnect(c);
+	c->len = 0;
+	c->pos = 0;
+
+	for (tries = 0; tries < 2; tries++) {
+		if ((c->fd < 0) && http_connect(c))
+			break;
+
+		if ((http_write(c, req, len) == 0) &&
+				((status = http_response(c)) >= 0))
+			break;
+
+		/* The connection went away, try once more on a new one */
+		http_disconnect(c);
+	}
+	free(req);
+
+	if (status < 0)
+		fprintf(stderr, "ERROR: %s: no response\n", c->host);
+	else if ((status / 100) != 2)
+		fprintf(stderr, "ERROR: %s returned status %d\n", c->host, status);
+
+	if (!c->keep_alive)
+		http_disconnect(c);
+
+	return status;
+}
+
+void http_close(struct http_conn *c)
+{
+	if (!c)
+		return;
+
+	http_disconnect(c);
+	free(c->host);
+	free(c);
+}
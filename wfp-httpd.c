@@ -0,0 +1,996 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Serve the current conditions as JSON over HTTP.
+ *
+ * The service's update function renders the complete HTTP response
+ * for each new sample, once. The server runs its own epoll loop on
+ * its own thread and hands every client a reference to the same
+ * pre-rendered response, so a request costs a write() and nothing
+ * else.
+ *
+ *   GET /current         the latest sample and the tower sensors
+ *   GET /current?wait=N  with If-None-Match set to the current ETag,
+ *                        wait up to N seconds for the next sample
+ *   GET /history?field=temperature&from=T&to=T&step=60|3600|86400
+ *                        see wfp-history.c
+ *   GET /stream          Server-Sent Events: "rapid_wind", "strike" and
+ *                        "precip" as they arrive and "observation"
+ *                        with each new sample
+ *
+ * Stream events are formatted once by whoever produces them and put
+ * on a hand-off list for the server thread, which queues a reference
+ * on each stream client's ring. A client whose ring fills up is too
+ * slow to keep up and is disconnected, nothing ever waits for one.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "cJSON.h"
+#include "wfp.h"
+
+#define HTTPD_DEFAULT_PORT 8080
+#define HTTPD_MAX_CLIENTS 1024
+#define HTTPD_REQUEST_SIZE 2048
+#define HTTPD_IDLE 60			/* close idle connections after this */
+#define HTTPD_MAX_WAIT 300		/* longest long-poll */
+#define HTTPD_MAX_POINTS 8784	/* a year of hours, for /history */
+#define HTTPD_STREAM_RING 64	/* events queued per stream client */
+#define HTTPD_PENDING 256		/* events waiting for the server thread */
+#define HTTPD_HEARTBEAT 15		/* seconds between stream keep-alives */
+#define HTTPD_BACKOFF_MIN 5		/* seconds before trying to listen again */
+#define HTTPD_BACKOFF_MAX 300
+
+/*
+ * A complete response. Shared by every client sending it and freed
+ * when the last one is done.
+ */
+struct httpd_doc {
+	int refs;
+	size_t len;
+	char data[];
+};
+
+enum client_state {
+	CLIENT_READING = 0,
+	CLIENT_WAITING,			/* long-poll, parked until the next sample */
+	CLIENT_WRITING,			/* waiting for the socket to take more */
+	CLIENT_STREAMING		/* event stream, idle */
+};
+
+struct httpd_client {
+	int fd;
+	enum client_state state;
+	char req[HTTPD_REQUEST_SIZE];
+	int len;
+	struct httpd_doc *doc;	/* being sent */
+	size_t sent;
+	int close;				/* close after this response */
+	time_t deadline;		/* idle or long-poll timeout */
+	int stream;				/* /stream client */
+	struct httpd_doc *ring[HTTPD_STREAM_RING];
+	int head;
+	int count;
+	struct httpd_client *prev;
+	struct httpd_client *next;
+};
+
+static int debug;
+static char *bind_host = NULL;
+static int port = HTTPD_DEFAULT_PORT;
+static int max_clients = HTTPD_MAX_CLIENTS;
+
+static int running = 0;
+static int backoff = 0;
+static time_t retry_at = 0;
+static pthread_t thread;
+static int epfd = -1;
+static int listen_fd = -1;
+static int wake_fd = -1;
+static struct httpd_client *clients = NULL;
+static int nclients = 0;
+static int nstreams = 0;
+static unsigned long slow_clients = 0;
+static struct httpd_doc *heartbeat = NULL;
+
+/* The latest response, protected by lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct httpd_doc *current = NULL;
+static struct httpd_doc *current_304 = NULL;
+static char etag[32] = "";
+static unsigned long generation = 0;
+static struct httpd_doc *pending[HTTPD_PENDING];
+static int npending = 0;
+static unsigned long lost_events = 0;
+
+static struct httpd_doc *doc_hold(struct httpd_doc *doc)
+{
+	__atomic_add_fetch(&doc->refs, 1, __ATOMIC_RELAXED);
+	return doc;
+}
+
+static void doc_put(struct httpd_doc *doc)
+{
+	if (doc && (__atomic_sub_fetch(&doc->refs, 1, __ATOMIC_ACQ_REL) == 0))
+		free(doc);
+}
+
+/*
+ * Build a response. extra is any additional header lines.
+ */
+static struct httpd_doc *doc_create(const char *status, const char *extra,
+		const char *type, const char *body)
+{
+	struct httpd_doc *doc;
+	size_t blen = body ? strlen(body) : 0;
+	size_t max = blen + strlen(status) + strlen(extra) + strlen(type) + 128;
+
+	if (!(doc = malloc(sizeof(struct httpd_doc) + max)))
+		return NULL;
+
+	doc->refs = 1;
+	doc->len = snprintf(doc->data, max, "HTTP/1.1 %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"Cache-Control: no-cache\r\n"
+			"%s\r\n", status, type, blen, extra);
+	if (body)
+		memcpy(doc->data + doc->len, body, blen);
+	doc->len += blen;
+
+	return doc;
+}
+
+static struct httpd_doc *doc_not_modified(const char *extra)
+{
+	struct httpd_doc *doc;
+	size_t max = strlen(extra) + 64;
+
+	if (!(doc = malloc(sizeof(struct httpd_doc) + max)))
+		return NULL;
+
+	doc->refs = 1;
+	doc->len = snprintf(doc->data, max, "HTTP/1.1 304 Not Modified\r\n"
+			"Cache-Control: no-cache\r\n"
+			"%s\r\n", extra);
+	return doc;
+}
+
+static struct httpd_doc *doc_raw(const char *text)
+{
+	struct httpd_doc *doc;
+	size_t len = strlen(text);
+
+	if (!(doc = malloc(sizeof(struct httpd_doc) + len + 1)))
+		return NULL;
+
+	doc->refs = 1;
+	doc->len = len;
+	memcpy(doc->data, text, len + 1);
+	return doc;
+}
+
+static struct httpd_doc *doc_error(const char *status)
+{
+	char body[64];
+
+	snprintf(body, sizeof(body), "{\"error\":\"%s\"}\n", status);
+	return doc_create(status, "", "application/json", body);
+}
+
+/*
+ * Render a sample as JSON. Called on the service's worker thread once
+ * per sample.
+ */
+static char *render_json(struct cfg_info *cfg, const weather_data_t *wd)
+{
+	struct sensor_list *list;
+	cJSON *root, *sensors, *s;
+	unsigned int i;
+	char *json;
+
+	root = cJSON_CreateObject();
+	if (wd->timestamp)
+		cJSON_AddStringToObject(root, "timestamp", wd->timestamp);
+	cJSON_AddNumberToObject(root, "time", (double)wd->time);
+	cJSON_AddStringToObject(root, "units", cfg->metric ? "metric" : "imperial");
+	for (i = 0; i < WD_VALUES; i++)
+		cJSON_AddNumberToObject(root, wd_fields[i].name, wd->value[i]);
+	cJSON_AddStringToObject(root, "wind_dir", wd->wind_dir);
+
+	sensors = cJSON_AddArrayToObject(root, "sensors");
+	for (list = wd->tower_list; list; list = list->next) {
+		s = cJSON_CreateObject();
+		if (list->sensor->sensor_id)
+			cJSON_AddStringToObject(s, "id", list->sensor->sensor_id);
+		cJSON_AddStringToObject(s, "location", list->sensor->location);
+		if (list->sensor->timestamp)
+			cJSON_AddStringToObject(s, "timestamp", list->sensor->timestamp);
+		cJSON_AddNumberToObject(s, "temperature", list->sensor->temperature);
+		cJSON_AddNumberToObject(s, "humidity", list->sensor->humidity);
+		cJSON_AddNumberToObject(s, "temperature_high",
+				list->sensor->temperature_high);
+		cJSON_AddNumberToObject(s, "temperature_low",
+				list->sensor->temperature_low);
+		cJSON_AddItemToArray(sensors, s);
+	}
+
+	json = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+	return json;
+}
+
+/*
+ * Find a query parameter, copying its value to buf.
+ */
+static int query_param(const char *query, const char *name, char *buf,
+		size_t size)
+{
+	size_t nlen = strlen(name);
+	const char *p = query;
+	size_t len;
+
+	while (p && *p) {
+		if ((strncmp(p, name, nlen) == 0) && (p[nlen] == '=')) {
+			p += nlen + 1;
+			len = strcspn(p, "&");
+			if (len >= size)
+				len = size - 1;
+			memcpy(buf, p, len);
+			buf[len] = '\0';
+			return 1;
+		}
+		if ((p = strchr(p, '&')))
+			p++;
+	}
+
+	return 0;
+}
+
+static struct httpd_doc *history_doc(const char *query)
+{
+	struct hist_point *pts;
+	struct httpd_doc *doc;
+	char field[32], buf[32];
+	time_t from, to;
+	int step = 3600;
+	cJSON *root, *arr, *p;
+	char *json;
+	int n, i;
+
+	to = time(NULL);
+	from = to - 86400;
+	if (!query_param(query, "field", field, sizeof(field)))
+		return doc_error("400 Bad Request");
+	if (query_param(query, "from", buf, sizeof(buf)))
+		from = atol(buf);
+	if (query_param(query, "to", buf, sizeof(buf)))
+		to = atol(buf);
+	if (query_param(query, "step", buf, sizeof(buf)))
+		step = atoi(buf);
+
+	if (!(pts = malloc(HTTPD_MAX_POINTS * sizeof(struct hist_point))))
+		return doc_error("503 Service Unavailable");
+
+	n = history_query(field, from, to, step, pts, HTTPD_MAX_POINTS);
+	if (n < 0) {
+		free(pts);
+		return doc_error("404 Not Found");
+	}
+
+	root = cJSON_CreateObject();
+	cJSON_AddStringToObject(root, "field", field);
+	cJSON_AddNumberToObject(root, "step", step);
+	arr = cJSON_AddArrayToObject(root, "points");
+	for (i = 0; i < n; i++) {
+		p = cJSON_CreateObject();
+		cJSON_AddNumberToObject(p, "time", (double)pts[i].time);
+		cJSON_AddNumberToObject(p, "min", pts[i].min);
+		cJSON_AddNumberToObject(p, "max", pts[i].max);
+		cJSON_AddNumberToObject(p, "mean", pts[i].mean);
+		cJSON_AddItemToArray(arr, p);
+	}
+	free(pts);
+
+	json = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+	doc = doc_create("200 OK", "", "application/json", json);
+	free(json);
+	return doc;
+}
+
+static void client_close(struct httpd_client *c)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	doc_put(c->doc);
+	while (c->count) {
+		doc_put(c->ring[c->head]);
+		c->head = (c->head + 1) % HTTPD_STREAM_RING;
+		c->count--;
+	}
+	if (c->stream)
+		nstreams--;
+
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		clients = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	nclients--;
+	free(c);
+}
+
+/*
+ * Write as much of the response as the socket will take. Stream
+ * clients keep going with whatever is on their ring. Returns -1 if
+ * the client was closed.
+ */
+static int client_write(struct httpd_client *c)
+{
+	struct epoll_event ev;
+	ssize_t n;
+
+	while (1) {
+		if (!c->doc) {
+			if (!c->stream || !c->count)
+				break;
+			c->doc = c->ring[c->head];
+			c->ring[c->head] = NULL;
+			c->head = (c->head + 1) % HTTPD_STREAM_RING;
+			c->count--;
+			c->sent = 0;
+		}
+
+		while (c->sent < c->doc->len) {
+			n = send(c->fd, c->doc->data + c->sent, c->doc->len - c->sent,
+					MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+					if (c->state != CLIENT_WRITING) {
+						c->state = CLIENT_WRITING;
+						ev.events = EPOLLOUT;
+						ev.data.ptr = c;
+						epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+					}
+					return 0;
+				}
+				client_close(c);
+				return -1;
+			}
+			c->sent += n;
+		}
+
+		doc_put(c->doc);
+		c->doc = NULL;
+		if (!c->stream)
+			break;
+	}
+
+	if (c->close) {
+		client_close(c);
+		return -1;
+	}
+
+	/* Ready for the next request (or event) on this connection */
+	if (c->state == CLIENT_WRITING) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+	if (c->stream) {
+		c->state = CLIENT_STREAMING;
+	} else {
+		c->state = CLIENT_READING;
+		c->deadline = time(NULL) + HTTPD_IDLE;
+	}
+	return 0;
+}
+
+/*
+ * Queue an event for a stream client. If its ring is full it isn't
+ * keeping up, so it's dropped rather than letting the backlog grow.
+ */
+static void client_push(struct httpd_client *c, struct httpd_doc *doc)
+{
+	if (c->count == HTTPD_STREAM_RING) {
+		slow_clients++;
+		if (debug)
+			printf("HTTP server: dropping slow stream client\n");
+		client_close(c);
+		return;
+	}
+
+	c->ring[(c->head + c->count) % HTTPD_STREAM_RING] = doc_hold(doc);
+	c->count++;
+	if (c->state == CLIENT_STREAMING)
+		client_write(c);
+}
+
+static void stream_push(struct httpd_doc *doc)
+{
+	struct httpd_client *c, *next;
+
+	for (c = clients; c; c = next) {
+		next = c->next;
+		if (c->stream)
+			client_push(c, doc);
+	}
+}
+
+static int client_send(struct httpd_client *c, struct httpd_doc *doc)
+{
+	c->doc = doc;
+	c->sent = 0;
+	if (!doc) {
+		client_close(c);
+		return -1;
+	}
+	return client_write(c);
+}
+
+/*
+ * Handle a complete request. Returns -1 if the client was closed.
+ */
+static int client_request(struct httpd_client *c)
+{
+	char *method, *path, *version, *query, *line, *save;
+	char match[32] = "";
+	char buf[16];
+	struct httpd_doc *doc;
+	int wait = 0;
+
+	method = strtok_r(c->req, " ", &save);
+	path = strtok_r(NULL, " ", &save);
+	version = strtok_r(NULL, "\r\n", &save);
+	if (!method || !path || !version)
+		return client_send(c, doc_error("400 Bad Request"));
+
+	c->close = (strcmp(version, "HTTP/1.1") != 0);
+	while ((line = strtok_r(NULL, "\r\n", &save)) != NULL) {
+		if (strncasecmp(line, "If-None-Match:", 14) == 0) {
+			line += 14;
+			line += strspn(line, " \t");
+			snprintf(match, sizeof(match), "%s", line);
+		} else if (strncasecmp(line, "Connection:", 11) == 0) {
+			if (strcasestr(line, "close"))
+				c->close = 1;
+			else if (strcasestr(line, "keep-alive"))
+				c->close = 0;
+		}
+	}
+
+	if (strcmp(method, "GET") != 0)
+		return client_send(c, doc_error("405 Method Not Allowed"));
+
+	if ((query = strchr(path, '?')))
+		*query++ = '\0';
+
+	if (strcmp(path, "/history") == 0)
+		return client_send(c, history_doc(query));
+
+	if (strcmp(path, "/stream") == 0) {
+		c->stream = 1;
+		c->close = 0;
+		c->deadline = time(NULL);
+		nstreams++;
+		return client_send(c, doc_raw("HTTP/1.1 200 OK\r\n"
+					"Content-Type: text/event-stream\r\n"
+					"Cache-Control: no-cache\r\n"
+					"\r\n"
+					"retry: 5000\n\n"));
+	}
+
+	if ((strcmp(path, "/current") != 0) && (strcmp(path, "/") != 0))
+		return client_send(c, doc_error("404 Not Found"));
+
+	if (query_param(query, "wait", buf, sizeof(buf)))
+		wait = atoi(buf);
+	if (wait > HTTPD_MAX_WAIT)
+		wait = HTTPD_MAX_WAIT;
+
+	pthread_mutex_lock(&lock);
+	if (!current) {
+		doc = NULL;
+	} else if (strcmp(match, etag) != 0) {
+		doc = doc_hold(current);
+	} else if (wait > 0) {
+		/* Client is up to date, hold it until the next sample */
+		pthread_mutex_unlock(&lock);
+		c->state = CLIENT_WAITING;
+		c->deadline = time(NULL) + wait;
+		return 0;
+	} else {
+		doc = doc_hold(current_304);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (!doc)
+		doc = doc_error("503 Service Unavailable");
+	return client_send(c, doc);
+}
+
+static void client_read(struct httpd_client *c)
+{
+	ssize_t n;
+	char *end;
+
+	if (c->state != CLIENT_READING) {
+		/* A waiting client shouldn't send anything, unless it closed */
+		char tmp[256];
+		n = recv(c->fd, tmp, sizeof(tmp), 0);
+		if ((n == 0) || ((n < 0) && (errno != EAGAIN)))
+			client_close(c);
+		return;
+	}
+
+	while (1) {
+		n = recv(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				client_close(c);
+			return;
+		}
+		if (n == 0) {
+			client_close(c);
+			return;
+		}
+		c->len += n;
+		c->req[c->len] = '\0';
+
+		/* Requests are GETs, no body to wait for */
+		while ((c->state == CLIENT_READING) &&
+				((end = strstr(c->req, "\r\n\r\n")) != NULL)) {
+			int used = end + 4 - c->req;
+			char next[HTTPD_REQUEST_SIZE];
+			int rest = c->len - used;
+
+			memcpy(next, end + 4, rest);
+			end[2] = '\0';
+			if (client_request(c) < 0)
+				return;
+			memcpy(c->req, next, rest);
+			c->len = rest;
+			c->req[c->len] = '\0';
+		}
+
+		if (c->len >= (int)sizeof(c->req) - 1) {
+			client_send(c, doc_error("431 Request Header Fields Too Large"));
+			return;
+		}
+	}
+}
+
+static void client_accept(void)
+{
+	struct httpd_client *c;
+	struct epoll_event ev;
+	int one = 1;
+	int fd;
+
+	while ((fd = accept4(listen_fd, NULL, NULL,
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if ((nclients >= max_clients) || !(c = calloc(1, sizeof(*c)))) {
+			close(fd);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c->fd = fd;
+		c->deadline = time(NULL) + HTTPD_IDLE;
+		c->next = clients;
+		if (clients)
+			clients->prev = c;
+		clients = c;
+		nclients++;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+/*
+ * Woken by another thread. Send stream events and, if a new sample
+ * was rendered, send it to everyone waiting for it.
+ */
+static void wake_waiting(void)
+{
+	struct httpd_doc *events[HTTPD_PENDING];
+	struct httpd_client *c, *next;
+	struct httpd_doc *doc;
+	unsigned long gen;
+	static unsigned long seen = 0;
+	uint64_t n;
+	int count;
+	int i;
+
+	if (read(wake_fd, &n, sizeof(n)) < 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	count = npending;
+	memcpy(events, pending, count * sizeof(pending[0]));
+	npending = 0;
+	gen = generation;
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < count; i++) {
+		stream_push(events[i]);
+		doc_put(events[i]);
+	}
+
+	if (gen == seen)
+		return;
+	seen = gen;
+
+	for (c = clients; c; c = next) {
+		next = c->next;
+		if (c->state != CLIENT_WAITING)
+			continue;
+		pthread_mutex_lock(&lock);
+		doc = doc_hold(current);
+		pthread_mutex_unlock(&lock);
+		client_send(c, doc);
+	}
+}
+
+/*
+ * Hand a stream event to the server thread. Safe to call from any
+ * thread, it never waits on a client.
+ */
+static void stream_event(struct httpd_doc *doc)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&lock);
+	if (npending < HTTPD_PENDING) {
+		pending[npending++] = doc;
+		doc = NULL;
+	} else {
+		lost_events++;
+	}
+	pthread_mutex_unlock(&lock);
+
+	doc_put(doc);
+	if (write(wake_fd, &one, sizeof(one)) < 0)
+		fprintf(stderr, "HTTP server: failed to wake server thread\n");
+}
+
+/*
+ * Close idle connections and answer long-polls that timed out.
+ */
+static void check_timeouts(time_t now)
+{
+	struct httpd_client *c, *next;
+	struct httpd_doc *doc;
+
+	for (c = clients; c; c = next) {
+		next = c->next;
+		if (c->stream) {
+			if (now - c->deadline >= HTTPD_HEARTBEAT) {
+				c->deadline = now;
+				client_push(c, heartbeat);
+			}
+			continue;
+		}
+		if (c->deadline > now)
+			continue;
+		if (c->state == CLIENT_WAITING) {
+			pthread_mutex_lock(&lock);
+			doc = doc_hold(current_304);
+			pthread_mutex_unlock(&lock);
+			client_send(c, doc);
+		} else {
+			client_close(c);
+		}
+	}
+}
+
+static void *httpd_thread(void *arg)
+{
+	struct epoll_event events[64];
+	struct httpd_client *c;
+	time_t last = 0;
+	int n, i;
+
+	while (running) {
+		n = epoll_wait(epfd, events, 64, 1000);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &listen_fd) {
+				client_accept();
+			} else if (events[i].data.ptr == &wake_fd) {
+				wake_waiting();
+			} else {
+				c = events[i].data.ptr;
+				if (events[i].events & EPOLLOUT)
+					client_write(c);
+				else
+					client_read(c);
+			}
+		}
+
+		if (time(NULL) != last) {
+			last = time(NULL);
+			check_timeouts(last);
+		}
+	}
+
+	while (clients)
+		client_close(clients);
+
+	return NULL;
+}
+
+static int httpd_start(void)
+{
+	struct sockaddr_in sa;
+	struct epoll_event ev;
+	int one = 1;
+	int err;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind_host && (inet_pton(AF_INET, bind_host, &sa.sin_addr) != 1)) {
+		fprintf(stderr, "HTTP server: bad address %s\n", bind_host);
+		return -1;
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if ((listen_fd < 0) || bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+			listen(listen_fd, 128)) {
+		fprintf(stderr, "HTTP server: can't listen on port %d: %s\n", port,
+				strerror(errno));
+		goto fail;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((epfd < 0) || (wake_fd < 0))
+		goto fail;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.ptr = &wake_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+	heartbeat = doc_raw(": keep-alive\n\n");
+
+	running = 1;
+	if ((err = pthread_create(&thread, NULL, httpd_thread, NULL))) {
+		fprintf(stderr, "Failed to start HTTP server thread: %s\n",
+				strerror(err));
+		running = 0;
+		goto fail;
+	}
+
+	backoff = 0;
+	if (debug)
+		printf("HTTP server listening on port %d\n", port);
+	return 0;
+
+fail:
+	if (listen_fd >= 0)
+		close(listen_fd);
+	if (epfd >= 0)
+		close(epfd);
+	if (wake_fd >= 0)
+		close(wake_fd);
+	listen_fd = epfd = wake_fd = -1;
+
+	/* Wait a bit longer each time before trying again. */
+	backoff = backoff ? backoff * 2 : HTTPD_BACKOFF_MIN;
+	if (backoff > HTTPD_BACKOFF_MAX)
+		backoff = HTTPD_BACKOFF_MAX;
+	retry_at = time(NULL) + backoff;
+	fprintf(stderr, "HTTP server: not started, retrying in %d seconds\n",
+			backoff);
+	return -1;
+}
+
+/*
+ * Render the new sample and make it the current response.
+ */
+static int httpd_update(struct cfg_info *cfg, struct station_info *station,
+		const weather_data_t *wd, uint64_t changed)
+{
+	struct httpd_doc *doc, *doc_304, *old, *old_304;
+	char tag[32];
+	char extra[64];
+	char *json;
+	uint64_t one = 1;
+
+	/*
+	 * init is called even when the service is disabled, so the
+	 * server isn't started until there's something to serve.
+	 */
+	if (!running && ((time(NULL) < retry_at) || httpd_start()))
+		return 0;
+
+
+	if (!(json = render_json(cfg, wd)))
+		return 0;
+
+	/*
+	 * Only this thread changes generation. It's bumped along with
+	 * current, so a wake never sees the new generation with the old
+	 * response.
+	 */
+	snprintf(tag, sizeof(tag), "\"%lx-%lu\"", (unsigned long)wd->time,
+			generation + 1);
+	snprintf(extra, sizeof(extra), "ETag: %s\r\n", tag);
+
+	doc = doc_create("200 OK", extra, "application/json", json);
+	doc_304 = doc_not_modified(extra);
+	free(json);
+	if (!doc || !doc_304) {
+		doc_put(doc);
+		doc_put(doc_304);
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	old = current;
+	old_304 = current_304;
+	current = doc;
+	current_304 = doc_304;
+	strcpy(etag, tag);
+	generation++;
+	pthread_mutex_unlock(&lock);
+
+	doc_put(old);
+	doc_put(old_304);
+
+	if (__atomic_load_n(&nstreams, __ATOMIC_RELAXED) &&
+			(json = malloc(doc->len + 32))) {
+		sprintf(json, "event: observation\ndata: %s\n\n",
+				strstr(doc->data, "\r\n\r\n") + 4);
+		stream_event(doc_raw(json));
+		free(json);
+	}
+
+	if (write(wake_fd, &one, sizeof(one)) < 0)
+		fprintf(stderr, "HTTP server: failed to wake server thread\n");
+
+	return 0;
+}
+
+/*
+ * Stream the events that aren't part of a sample. Called on the main
+ * thread as each packet arrives, so this only formats the event and
+ * hands it off.
+ */
+static void httpd_event(struct cfg_info *cfg, const struct wf_packet *pkt)
+{
+	const double *ev = pkt->obs[0];
+	char buf[256];
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) ||
+			!__atomic_load_n(&nstreams, __ATOMIC_RELAXED) || (pkt->rows < 1))
+		return;
+
+	switch (pkt->type) {
+		case WF_RAPID_WIND:
+			if (pkt->cols[0] < 3)
+				return;
+			snprintf(buf, sizeof(buf), "event: rapid_wind\ndata: "
+					"{\"time\":%.0f,\"speed\":%.2f,\"direction\":%.0f}\n\n",
+					ev[0], cfg->metric ? ev[1] : MS2MPH(ev[1]), ev[2]);
+			break;
+		case WF_EVT_STRIKE:
+			if (pkt->cols[0] < 3)
+				return;
+			snprintf(buf, sizeof(buf), "event: strike\ndata: "
+					"{\"time\":%.0f,\"distance\":%.1f,\"energy\":%.0f}\n\n",
+					ev[0], cfg->metric ? ev[1] : km2miles(ev[1]), ev[2]);
+			break;
+		case WF_EVT_PRECIP:
+			snprintf(buf, sizeof(buf), "event: precip\ndata: "
+					"{\"time\":%.0f}\n\n", ev[0]);
+			break;
+		default:
+			return;
+	}
+
+	stream_event(doc_raw(buf));
+}
+
+static int httpd_init(struct cfg_info *cfg, int d)
+{
+	debug = d;
+
+	if (cfg->host && cfg->host[0])
+		bind_host = strdup(cfg->host);
+	if (cfg->extra && cfg->extra[0])
+		port = atoi(cfg->extra);
+	max_clients = cfg_int(cfg, "max_clients", HTTPD_MAX_CLIENTS);
+
+	return 0;
+}
+
+static void httpd_cleanup(void)
+{
+	uint64_t one = 1;
+
+	if (running) {
+		running = 0;
+		if (write(wake_fd, &one, sizeof(one)) < 0)
+			fprintf(stderr, "HTTP server: failed to wake server thread\n");
+		pthread_join(thread, NULL);
+	}
+
+	if (listen_fd >= 0)
+		close(listen_fd);
+	if (epfd >= 0)
+		close(epfd);
+	if (wake_fd >= 0)
+		close(wake_fd);
+	listen_fd = epfd = wake_fd = -1;
+
+	doc_put(current);
+	doc_put(current_304);
+	current = current_304 = NULL;
+	while (npending)
+		doc_put(pending[--npending]);
+	doc_put(heartbeat);
+	heartbeat = NULL;
+	if (slow_clients || lost_events)
+		printf("HTTP server: %lu slow stream clients dropped, %lu events "
+				"lost\n", slow_clients, lost_events);
+	free(bind_host);
+	bind_host = NULL;
+}
+
+static const struct publisher_funcs httpd_funcs = {
+	.init = httpd_init,
+	.update = httpd_update,
+	.event = httpd_event,
+	.cleanup = httpd_cleanup
+};
+
+void httpd_setup(struct service_info *sinfo)
+{
+	sinfo->funcs = httpd_funcs;
+	return;
+}
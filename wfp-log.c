@@ -18,55 +18,353 @@
  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
+ *
+ * Local log to file
+ *
+ * Log the weather data to a local file on the filesystem, one line
+ * per sample.
+ *
+ * The file is kept open and lines are collected in a buffer that's
+ * written out once it's "flush" seconds old (default 10, 0 writes
+ * every line as it comes). The log is rotated when it would grow
+ * past "max_size" kilobytes and/or, with "rotate_daily", at local
+ * midnight. The old file is renamed to <file>.YYYYMMDD-HHMMSS, after
+ * the time it was started, and compressed in the background with
+ * gzip or zstd if "compress" says so. Only the newest "keep" old
+ * files are kept, 0 keeps them all.
+ *
+ * SIGHUP closes and reopens the file, for use with an external log
+ * rotator.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <sys/time.h>
-#include <netdb.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <signal.h>
 #include <math.h>
 #include "wfp.h"
 
+#define LOG_BUFFER 65536
+#define LOG_LINE 512
+#define LOG_FLUSH 10			/* default seconds to hold lines */
+#define LOG_KEEP 30				/* default old files kept */
+
 extern char *time_stamp(int gmt, int mode);
+extern char **environ;
 
 static int debug;
 
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *log_path;
+static int log_fd = -1;
+static off_t log_size;			/* including what's buffered */
+static time_t log_started;		/* time of the first line in the file */
+static int log_day;				/* local day of log_started */
+static char *log_buf;
+static int log_len;
+static time_t log_oldest;		/* when the oldest buffered line was added */
+static int reopen;				/* set by SIGHUP */
+
+static int flush_interval = LOG_FLUSH;
+static off_t max_size;
+static int rotate_daily;
+static int keep = LOG_KEEP;
+static const char *compress_cmd;
+
+static int local_day(time_t t)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	return (tm.tm_year + 1900) * 1000 + tm.tm_yday;
+}
+
 /*
- * Local log to file
- *
- * Log the weather data to a local file on the filesystem
+ * Write out everything that's buffered. Called with the lock held.
  */
-void send_to_log(struct cfg_info *cfg, struct station_info *station,
-				weather_data_t *wd)
+static int log_flush(void)
+{
+	ssize_t n;
+	int off = 0;
+	int ret = 0;
+
+	if (log_fd < 0) {
+		log_len = 0;
+		return -1;
+	}
+
+	while (off < log_len) {
+		n = write(log_fd, log_buf + off, log_len - off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to write to %s: %s\n", log_path,
+					strerror(errno));
+			/* Try a fresh file next time */
+			close(log_fd);
+			log_fd = -1;
+			ret = -1;
+			break;
+		}
+		off += n;
+	}
+
+	log_len = 0;
+	return ret;
+}
+
+static int log_open(void)
+{
+	struct stat st;
+
+	log_fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (log_fd < 0) {
+		fprintf(stderr, "Failed to open file %s for writing: %s\n",
+				log_path, strerror(errno));
+		return -1;
+	}
+
+	log_size = 0;
+	log_started = time(NULL);
+	if ((fstat(log_fd, &st) == 0) && (st.st_size > 0)) {
+		log_size = st.st_size;
+		log_started = st.st_mtime;
+	}
+	log_day = local_day(log_started);
+
+	return 0;
+}
+
+/*
+ * Delete the oldest rotated files so only "keep" are left. Their
+ * names sort by age.
+ */
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)b, *(char * const *)a);
+}
+
+static void log_prune(void)
+{
+	char dir[256], path[512];
+	const char *base, *slash;
+	struct dirent *de;
+	char **names = NULL;
+	int count = 0;
+	int len;
+	DIR *d;
+	int i;
+
+	if (keep <= 0)
+		return;
+
+	slash = strrchr(log_path, '/');
+	base = slash ? slash + 1 : log_path;
+	snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - log_path) : 1,
+			slash ? log_path : ".");
+	if (dir[0] == '\0')
+		strcpy(dir, "/");
+	len = strlen(base);
+
+	if (!(d = opendir(dir)))
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if ((strncmp(de->d_name, base, len) != 0) ||
+				(de->d_name[len] != '.'))
+			continue;
+		if (!(count & 63) &&
+				!(names = realloc(names, (count + 64) * sizeof(char *))))
+			break;
+		names[count++] = strdup(de->d_name);
+	}
+	closedir(d);
+
+	if (names) {
+		qsort(names, count, sizeof(char *), name_cmp);
+		for (i = 0; i < count; i++) {
+			if (i >= keep) {
+				snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+				unlink(path);
+			}
+			free(names[i]);
+		}
+		free(names);
+	}
+}
+
+/*
+ * Compress a rotated file and prune the old ones. Runs on its own
+ * detached thread so the log service isn't held up.
+ */
+static void *log_compress(void *arg)
+{
+	char *file = arg;
+	char *argv[5];
+	posix_spawnattr_t attr;
+	sigset_t none;
+	pid_t pid;
+	int status;
+	int i = 0;
+
+	if (compress_cmd) {
+		argv[i++] = (char *)compress_cmd;
+		argv[i++] = "-q";
+		if (strcmp(compress_cmd, "zstd") == 0)
+			argv[i++] = "--rm";
+		argv[i++] = file;
+		argv[i] = NULL;
+
+		/* We block signals for the event loop, the child shouldn't */
+		sigemptyset(&none);
+		posix_spawnattr_init(&attr);
+		posix_spawnattr_setsigmask(&attr, &none);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+		if (posix_spawnp(&pid, compress_cmd, NULL, &attr, argv, environ))
+			fprintf(stderr, "Failed to run %s on %s\n", compress_cmd, file);
+		else if ((waitpid(pid, &status, 0) == pid) &&
+				(!WIFEXITED(status) || WEXITSTATUS(status)))
+			fprintf(stderr, "%s %s failed\n", compress_cmd, file);
+		posix_spawnattr_destroy(&attr);
+	}
+
+	pthread_mutex_lock(&log_lock);
+	log_prune();
+	pthread_mutex_unlock(&log_lock);
+
+	free(file);
+	return NULL;
+}
+
+static int rotated_exists(const char *name)
+{
+	char path[600];
+
+	if (access(name, F_OK) == 0)
+		return 1;
+	snprintf(path, sizeof(path), "%s.gz", name);
+	if (access(path, F_OK) == 0)
+		return 1;
+	snprintf(path, sizeof(path), "%s.zst", name);
+	return access(path, F_OK) == 0;
+}
+
+/*
+ * Move the current file aside and start a new one. Called with the
+ * lock held.
+ */
+static void log_rotate(void)
+{
+	char stamp[32];
+	pthread_attr_t attr;
+	pthread_t thread;
+	struct tm tm;
+	char *old;
+	int n = 0;
+
+	log_flush();
+	if (log_fd >= 0)
+		close(log_fd);
+	log_fd = -1;
+
+	localtime_r(&log_started, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	if (!(old = malloc(strlen(log_path) + sizeof(stamp) + 16)))
+		return;
+	sprintf(old, "%s.%s", log_path, stamp);
+
+	/* Small files can rotate more than once a second */
+	while (rotated_exists(old) && (n < 1000))
+		sprintf(old, "%s.%s-%d", log_path, stamp, ++n);
+
+	if (rename(log_path, old) < 0) {
+		fprintf(stderr, "Failed to rotate %s: %s\n", log_path,
+				strerror(errno));
+		free(old);
+		return;
+	}
+
+	if (debug)
+		fprintf(stderr, "Rotated %s to %s\n", log_path, old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, log_compress, old)) {
+		fprintf(stderr, "Failed to start log compression for %s\n", old);
+		free(old);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Add a line, rotating first if it's time.
+ */
+static void log_write(const char *line, int len, time_t t)
+{
+	pthread_mutex_lock(&log_lock);
+
+	if (reopen) {
+		reopen = 0;
+		log_flush();
+		if (log_fd >= 0)
+			close(log_fd);
+		log_fd = -1;
+	}
+
+	if ((log_fd >= 0) && (log_size > 0) &&
+			((max_size && (log_size + len > max_size)) ||
+			 (rotate_daily && (local_day(t) != log_day))))
+		log_rotate();
+
+	if ((log_fd < 0) && (log_open() < 0)) {
+		log_len = 0;
+		pthread_mutex_unlock(&log_lock);
+		return;
+	}
+
+	if (log_len + len > LOG_BUFFER)
+		log_flush();
+	if (log_len == 0)
+		log_oldest = time(NULL);
+	memcpy(log_buf + log_len, line, len);
+	log_len += len;
+	log_size += len;
+
+	if (time(NULL) - log_oldest >= flush_interval)
+		log_flush();
+
+	pthread_mutex_unlock(&log_lock);
+}
+
+int send_to_log(struct cfg_info *cfg, struct station_info *station,
+				const weather_data_t *wd, uint64_t changed)
 {
 	struct timeval start, end;
 	char *ts_start, *ts_end;
-	time_t t = time(NULL);
-	struct tm* lt = localtime(&t);
-	FILE *fp;
-	char p_str[5];
-	char m_str[4];
+	time_t t = wd->time ? wd->time : time(NULL);
+	struct tm lt;
+	char line[LOG_LINE];
+	const char *p_str;
+	const char *m_str;
+	int len;
 
 	gettimeofday(&start, NULL);
 
 	if (!cfg->metric) {
-		unit_convert(wd, CONVERT_ALL);
-		sprintf(p_str, "HgIn");
-		sprintf(m_str, "mph");
+		p_str = "HgIn";
+		m_str = "mph";
 	} else {
-		sprintf(p_str, "mb");
-		sprintf(m_str, "m/s");
-	}
-
-	fp = fopen(cfg->host, "a");
-	if (fp == NULL) {
-		fprintf(stderr, "Failed to open file %s for writing\n", cfg->host);
-		goto end;
+		p_str = "mb";
+		m_str = "m/s";
 	}
 
 	if (debug) {
@@ -75,11 +373,12 @@ void send_to_log(struct cfg_info *cfg, struct station_info *station,
 		free(ts_start);
 	}
 
-	fprintf(fp, "%4d-%02d-%02d %02d:%02d:%02d",
-			lt->tm_year + 1900, lt->tm_mon + 1, lt->tm_mday,
-			lt->tm_hour, lt->tm_min, lt->tm_sec);
-
-	fprintf(fp, "|%.2f%s|%.2f|%.2f|%.2f|%.2f|%.2f|%3.0f|%.1f%s|%.1f%s|%.1f%%|%.1fº|%.1fº\n",
+	localtime_r(&t, &lt);
+	len = snprintf(line, sizeof(line),
+			"%4d-%02d-%02d %02d:%02d:%02d"
+			"|%.2f%s|%.2f|%.2f|%.2f|%.2f|%.2f|%3.0f|%.1f%s|%.1f%s|%.1f%%|%.1fº|%.1fº\n",
+			lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday,
+			lt.tm_hour, lt.tm_min, lt.tm_sec,
 			wd->pressure,
 			p_str,
 			wd->rainfall_year,
@@ -95,10 +394,10 @@ void send_to_log(struct cfg_info *cfg, struct station_info *station,
 			wd->humidity,
 			wd->dewpoint,
 			wd->temperature);
+	if (len >= (int)sizeof(line))
+		len = sizeof(line) - 1;
 
-	fclose (fp);
-
-end:
+	log_write(line, len, t);
 
 	gettimeofday(&end, NULL);
 	if (debug) {
@@ -113,19 +412,75 @@ end:
 		free(ts_end);
 	}
 
-	return;
+	return 0;
+}
+
+/*
+ * Called once a second from the main loop, so lines don't sit in
+ * the buffer when samples stop coming.
+ */
+void log_tick(time_t now)
+{
+	pthread_mutex_lock(&log_lock);
+	if (log_len && (log_fd >= 0) && (now - log_oldest >= flush_interval))
+		log_flush();
+	pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * SIGHUP. The file is reopened before the next line is written.
+ */
+void log_reopen(void)
+{
+	pthread_mutex_lock(&log_lock);
+	reopen = 1;
+	pthread_mutex_unlock(&log_lock);
 }
 
 static int log_init(struct cfg_info *cfg, int d)
 {
+	const char *c;
+
 	debug = d;
+	log_path = cfg->host;
+
+	flush_interval = cfg_int(cfg, "flush", LOG_FLUSH);
+	max_size = (off_t)cfg_int(cfg, "max_size", 0) * 1024;
+	rotate_daily = cfg_int(cfg, "rotate_daily", 0);
+	keep = cfg_int(cfg, "keep", LOG_KEEP);
+
+	c = cfg_string(cfg, "compress", "");
+	if ((strcmp(c, "gzip") == 0) || (strcmp(c, "zstd") == 0))
+		compress_cmd = c;
+	else if (c[0] != '\0')
+		fprintf(stderr, "Unknown log compression %s\n", c);
+
+	log_buf = malloc(LOG_BUFFER);
+	if (!log_buf) {
+		fprintf(stderr, "Failed to allocate log buffer\n");
+		return -1;
+	}
+
 	return 0;
 }
 
+static void log_cleanup(void)
+{
+	pthread_mutex_lock(&log_lock);
+	if (log_fd >= 0) {
+		log_flush();
+		close(log_fd);
+		log_fd = -1;
+	}
+	free(log_buf);
+	log_buf = NULL;
+	pthread_mutex_unlock(&log_lock);
+}
+
 static const struct publisher_funcs log_funcs = {
 	.init = log_init,
 	.update = send_to_log,
-	.cleanup = NULL
+	.cleanup = log_cleanup
 };
 
 void log_setup(struct service_info *sinfo)
@@ -133,4 +488,3 @@ void log_setup(struct service_info *sinfo)
 	sinfo->funcs = log_funcs;
 	return;
 }
-
@@ -20,6 +20,30 @@
  * THE SOFTWARE.
  *
  * Publish weather data to a MQTT broker.
+ *
+ * Two ways of publishing, either or both can be enabled:
+ *
+ *   "json"   one compact JSON document with every value and the
+ *            tower sensors, sent to <prefix>/state each cycle.
+ *   "fields" a topic per value, <prefix>/temperature etc. and
+ *            <sensor_prefix>/<location>/temperature for the tower
+ *            sensors. With "changes_only" a value is only sent when
+ *            it has moved more than its deadband since it was last
+ *            sent (see wfp-change.c).
+ *
+ * Things that don't change, the station name, location and so on,
+ * are sent once, retained, when we connect. With "discovery" set,
+ * Home Assistant discovery configs for every value and tower sensor
+ * are sent at the same time and the values default to retained and
+ * changes only, so Home Assistant picks everything up on its own
+ * and only sees traffic when something changes.
+ *
+ * The connection is run by libmosquitto's own network thread, which
+ * handles keepalives and QoS acknowledgements and reconnects with
+ * an increasing delay when the broker goes away. While disconnected,
+ * messages are held in a bounded queue ("offline_queue" messages,
+ * oldest dropped first) and sent, in order, once the connection is
+ * back.
  */
 
 #include <stdio.h>
@@ -32,219 +56,789 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <math.h>
 #include "wfp.h"
 #include <mosquitto.h>
 
-extern double TempF(double c);
-extern double MS2MPH(double ms);
-extern double mb2in(double mb);
+#define MQTT_MAX_SENSORS 8
+#define MQTT_TOPIC_SIZE 128
+#define MQTT_JSON_SIZE 4096
+#define MQTT_KEEPALIVE 60
+#define MQTT_RECONNECT_MIN 1	/* seconds, doubled on each failure */
+#define MQTT_RECONNECT_MAX 120
+#define MQTT_OFFLINE_QUEUE 500
+
+extern int verbose;
+
+static struct mosquitto *mosq = NULL;
+
+static int mqtt_start(struct cfg_info *cfg);
+
+/* Home Assistant device class, indexed by wd_unit */
+static const char *ha_classes[UNIT_CLASSES] = {
+	[UNIT_NONE]      = NULL,
+	[UNIT_TEMP]      = "temperature",
+	[UNIT_HUMIDITY]  = "humidity",
+	[UNIT_PRESSURE]  = "atmospheric_pressure",
+	[UNIT_SPEED]     = "wind_speed",
+	[UNIT_DIRECTION] = NULL,
+	[UNIT_LIGHT]     = "illuminance",
+	[UNIT_SOLAR]     = "irradiance",
+	[UNIT_COUNT]     = NULL,
+	[UNIT_DISTANCE]  = "distance",
+	[UNIT_RAIN]      = "precipitation",
+};
+
+static const struct {
+	const char *name;		/* topic and JSON key */
+	enum wd_field field;
+} mqtt_fields[] = {
+	{ "temperature",       WD_TEMPERATURE },
+	{ "high_temperature",  WD_TEMPERATURE_HIGH },
+	{ "low_temperature",   WD_TEMPERATURE_LOW },
+	{ "humidity",          WD_HUMIDITY },
+	{ "pressure",          WD_PRESSURE },
+	{ "sealevel",          WD_PRESSURE_SEALEVEL },
+	{ "pressure_trend",    WD_TREND },
+	{ "pressure_change",   WD_PRESSURE_CHANGE },
+	{ "pressure_tendency", WD_TENDENCY },
+	{ "wind_speed",        WD_WINDSPEED },
+	{ "gust_speed",        WD_GUSTSPEED },
+	{ "wind_direction",    WD_WINDDIRECTION },
+	{ "gust_direction",    WD_GUSTDIRECTION },
+	{ "dewpoint",          WD_DEWPOINT },
+	{ "heat_index",        WD_HEATINDEX },
+	{ "windchill",         WD_WINDCHILL },
+	{ "feels_like",        WD_FEELSLIKE },
+	{ "illumination",      WD_ILLUMINATION },
+	{ "solar_radiation",   WD_SOLAR },
+	{ "UV_index",          WD_UV },
+	{ "lightning_strikes", WD_STRIKES },
+	{ "lightning_distance",WD_DISTANCE },
+	{ "rain",              WD_RAIN },
+	{ "daily_rain",        WD_DAILY_RAIN },
+	{ "hour_rain",         WD_RAINFALL_1HR },
+	{ "day_rain",          WD_RAINFALL_DAY },
+	{ "month_rain",        WD_RAINFALL_MONTH },
+	{ "year_rain",         WD_RAINFALL_YEAR },
+	{ "rain_60min",        WD_RAINFALL_60MIN },
+	{ "rain_24hr",         WD_RAINFALL_24HR },
+};
 
-struct mosquitto *mosq = NULL;
+#define MQTT_FIELDS (sizeof(mqtt_fields) / sizeof(mqtt_fields[0]))
+
+static const struct {
+	const char *name;
+	size_t offset;
+	int precision;
+	double deadband;
+	enum wd_unit unit;
+} sensor_fields[] = {
+	{ "temperature",      offsetof(struct sensor_data, temperature),       1, 0.1, UNIT_TEMP },
+	{ "high_temperature", offsetof(struct sensor_data, temperature_high),  1, 0,   UNIT_TEMP },
+	{ "low_temperature",  offsetof(struct sensor_data, temperature_low),   1, 0,   UNIT_TEMP },
+	{ "humidity",         offsetof(struct sensor_data, humidity),          0, 1,   UNIT_HUMIDITY },
+};
 
-static int mqtt_init(struct cfg_info *cfg, int debug)
+#define SENSOR_FIELDS (sizeof(sensor_fields) / sizeof(sensor_fields[0]))
+
+/* What was last sent on each tower sensor topic */
+struct mqtt_last {
+	int sent;
+	double value;
+};
+
+struct mqtt_sensor {
+	char location[50];
+	int announced;			/* discovery config sent */
+	struct mqtt_last last[SENSOR_FIELDS];
+};
+
+static const char *prefix = "home/climate";
+static const char *sensor_prefix = "home";
+static int qos = 0;
+static bool retain = false;
+static int send_json = 0;
+static int send_fields = 1;
+static int changes_only = 0;
+static char last_wind_dir[4];
+static struct mqtt_sensor sensors[MQTT_MAX_SENSORS];
+static int failures;
+static int discovery = 0;
+static const char *discovery_prefix = "homeassistant";
+static char node_id[64];
+static char status_topic[MQTT_TOPIC_SIZE];
+static int announce = 1;		/* send the retained messages next cycle */
+
+/*
+ * Messages waiting for the broker. The worker thread adds to it and
+ * the network thread empties it when it connects, so it's guarded
+ * by offline_lock along with connected.
+ */
+struct mqtt_msg {
+	char *topic;
+	char *payload;
+	int len;
+	int qos;
+	bool retain;
+	struct mqtt_msg *next;
+};
+
+static pthread_mutex_t offline_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mqtt_msg *offline_head;
+static struct mqtt_msg *offline_tail;
+static int offline_count;
+static int offline_max = MQTT_OFFLINE_QUEUE;
+static int offline_dropped;
+static int connected;
+
+/*
+ * Queue a message until we're connected again. Called with
+ * offline_lock held.
+ */
+static void offline_add(const char *topic, const char *payload, int len,
+		bool keep)
 {
-	int port;
-	int ret;
+	struct mqtt_msg *m;
 
-	mosquitto_lib_init();
+	if (offline_max <= 0) {
+		failures++;
+		return;
+	}
 
-	/* Create runtime instance with random client ID */
-	mosq = mosquitto_new(NULL, true, NULL);
-	if (!mosq) {
-		fprintf(stderr, "Failed to initialize a MQTT instance.\n");
-		return -1;
+	if (offline_count >= offline_max) {
+		m = offline_head;
+		offline_head = m->next;
+		if (!offline_head)
+			offline_tail = NULL;
+		offline_count--;
+		offline_dropped++;
+		free(m);
 	}
 
-	//mosquitto_username_pw_set (mosq, cfg->name, cfg->pass);
+	if (!(m = malloc(sizeof(struct mqtt_msg) + strlen(topic) + 1 + len))) {
+		failures++;
+		return;
+	}
+	m->topic = (char *)(m + 1);
+	strcpy(m->topic, topic);
+	m->payload = m->topic + strlen(topic) + 1;
+	memcpy(m->payload, payload, len);
+	m->len = len;
+	m->qos = qos;
+	m->retain = keep;
+	m->next = NULL;
+
+	if (offline_tail)
+		offline_tail->next = m;
+	else
+		offline_head = m;
+	offline_tail = m;
+	offline_count++;
+}
 
-	/* Connect to MQTT broker */
-	port = atoi(cfg->extra);
-	ret = mosquitto_connect(mosq, cfg->host, port, 0);
-	if (ret) {
-		fprintf (stderr, "Can't connect to Mosquitto broker %s\n",
-				cfg->host);
-		return -1;
+/*
+ * Send everything that was queued while we were disconnected. Called
+ * with offline_lock held.
+ */
+static void offline_flush(void)
+{
+	struct mqtt_msg *m;
+	int sent = 0;
+
+	while ((m = offline_head) != NULL) {
+		if (mosquitto_publish(mosq, NULL, m->topic, m->len, m->payload,
+					m->qos, m->retain) != MOSQ_ERR_SUCCESS)
+			break;
+		offline_head = m->next;
+		if (!offline_head)
+			offline_tail = NULL;
+		offline_count--;
+		sent++;
+		free(m);
+	}
+
+	if (sent && verbose)
+		fprintf(stderr, "MQTT: sent %d queued messages\n", sent);
+	if (offline_dropped) {
+		fprintf(stderr, "MQTT: %d messages were dropped while disconnected\n",
+				offline_dropped);
+		offline_dropped = 0;
 	}
+}
+
+/*
+ * Publish a message, or queue it if we aren't connected. Anything
+ * already queued goes first so that messages stay in order.
+ */
+static void mqtt_send_keep(const char *topic, const char *payload, int len,
+		bool keep)
+{
+	int ret;
+
+	pthread_mutex_lock(&offline_lock);
+	if (connected && !offline_head) {
+		ret = mosquitto_publish(mosq, NULL, topic, len, payload, qos, keep);
+		if (ret == MOSQ_ERR_NO_CONN) {
+			connected = 0;
+			offline_add(topic, payload, len, keep);
+		} else if (ret != MOSQ_ERR_SUCCESS) {
+			failures++;
+		}
+	} else {
+		offline_add(topic, payload, len, keep);
+	}
+	pthread_mutex_unlock(&offline_lock);
+}
+
+static void mqtt_send(const char *topic, const char *payload, int len)
+{
+	mqtt_send_keep(topic, payload, len, retain);
+}
+
+/*
+ * Network thread callbacks.
+ */
+static void on_connect(struct mosquitto *m, void *data, int rc)
+{
+	if (rc) {
+		fprintf(stderr, "MQTT: broker refused connection: %s\n",
+				mosquitto_connack_string(rc));
+		return;
+	}
+
+	if (verbose)
+		fprintf(stderr, "MQTT: connected\n");
+
+	if (status_topic[0])
+		mosquitto_publish(mosq, NULL, status_topic, 6, "online", qos, true);
+
+	/*
+	 * The broker may have lost the retained messages if it was
+	 * restarted, so send them again.
+	 */
+	pthread_mutex_lock(&offline_lock);
+	offline_flush();
+	connected = 1;
+	announce = 1;
+	pthread_mutex_unlock(&offline_lock);
+}
+
+static void on_disconnect(struct mosquitto *m, void *data, int rc)
+{
+	pthread_mutex_lock(&offline_lock);
+	connected = 0;
+	pthread_mutex_unlock(&offline_lock);
+
+	/* rc is 0 only when we asked to disconnect */
+	if (rc)
+		fprintf(stderr, "MQTT: lost connection to broker, reconnecting\n");
+}
 
+/*
+ * Should a tower sensor value go out on its own topic? Always,
+ * unless only changes are being sent. The station values use the
+ * changed mask from the core instead.
+ */
+static int sensor_changed(struct mqtt_last *l, double v, double band)
+{
+	if (!changes_only || !l->sent || (fabs(v - l->value) > band) ||
+			(isnan(v) != isnan(l->value))) {
+		l->sent = 1;
+		l->value = v;
+		return 1;
+	}
 	return 0;
 }
 
-static void mqtt_publish(struct cfg_info *cfg, struct station_info *station,
-						weather_data_t *wd)
+/*
+ * Append a JSON string, escaping anything that needs it.
+ */
+static int json_string(char *buf, int size, const char *s)
 {
-	char buf[30];
-	int ret = 0;
-	struct sensor_list *list = wd->tower_list;
+	int len = 0;
+
+	if (size > 0)
+		buf[len++] = '"';
+	for (; *s && (len < size - 3); s++) {
+		if ((*s == '"') || (*s == '\\'))
+			buf[len++] = '\\';
+		if ((unsigned char)*s >= ' ')
+			buf[len++] = *s;
+	}
+	if (len < size - 1)
+		buf[len++] = '"';
+	buf[len] = '\0';
+	return len;
+}
+
+static struct mqtt_sensor *find_sensor(const char *location)
+{
+	int i;
+
+	for (i = 0; i < MQTT_MAX_SENSORS; i++) {
+		if (strcmp(sensors[i].location, location) == 0)
+			return &sensors[i];
+		if (sensors[i].location[0] == '\0') {
+			snprintf(sensors[i].location, sizeof(sensors[i].location), "%s",
+					location);
+			return &sensors[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Build the JSON state document. Returns its length, or -1 if it
+ * didn't fit.
+ */
+static int build_json(char *buf, int size, const struct cfg_info *cfg,
+		const weather_data_t *wd)
+{
+	struct sensor_list *list;
+	enum wd_field f;
+	unsigned int i;
+	int len;
+
+	len = snprintf(buf, size, "{\"time\":%ld", (long)wd->time);
+	if (wd->timestamp && (len < size)) {
+		len += snprintf(buf + len, size - len, ",\"last_update\":");
+		if (len < size)
+			len += json_string(buf + len, size - len, wd->timestamp);
+	}
+
+	for (i = 0; (i < MQTT_FIELDS) && (len < size); i++) {
+		f = mqtt_fields[i].field;
+		len += snprintf(buf + len, size - len, ",\"%s\":",
+				mqtt_fields[i].name);
+		if (len >= size)
+			break;
+		if (isnan(wd->value[f]))
+			len += snprintf(buf + len, size - len, "null");
+		else
+			len += fmt_field(buf + len, size - len, cfg, wd, f);
+	}
+	if (len < size)
+		len += snprintf(buf + len, size - len, ",\"wind_dir_text\":\"%s\"",
+				wd->wind_dir);
+
+	if (wd->tower_list && (len < size))
+		len += snprintf(buf + len, size - len, ",\"sensors\":{");
+	for (list = wd->tower_list; list && (len < size); list = list->next) {
+		len += json_string(buf + len, size - len, list->sensor->location);
+		for (i = 0; (i < SENSOR_FIELDS) && (len < size); i++) {
+			len += snprintf(buf + len, size - len, "%s\"%s\":",
+					i ? "," : ":{", sensor_fields[i].name);
+			if (len < size)
+				len += fmt_double(buf + len, size - len,
+						*(double *)((char *)list->sensor + sensor_fields[i].offset),
+						sensor_fields[i].precision);
+		}
+		if (len < size)
+			len += snprintf(buf + len, size - len, "}%s",
+					list->next ? "," : "}");
+	}
+	if (len < size)
+		len += snprintf(buf + len, size - len, "}");
+
+	return (len < size) ? len : -1;
+}
 
-	if (!cfg->metric)
-		unit_convert(wd, CONVERT_ALL);
+/*
+ * Copy s to buf keeping only what's safe in a topic level or id.
+ */
+static void make_id(char *buf, int size, const char *s)
+{
+	int len = 0;
 
+	for (; s && *s && (len < size - 1); s++) {
+		if (isalnum((unsigned char)*s))
+			buf[len++] = tolower((unsigned char)*s);
+		else if (len && (buf[len - 1] != '_'))
+			buf[len++] = '_';
+	}
+	buf[len] = '\0';
+}
 
-	ret += mosquitto_publish(mosq, NULL, "home/climate/last_update",
-			strlen(wd->timestamp), wd->timestamp, 0, false);
+/*
+ * Send the Home Assistant discovery config for one value. id is
+ * unique within the station, name is shown to the user.
+ */
+static void ha_config(struct station_info *station, const char *id,
+		const char *name, const char *state_topic, enum wd_unit unit,
+		int precision, int metric)
+{
+	char topic[MQTT_TOPIC_SIZE];
+	char buf[1024];
+	const char *u;
+	int size = sizeof(buf);
+	int len;
+
+	snprintf(topic, sizeof(topic), "%s/sensor/%s/%s/config",
+			discovery_prefix, node_id, id);
+
+	len = snprintf(buf, size, "{\"name\":");
+	len += json_string(buf + len, size - len, name);
+	len += snprintf(buf + len, size - len,
+			",\"unique_id\":\"%s_%s\",\"state_topic\":", node_id, id);
+	if (len < size)
+		len += json_string(buf + len, size - len, state_topic);
+	if (len < size)
+		len += snprintf(buf + len, size - len,
+				",\"availability_topic\":\"%s\"", status_topic);
+
+	u = wd_unit_label(unit, !metric);
+	if (u[0] && (len < size))
+		len += snprintf(buf + len, size - len,
+				",\"unit_of_measurement\":\"%s\"", u);
+	if (ha_classes[unit] && (len < size))
+		len += snprintf(buf + len, size - len, ",\"device_class\":\"%s\"",
+				ha_classes[unit]);
+	if ((precision >= 0) && (len < size))
+		len += snprintf(buf + len, size - len,
+				",\"state_class\":\"measurement\","
+				"\"suggested_display_precision\":%d", precision);
+
+	if (len < size)
+		len += snprintf(buf + len, size - len,
+				",\"device\":{\"identifiers\":[\"%s\"],\"name\":", node_id);
+	if (len < size)
+		len += json_string(buf + len, size - len, station->name);
+	if (len < size)
+		len += snprintf(buf + len, size - len,
+				",\"manufacturer\":\"WeatherFlow\"}}");
+
+	if (len >= size) {
+		fprintf(stderr, "MQTT discovery config for %s too large\n", id);
+		return;
+	}
 
-	sprintf(buf, "%f", wd->temperature);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/temperature",
-			strlen(buf), buf, 0, false);
+	mqtt_send_keep(topic, buf, len, true);
+}
 
-	sprintf(buf, "%f", wd->temperature_high);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/high_temperature",
-			strlen(buf), buf, 0, false);
+/*
+ * "wind_speed" -> "Wind speed", or "Outside wind speed" with a
+ * location.
+ */
+static void field_title(char *buf, int size, const char *location,
+		const char *field)
+{
+	int start = 0;
+	int i;
+
+	if (location)
+		start = snprintf(buf, size, "%s ", location);
+	if (start < size)
+		snprintf(buf + start, size - start, "%s", field);
+	for (i = start; (i < size) && buf[i]; i++)
+		if (buf[i] == '_')
+			buf[i] = ' ';
+	buf[0] = toupper((unsigned char)buf[0]);
+}
 
-	sprintf(buf, "%f", wd->temperature_low);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/low_temperature",
-			strlen(buf), buf, 0, false);
+/*
+ * Send the things that don't change, retained, and the discovery
+ * configs for the station values.
+ */
+static void announce_station(struct station_info *station,
+		const struct cfg_info *cfg)
+{
+	char topic[MQTT_TOPIC_SIZE];
+	char state[MQTT_TOPIC_SIZE];
+	char name[64];
+	char buf[30];
+	unsigned int i;
+	int len;
+
+	snprintf(topic, sizeof(topic), "%s/station", prefix);
+	mqtt_send_keep(topic, station->name, strlen(station->name), true);
+	snprintf(topic, sizeof(topic), "%s/location", prefix);
+	mqtt_send_keep(topic, station->location, strlen(station->location), true);
+	snprintf(topic, sizeof(topic), "%s/latitude", prefix);
+	mqtt_send_keep(topic, station->latitude, strlen(station->latitude), true);
+	snprintf(topic, sizeof(topic), "%s/longitude", prefix);
+	mqtt_send_keep(topic, station->longitude, strlen(station->longitude),
+			true);
+	snprintf(topic, sizeof(topic), "%s/elevation", prefix);
+	len = snprintf(buf, sizeof(buf), "%d", station->elevation);
+	mqtt_send_keep(topic, buf, len, true);
+
+	/* Sensors are announced again as they're seen */
+	for (i = 0; i < MQTT_MAX_SENSORS; i++)
+		sensors[i].announced = 0;
+
+	if (!discovery)
+		return;
+
+	for (i = 0; i < MQTT_FIELDS; i++) {
+		snprintf(state, sizeof(state), "%s/%s", prefix, mqtt_fields[i].name);
+		field_title(name, sizeof(name), NULL, mqtt_fields[i].name);
+		ha_config(station, mqtt_fields[i].name, name, state,
+				wd_fields[mqtt_fields[i].field].unit,
+				cfg->precision[mqtt_fields[i].field], cfg->metric);
+	}
+	snprintf(state, sizeof(state), "%s/wind_dir_text", prefix);
+	ha_config(station, "wind_dir_text", "Wind direction text", state,
+			UNIT_NONE, -1, cfg->metric);
+}
 
-	sprintf(buf, "%f", wd->humidity);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/humidity",
-			strlen(buf), buf, 0, false);
+static void announce_sensor(struct station_info *station,
+		struct mqtt_sensor *ms, int metric)
+{
+	char state[MQTT_TOPIC_SIZE];
+	char loc[50];
+	char id[100];
+	char name[100];
+	unsigned int i;
+
+	ms->announced = 1;
+	if (!discovery)
+		return;
+
+	make_id(loc, sizeof(loc), ms->location);
+	for (i = 0; i < SENSOR_FIELDS; i++) {
+		snprintf(state, sizeof(state), "%s/%s/%s", sensor_prefix,
+				ms->location, sensor_fields[i].name);
+		snprintf(id, sizeof(id), "%s_%s", loc, sensor_fields[i].name);
+		field_title(name, sizeof(name), ms->location, sensor_fields[i].name);
+		ha_config(station, id, name, state, sensor_fields[i].unit,
+				sensor_fields[i].precision, metric);
+	}
+}
 
-	sprintf(buf, "%f", wd->pressure);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/pressure",
-			strlen(buf), buf, 0, false);
+static void send_fields_topics(struct station_info *station,
+		const struct cfg_info *cfg, const weather_data_t *wd, uint64_t changed)
+{
+	struct sensor_list *list;
+	struct mqtt_sensor *ms;
+	char topic[MQTT_TOPIC_SIZE];
+	char buf[30];
+	unsigned int i;
+	double v;
+	int len;
+
+	snprintf(topic, sizeof(topic), "%s/last_update", prefix);
+	if (wd->timestamp)
+		mqtt_send(topic, wd->timestamp, strlen(wd->timestamp));
+
+	for (i = 0; i < MQTT_FIELDS; i++) {
+		if (changes_only && !(changed & WD_BIT(mqtt_fields[i].field)))
+			continue;
+		snprintf(topic, sizeof(topic), "%s/%s", prefix, mqtt_fields[i].name);
+		len = fmt_field(buf, sizeof(buf), cfg, wd, mqtt_fields[i].field);
+		mqtt_send(topic, buf, len);
+	}
 
-	sprintf(buf, "%f", wd->pressure_sealevel);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/sealevel",
-			strlen(buf), buf, 0, false);
+	if (!changes_only || strcmp(last_wind_dir, wd->wind_dir)) {
+		strcpy(last_wind_dir, wd->wind_dir);
+		snprintf(topic, sizeof(topic), "%s/wind_dir_text", prefix);
+		mqtt_send(topic, wd->wind_dir, strlen(wd->wind_dir));
+	}
 
-	sprintf(buf, "%f", wd->trend);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/pressure_trend",
-			strlen(buf), buf, 0, false);
+	for (list = wd->tower_list; list; list = list->next) {
+		ms = find_sensor(list->sensor->location);
+		if (ms && !ms->announced)
+			announce_sensor(station, ms, cfg->metric);
+		if (changes_only && !(changed & WD_BIT(WD_SENSORS)))
+			continue;
+		for (i = 0; i < SENSOR_FIELDS; i++) {
+			v = *(double *)((char *)list->sensor + sensor_fields[i].offset);
+			if (ms && !sensor_changed(&ms->last[i], v,
+						sensor_fields[i].deadband))
+				continue;
+			snprintf(topic, sizeof(topic), "%s/%s/%s", sensor_prefix,
+					list->sensor->location, sensor_fields[i].name);
+			len = fmt_double(buf, sizeof(buf), v, sensor_fields[i].precision);
+			mqtt_send(topic, buf, len);
+		}
+	}
+}
 
-	sprintf(buf, "%f", wd->windspeed);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/wind_speed",
-			strlen(buf), buf, 0, false);
+static int mqtt_publish(struct cfg_info *cfg, struct station_info *station,
+						const weather_data_t *wd, uint64_t changed)
+{
+	char topic[MQTT_TOPIC_SIZE];
+	char *json;
+	int again;
+	int len;
+
+	if (!mosq && mqtt_start(cfg))
+		return 0;
+
+	failures = 0;
+
+	if (send_json && (json = malloc(MQTT_JSON_SIZE))) {
+		if ((len = build_json(json, MQTT_JSON_SIZE, cfg, wd)) < 0) {
+			fprintf(stderr, "MQTT state too large to send\n");
+		} else {
+			snprintf(topic, sizeof(topic), "%s/state", prefix);
+			mqtt_send(topic, json, len);
+		}
+		free(json);
+	}
 
-	sprintf(buf, "%f", wd->gustspeed);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/gust_speed",
-			strlen(buf), buf, 0, false);
+	pthread_mutex_lock(&offline_lock);
+	again = announce;
+	announce = 0;
+	pthread_mutex_unlock(&offline_lock);
+	if (again)
+		announce_station(station, cfg);
 
-	sprintf(buf, "%f", wd->winddirection);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/wind_direction",
-			strlen(buf), buf, 0, false);
+	if (send_fields)
+		send_fields_topics(station, cfg, wd, changed);
 
-	sprintf(buf, "%f", wd->gustdirection);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/gust_direction",
-			strlen(buf), buf, 0, false);
+	if (failures)
+		fprintf(stderr, "Publishing failed %d times\n", failures);
 
-	sprintf(buf, "%f", wd->dewpoint);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/dewpoint",
-			strlen(buf), buf, 0, false);
+	return 0;
+}
 
-	sprintf(buf, "%f", wd->heatindex);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/heat_index",
-			strlen(buf), buf, 0, false);
+/*
+ * Read the publishing options.
+ */
+static void mqtt_options(struct cfg_info *cfg)
+{
+	prefix = cfg_string(cfg, "prefix", prefix);
+	sensor_prefix = cfg_string(cfg, "sensor_prefix", sensor_prefix);
+	discovery = cfg_int(cfg, "discovery", 0);
+	discovery_prefix = cfg_string(cfg, "discovery_prefix", discovery_prefix);
+	qos = cfg_int(cfg, "qos", 0);
+	retain = cfg_int(cfg, "retain", discovery) ? true : false;
+	send_json = cfg_int(cfg, "json", 0);
+	send_fields = cfg_int(cfg, "fields", discovery || !send_json);
+	changes_only = cfg_int(cfg, "changes_only", discovery);
+	snprintf(status_topic, sizeof(status_topic), "%s/status", prefix);
+}
 
-	sprintf(buf, "%f", wd->windchill);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/windchill",
-			strlen(buf), buf, 0, false);
+/*
+ * TLS is turned on with "tls" : 1 and uses "cafile" or "capath" to
+ * check the broker's certificate, plus "certfile" and "keyfile" if
+ * the broker wants a client certificate.
+ */
+static int mqtt_tls(struct cfg_info *cfg)
+{
+	const char *cafile = cfg_string(cfg, "cafile", NULL);
+	const char *capath = cfg_string(cfg, "capath", NULL);
+	int ret;
 
-	sprintf(buf, "%f", wd->feelslike);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/feels_like",
-			strlen(buf), buf, 0, false);
+	if (!cfg_int(cfg, "tls", 0))
+		return 0;
 
-	sprintf(buf, "%f", wd->illumination);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/illumination",
-			strlen(buf), buf, 0, false);
+	if (!cafile && !capath)
+		capath = "/etc/ssl/certs";
 
-	sprintf(buf, "%f", wd->solar);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/solar_radiation",
-			strlen(buf), buf, 0, false);
+	ret = mosquitto_tls_set(mosq, cafile, capath,
+			cfg_string(cfg, "certfile", NULL),
+			cfg_string(cfg, "keyfile", NULL), NULL);
+	if (ret) {
+		fprintf(stderr, "MQTT: TLS setup failed: %s\n",
+				mosquitto_strerror(ret));
+		return -1;
+	}
 
-	sprintf(buf, "%f", wd->uv);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/UV_index",
-			strlen(buf), buf, 0, false);
+	return 0;
+}
 
-	sprintf(buf, "%d", wd->strikes);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/lightning_strikes",
-			strlen(buf), buf, 0, false);
+static int mqtt_init(struct cfg_info *cfg, int debug)
+{
+	mqtt_options(cfg);
+	offline_max = cfg_int(cfg, "offline_queue", MQTT_OFFLINE_QUEUE);
+	make_id(node_id, sizeof(node_id), cfg_string(cfg, "node_id", NULL));
+	if (node_id[0] == '\0')
+		make_id(node_id, sizeof(node_id), prefix);
+	mosquitto_lib_init();
 
-	sprintf(buf, "%f", wd->distance);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/lightning_distance",
-			strlen(buf), buf, 0, false);
+	return 0;
+}
 
-	sprintf(buf, "%f", wd->rain);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/rain",
-			strlen(buf), buf, 0, false);
+static void mqtt_free(void)
+{
+	mosquitto_destroy(mosq);
+	mosq = NULL;
+}
 
-	sprintf(buf, "%f", wd->daily_rain);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/daily_rain",
-			strlen(buf), buf, 0, false);
+/*
+ * Set up the client and start connecting to the broker. Called on
+ * the first update, init is called even when the service is disabled
+ * and the network thread would keep trying to connect for nothing.
+ */
+static int mqtt_start(struct cfg_info *cfg)
+{
+	int port;
+	int ret;
 
-	sprintf(buf, "%f", wd->rainfall_1hr);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/hour_rain",
-			strlen(buf), buf, 0, false);
+	/* Create runtime instance with random client ID */
+	mosq = mosquitto_new(NULL, true, NULL);
+	if (!mosq) {
+		fprintf(stderr, "Failed to initialize a MQTT instance.\n");
+		return -1;
+	}
 
-	sprintf(buf, "%f", wd->rainfall_day);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/day_rain",
-			strlen(buf), buf, 0, false);
+	if (cfg->name && (cfg->name[0] != '\0'))
+		mosquitto_username_pw_set(mosq, cfg->name, cfg->pass);
 
-	sprintf(buf, "%f", wd->rainfall_month);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/month_rain",
-			strlen(buf), buf, 0, false);
-
-	sprintf(buf, "%f", wd->rainfall_year);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/year_rain",
-			strlen(buf), buf, 0, false);
-
-	sprintf(buf, "%f", wd->rainfall_60min);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/rain_60min",
-			strlen(buf), buf, 0, false);
-
-	sprintf(buf, "%f", wd->rainfall_24hr);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/rain_24hr",
-			strlen(buf), buf, 0, false);
-
-	sprintf(buf, "%s", wd->wind_dir);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/wind_dir_text",
-			strlen(buf), buf, 0, false);
-
-	ret += mosquitto_publish(mosq, NULL, "home/climate/station",
-			strlen(station->name), station->name, 0, false);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/location",
-			strlen(station->location), station->location, 0, false);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/latitude",
-			strlen(station->latitude), station->latitude, 0, false);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/longitude",
-			strlen(station->longitude), station->longitude, 0, false);
-	sprintf(buf, "%d", station->elevation);
-	ret += mosquitto_publish(mosq, NULL, "home/climate/elevation",
-			strlen(buf), buf, 0, false);
-
-	while(list) {
-		char topic[80];
-
-		sprintf(topic, "home/%s/temperature", list->sensor->location);
-		sprintf(buf, "%f", list->sensor->temperature);
-		ret += mosquitto_publish(mosq, NULL, topic, strlen(buf), buf, 0, false);
-
-		sprintf(topic, "home/%s/high_temperature", list->sensor->location);
-		sprintf(buf, "%f", list->sensor->temperature_high);
-		ret += mosquitto_publish(mosq, NULL, topic, strlen(buf), buf, 0, false);
-
-		sprintf(topic, "home/%s/low_temperature", list->sensor->location);
-		sprintf(buf, "%f", list->sensor->temperature_low);
-		ret += mosquitto_publish(mosq, NULL, topic, strlen(buf), buf, 0, false);
-
-		sprintf(topic, "home/%s/humidity", list->sensor->location);
-		sprintf(buf, "%f", list->sensor->humidity);
-		ret += mosquitto_publish(mosq, NULL, topic, strlen(buf), buf, 0, false);
-
-		list = list->next;
+	if (mqtt_tls(cfg)) {
+		mqtt_free();
+		return -1;
 	}
 
+	/* The broker tells everyone we've gone if we drop off */
+	mosquitto_will_set(mosq, status_topic, 7, "offline", qos, true);
+
+	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_disconnect_callback_set(mosq, on_disconnect);
+	mosquitto_reconnect_delay_set(mosq, MQTT_RECONNECT_MIN,
+			MQTT_RECONNECT_MAX, true);
+
+	/*
+	 * Connect to MQTT broker. If it isn't up yet the network thread
+	 * keeps trying, and publishes are queued until it is.
+	 */
+	port = (cfg->extra && cfg->extra[0]) ? atoi(cfg->extra) : 1883;
+	ret = mosquitto_connect_async(mosq, cfg->host, port,
+			cfg_int(cfg, "keepalive", MQTT_KEEPALIVE));
 	if (ret)
-		fprintf(stderr, "Publishing failed %d times\n", ret);
+		fprintf (stderr, "Can't connect to Mosquitto broker %s: %s, "
+				"will keep trying\n", cfg->host, mosquitto_strerror(ret));
 
-	return;
+	ret = mosquitto_loop_start(mosq);
+	if (ret) {
+		fprintf(stderr, "Failed to start MQTT network thread: %s\n",
+				mosquitto_strerror(ret));
+		mqtt_free();
+		return -1;
+	}
+
+	return 0;
 }
 
 static void mqtt_disconnect(void)
 {
-	mosquitto_disconnect (mosq);
-	mosquitto_destroy (mosq);
+	struct mqtt_msg *m;
+
+	if (mosq) {
+		/* A clean disconnect doesn't trigger the will */
+		mosquitto_publish(mosq, NULL, status_topic, 7, "offline", qos, true);
+		mosquitto_disconnect (mosq);
+		mosquitto_loop_stop (mosq, false);
+		mqtt_free();
+	}
 	mosquitto_lib_cleanup();
 
+	pthread_mutex_lock(&offline_lock);
+	if (offline_count)
+		fprintf(stderr, "MQTT: discarding %d unsent messages\n",
+				offline_count);
+	while ((m = offline_head) != NULL) {
+		offline_head = m->next;
+		free(m);
+	}
+	offline_tail = NULL;
+	offline_count = 0;
+	pthread_mutex_unlock(&offline_lock);
+
 	return;
 }
 
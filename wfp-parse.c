@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Single pass scanner for the WeatherFlow UDP packets.
+ *
+ * The hub packets all have the same simple shape, a flat object with
+ * a few strings, a few numbers and an observation array. Rather than
+ * build a cJSON tree for every packet, this walks the text once and
+ * fills in a wf_packet structure on the caller's stack.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wfp.h"
+
+struct scanner {
+	const char *p;
+	const char *end;
+};
+
+static const struct {
+	const char *name;
+	enum wf_type type;
+} wf_types[] = {
+	{ "obs_air",       WF_OBS_AIR },
+	{ "obs_sky",       WF_OBS_SKY },
+	{ "obs_tower",     WF_OBS_TOWER },
+	{ "rapid_wind",    WF_RAPID_WIND },
+	{ "evt_strike",    WF_EVT_STRIKE },
+	{ "evt_precip",    WF_EVT_PRECIP },
+	{ "device_status", WF_DEVICE_STATUS },
+	{ "hub_status",    WF_HUB_STATUS },
+	{ NULL,            WF_UNKNOWN }
+};
+
+static void skip_ws(struct scanner *s)
+{
+	while ((s->p < s->end) && ((*s->p == ' ') || (*s->p == '\t') ||
+				(*s->p == '\r') || (*s->p == '\n')))
+		s->p++;
+}
+
+static int expect(struct scanner *s, char c)
+{
+	skip_ws(s);
+	if ((s->p >= s->end) || (*s->p != c))
+		return -1;
+	s->p++;
+	return 0;
+}
+
+/*
+ * Scan a string value. If buf is NULL the string is skipped,
+ * otherwise it's copied (truncated if needed). Escapes are copied
+ * as-is since none of the values we care about use them.
+ */
+static int scan_string(struct scanner *s, char *buf, int len)
+{
+	int n = 0;
+
+	if (expect(s, '"'))
+		return -1;
+
+	while ((s->p < s->end) && (*s->p != '"')) {
+		if ((*s->p == '\\') && (s->p + 1 < s->end)) {
+			if (buf && (n < len - 1))
+				buf[n++] = *s->p;
+			s->p++;
+		}
+		if (buf && (n < len - 1))
+			buf[n++] = *s->p;
+		s->p++;
+	}
+
+	if (s->p >= s->end)
+		return -1;
+	s->p++;
+
+	if (buf)
+		buf[n] = '\0';
+	return n;
+}
+
+/*
+ * Scan a number. null, true and false are accepted as 0, 1 and 0
+ * which matches what cJSON's valuedouble gave us.
+ */
+static int scan_number(struct scanner *s, double *v)
+{
+	char *e;
+
+	skip_ws(s);
+	if (s->p >= s->end)
+		return -1;
+
+	if ((s->end - s->p >= 4) && (strncmp(s->p, "null", 4) == 0)) {
+		*v = 0;
+		s->p += 4;
+		return 0;
+	} else if ((s->end - s->p >= 4) && (strncmp(s->p, "true", 4) == 0)) {
+		*v = 1;
+		s->p += 4;
+		return 0;
+	} else if ((s->end - s->p >= 5) && (strncmp(s->p, "false", 5) == 0)) {
+		*v = 0;
+		s->p += 5;
+		return 0;
+	}
+
+	*v = strtod(s->p, &e);
+	if ((e == s->p) || (e > s->end))
+		return -1;
+	s->p = e;
+	return 0;
+}
+
+/*
+ * Skip over any value, including nested arrays and objects.
+ */
+static int skip_value(struct scanner *s)
+{
+	double v;
+	int depth = 0;
+
+	skip_ws(s);
+	if (s->p >= s->end)
+		return -1;
+
+	if (*s->p == '"')
+		return (scan_string(s, NULL, 0) < 0) ? -1 : 0;
+
+	if ((*s->p != '[') && (*s->p != '{'))
+		return scan_number(s, &v);
+
+	while (s->p < s->end) {
+		switch (*s->p) {
+			case '"':
+				if (scan_string(s, NULL, 0) < 0)
+					return -1;
+				continue;
+			case '[':
+			case '{':
+				depth++;
+				break;
+			case ']':
+			case '}':
+				if (--depth == 0) {
+					s->p++;
+					return 0;
+				}
+				break;
+		}
+		s->p++;
+	}
+
+	return -1;
+}
+
+/*
+ * Scan a flat array of numbers into vals. Returns the number of
+ * values or -1 if it doesn't look like a flat array of numbers.
+ */
+static int scan_values(struct scanner *s, double *vals, int max)
+{
+	int n = 0;
+
+	if (expect(s, '['))
+		return -1;
+
+	skip_ws(s);
+	if ((s->p < s->end) && (*s->p == ']')) {
+		s->p++;
+		return 0;
+	}
+
+	while (1) {
+		if (n >= max)
+			return -1;
+		if (scan_number(s, &vals[n++]))
+			return -1;
+
+		skip_ws(s);
+		if (s->p >= s->end)
+			return -1;
+		if (*s->p == ']') {
+			s->p++;
+			return n;
+		}
+		if (*s->p != ',')
+			return -1;
+		s->p++;
+	}
+}
+
+/*
+ * Scan the 2 dimensional "obs" array [[v,v,v],[v,v,v]]
+ */
+static int scan_obs(struct scanner *s, struct wf_packet *pkt)
+{
+	int n;
+
+	if (expect(s, '['))
+		return -1;
+
+	skip_ws(s);
+	if ((s->p < s->end) && (*s->p == ']')) {
+		s->p++;
+		return 0;
+	}
+
+	while (1) {
+		if (pkt->rows >= WF_MAX_ROWS)
+			return -1;
+		n = scan_values(s, pkt->obs[pkt->rows], WF_MAX_VALUES);
+		if (n < 0)
+			return -1;
+		pkt->cols[pkt->rows++] = n;
+
+		skip_ws(s);
+		if (s->p >= s->end)
+			return -1;
+		if (*s->p == ']') {
+			s->p++;
+			return 0;
+		}
+		if (*s->p != ',')
+			return -1;
+		s->p++;
+	}
+}
+
+/*
+ * Some status values (firmware_revision) are sent as a number by
+ * the devices and as a string by the hub.
+ */
+static int scan_status_value(struct scanner *s, double *v)
+{
+	char buf[24];
+
+	skip_ws(s);
+	if ((s->p < s->end) && (*s->p == '"')) {
+		if (scan_string(s, buf, sizeof(buf)) < 0)
+			return -1;
+		*v = atof(buf);
+		return 0;
+	}
+
+	return scan_number(s, v);
+}
+
+/*
+ * Parse a WeatherFlow packet into pkt. Returns 0 on success or -1
+ * if the packet isn't the flat object we expect. On success
+ * pkt->type is WF_UNKNOWN for packet types we don't know about.
+ */
+int wf_packet_scan(const char *msg, int len, struct wf_packet *pkt)
+{
+	struct scanner s;
+	char key[24];
+	char type[24];
+	double *status;
+	int n;
+	int i;
+
+	s.p = msg;
+	s.end = msg + len;
+
+	memset(pkt, 0, sizeof(struct wf_packet));
+	type[0] = '\0';
+
+	if (expect(&s, '{'))
+		return -1;
+
+	skip_ws(&s);
+	if ((s.p < s.end) && (*s.p == '}'))
+		return -1;
+
+	while (1) {
+		if (scan_string(&s, key, sizeof(key)) < 0)
+			return -1;
+		if (expect(&s, ':'))
+			return -1;
+
+		status = NULL;
+		if (strcmp(key, "type") == 0) {
+			if (scan_string(&s, type, sizeof(type)) < 0)
+				return -1;
+		} else if (strcmp(key, "serial_number") == 0) {
+			if (scan_string(&s, pkt->serial_number,
+						sizeof(pkt->serial_number)) < 0)
+				return -1;
+		} else if (strcmp(key, "hub_sn") == 0) {
+			if (scan_string(&s, pkt->hub_sn, sizeof(pkt->hub_sn)) < 0)
+				return -1;
+		} else if (strcmp(key, "obs") == 0) {
+			if (scan_obs(&s, pkt))
+				return -1;
+		} else if ((strcmp(key, "ob") == 0) || (strcmp(key, "evt") == 0)) {
+			n = scan_values(&s, pkt->obs[0], WF_MAX_VALUES);
+			if (n < 0)
+				return -1;
+			pkt->cols[0] = n;
+			pkt->rows = 1;
+		} else if (strcmp(key, "timestamp") == 0) {
+			status = &pkt->timestamp;
+		} else if (strcmp(key, "uptime") == 0) {
+			status = &pkt->uptime;
+		} else if (strcmp(key, "voltage") == 0) {
+			status = &pkt->voltage;
+		} else if (strcmp(key, "rssi") == 0) {
+			status = &pkt->rssi;
+		} else if (strcmp(key, "hub_rssi") == 0) {
+			status = &pkt->hub_rssi;
+		} else if (strcmp(key, "sensor_status") == 0) {
+			status = &pkt->sensor_status;
+		} else if (strcmp(key, "firmware_revision") == 0) {
+			status = &pkt->firmware_revision;
+		} else if (strcmp(key, "seq") == 0) {
+			status = &pkt->seq;
+		} else if (skip_value(&s)) {
+			return -1;
+		}
+
+		if (status && scan_status_value(&s, status))
+			return -1;
+
+		skip_ws(&s);
+		if (s.p >= s.end)
+			return -1;
+		if (*s.p == '}')
+			break;
+		if (*s.p != ',')
+			return -1;
+		s.p++;
+	}
+
+	for (i = 0; wf_types[i].name; i++) {
+		if (strcmp(type, wf_types[i].name) == 0) {
+			pkt->type = wf_types[i].type;
+			break;
+		}
+	}
+
+	return 0;
+}
@@ -31,54 +31,47 @@
 #include <unistd.h>
 #include "wfp.h"
 
-extern void send_url(char *host, int port, char *url, char *ident, int resp);
-
-
 extern int debug;
 extern int verbose;
 
-static char *tpl = "GET /%s HTTP/1.0\r\nHost: %s\r\nUser-Agent: %s\r\n\r\n";
-static weather_data_t ws;
-static int count = 0;
+#define PWS_REQUEST_SIZE 1024
+
+static struct http_conn *conn = NULL;
+
+static const struct {
+	const char *name;
+	enum wd_field field;
+} pws_params[] = {
+	{ "&baromin=",        WD_PRESSURE },
+	{ "&dailyrainin=",    WD_RAINFALL_DAY },
+	{ "&rainin=",         WD_RAINFALL_1HR },
+	{ "&winddir=",        WD_WINDDIRECTION },
+	{ "&windgustmph=",    WD_GUSTSPEED },
+	{ "&windspeedmph=",   WD_WINDSPEED },
+	{ "&humidity=",       WD_HUMIDITY },
+	{ "&dewptf=",         WD_DEWPOINT },
+	{ "&tempf=",          WD_TEMPERATURE },
+	{ "&monthrainin=",    WD_RAINFALL_MONTH },
+	{ "&yearrainin=",     WD_RAINFALL_YEAR },
+	{ "&solarradiation=", WD_SOLAR },
+	{ "&UV=",             WD_UV },
+};
+
+#define PWS_PARAMS (sizeof(pws_params) / sizeof(pws_params[0]))
 
 /*
  * PWS Weather publisher
  */
-void send_to_pws(struct cfg_info *cfg, struct station_info *station,
-				weather_data_t *wd)
+int send_to_pws(struct cfg_info *cfg, struct station_info *station,
+				const weather_data_t *wd, uint64_t changed)
 {
-	char *str;
 	char *request;
 	struct timeval start, end;
 	char *ts_start, *ts_end;
-	time_t t = time(NULL);
-	struct tm* lt = localtime(&t);
-
-	if (!cfg->metric)
-		unit_convert(wd, CONVERT_ALL);
-
-	/* Limit sending to PWS Weather */
-	if ((lt->tm_min % 2) != 0) {
-		/* Average data if called more frequently than limit */
-		ws.pressure      += wd->pressure;
-		ws.windspeed     += wd->windspeed;
-		ws.winddirection += wd->winddirection;
-		if (wd->gustspeed > ws.gustspeed)
-			ws.gustspeed      = wd->gustspeed;
-		ws.gustdirection  = wd->gustdirection;
-		ws.humidity      += wd->humidity;
-		ws.dewpoint      += wd->dewpoint;
-		ws.temperature   += wd->temperature;
-		ws.rainfall_day   = wd->rainfall_day;
-		ws.rainfall_1hr   = wd->rainfall_1hr;
-		ws.rainfall_month = wd->rainfall_month;
-		ws.rainfall_year  = wd->rainfall_year;
-		count++;
-		goto out;
-	}
+	unsigned int i;
+	int ret = -1;
+	int len;
 
-	if (count == 0)
-		goto out;
 
 	gettimeofday(&start, NULL);
 
@@ -88,74 +81,39 @@ void send_to_pws(struct cfg_info *cfg, struct station_info *station,
 		free(ts_start);
 	}
 
-	ts_start = time_stamp(1, 0);
-	request = (char *)malloc(1024);
-	sprintf(request, "pwsupdate/pwsupdate.php?"
+	ts_start = time_stamp_at(wd->time ? wd->time : time(NULL), 1, 0);
+	request = (char *)malloc(PWS_REQUEST_SIZE);
+	len = snprintf(request, PWS_REQUEST_SIZE,
+			"pwsupdate/pwsupdate.php?"
 			"&ID=%s"
 			"&PASSWORD=%s"
-			"&dateutc=%s"
-			"&baromin=%f"
-			"&dailyrainin=%f"
-			"&rainin=%f"
-			"&winddir=%f"
-			"&windgustmph=%f"
-			"&windspeedmph=%f"
-			"&humidity=%f"
-			"&dewptf=%f"
-			"&tempf=%f"
-			"&monthrainin=%.2f"
-			"&yearrainin=%.2f"
-			"&solarradiation=%.2f"
-			"&UV=%.2f"
-			"&softwaretype=ACU-LINK"
-			"&action=updateraw",
+			"&dateutc=%s",
 			cfg->name,
 			cfg->pass,
-			ts_start,
-			(ws.pressure / count),
-			(ws.rainfall_day),
-			(ws.rainfall_1hr),
-			(ws.winddirection / count),
-			ws.gustspeed,
-			(ws.windspeed / count),
-			(ws.humidity / count),
-			(ws.dewpoint / count),
-			(ws.temperature / count),
-			(ws.rainfall_month),
-			(ws.rainfall_year),
-			ws.solar,
-			ws.uv
-			);
+			ts_start);
+	for (i = 0; (i < PWS_PARAMS) && (len < PWS_REQUEST_SIZE); i++)
+		len += fmt_param(request + len, PWS_REQUEST_SIZE - len,
+				pws_params[i].name, cfg, wd, pws_params[i].field);
+	if (len < PWS_REQUEST_SIZE)
+		snprintf(request + len, PWS_REQUEST_SIZE - len,
+				"&softwaretype=ACU-LINK"
+				"&action=updateraw");
 
 	if (verbose > 1)
 		fprintf(stderr, "PWSWeather: %s\n", request);
 
 	/*
-	 * Build url string using tpl as a template
-	 * sprintf(query, tpl, <page>, <host>, <USERAGENT>)
-	 *
-	 * <page> is the full string with data
-	 * <host> is the host name
-	 * <USERAGENT is the user agent string
+	 * The connection is opened on the first upload and kept open.
+	 * In debug mode, send to a test server instead.
 	 */
-
-	str = (char *)malloc(4096);
-
-
-	sprintf(str, tpl, request, cfg->host, "acu-link");
-	if (!debug) {
-		send_url(cfg->host, 80, str, NULL, 1);
-	} else {
-		send_url("www.bobshome.net", 80, str, NULL, 0);
-	}
+	if (!conn)
+		conn = http_open(debug ? "www.bobshome.net" : cfg->host, 80);
+	if (conn && ((http_get(conn, request, "acu-link") / 100) == 2))
+		ret = 0;
 
 	free(ts_start);
-	free(str);
 	free(request);
 
-	count = 0;
-	memset(&ws, 0, sizeof(weather_data_t));
-
 	gettimeofday(&end, NULL);
 	if (verbose || debug) {
 		long diff;
@@ -169,19 +127,37 @@ void send_to_pws(struct cfg_info *cfg, struct station_info *station,
 		free(ts_end);
 	}
 
-out:
-	return;
+	return ret;
+}
+
+static void pws_cleanup(void)
+{
+	http_close(conn);
+	conn = NULL;
 }
 
 static const struct publisher_funcs pws_funcs = {
 	.init = NULL,
 	.update = send_to_pws,
-	.cleanup = NULL
+	.cleanup = pws_cleanup
 };
 
 void pws_setup(struct service_info *sinfo)
 {
 	sinfo->funcs = pws_funcs;
+
+	/* Limit sending to every 2 minutes, on the even minutes */
+	if (sinfo->interval < 0)
+		sinfo->interval = 120;
+	if (sinfo->align < 0)
+		sinfo->align = 1;
+
+	/* Keep uploads that fail and send them when the site is back */
+	if (sinfo->spool < 0)
+		sinfo->spool = 1;
+	/* Look the host up ahead of the first upload, if it's going to be used */
+	if (sinfo->enabled)
+		dns_prefetch(sinfo->cfg.host);
 	return;
 }
 
@@ -22,38 +22,132 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <pthread.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <sys/time.h>
-#include <netdb.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
-#include <math.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include "cJSON.h"
 #include "wfp.h"
 
 extern int debug;
 extern int verbose;
 
-static void save_rainfall(weather_data_t *wd);
+#define RAIN_FILE "rainfall.dat"
+#define RAIN_TMP_FILE "rainfall.dat.tmp"
+#define RAIN_LEGACY_FILE "rainfall.json"
+#define RAIN_MAGIC 0x4e494152		/* "RAIN" */
+#define RAIN_VERSION 1
+#define RAIN_FLUSH 60				/* default seconds between writes */
+
+/*
+ * The saved state. Written whole to a temporary file which is then
+ * renamed over the old one, so the file on disk is always either the
+ * old or the new record, never a mix. The sum catches anything else.
+ */
+struct rain_state {
+	uint32_t magic;
+	uint32_t version;
+	int64_t saved;					/* time of the last sample */
+	double rain_60_min[60];
+	double rain_24_hr[24];
+	double hour;
+	double day;
+	double month;
+	double year;
+	uint32_t sum;
+};
 
 static double rain_60_min[60] = {0};
 static double rain_24_hr[24] = {0};
 
+static struct rain_state state;
+static int dirty = 0;
+static time_t last_write = 0;
+static int flush_time = RAIN_FLUSH;
+
+/*
+ * Seconds between writes when the rain totals are changing, 0 to
+ * write every change.
+ */
+void rainfall_config(int flush)
+{
+	if (flush >= 0)
+		flush_time = flush;
+}
+
+static void save_rainfall(void)
+{
+	int fd;
+
+	state.magic = RAIN_MAGIC;
+	state.version = RAIN_VERSION;
+	state.sum = checksum(&state, offsetof(struct rain_state, sum));
+
+	fd = open(RAIN_TMP_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s for writing: %s\n", RAIN_TMP_FILE,
+				strerror(errno));
+		return;
+	}
+
+	if ((write(fd, &state, sizeof(state)) != sizeof(state)) || fsync(fd)) {
+		fprintf(stderr, "Failed to write %s: %s\n", RAIN_TMP_FILE,
+				strerror(errno));
+		close(fd);
+		unlink(RAIN_TMP_FILE);
+		return;
+	}
+	close(fd);
+
+	if (rename(RAIN_TMP_FILE, RAIN_FILE)) {
+		fprintf(stderr, "Failed to rename %s: %s\n", RAIN_TMP_FILE,
+				strerror(errno));
+		unlink(RAIN_TMP_FILE);
+		return;
+	}
+
+	dirty = 0;
+	if (verbose)
+		printf("Saved rainfall totals\n");
+}
+
+/*
+ * Write the totals if they've changed and the flush time is up, or
+ * now if force is set. Called once a second and at shutdown.
+ */
+void rainfall_flush(time_t now, int force)
+{
+	if (!dirty)
+		return;
+	if (!force && (now - last_write < flush_time))
+		return;
+
+	last_write = now;
+	save_rainfall();
+}
+
 /*
  * Rain data comes in at mm's over a 1 minute interval. Use
  * this to track rain over other timeframes.
  *
  * Save the accumulated rain values so that we can recover
- * from a restart.
+ * from a restart. They're only written when something changed,
+ * which when it isn't raining is only when a total is reset.
+ *
+ * The rain is bucketed using the time the packet arrived rather
+ * than the time we got around to processing it.
  */
-void accumulate_rain(weather_data_t *wd, double rain)
+void accumulate_rain(weather_data_t *wd, double rain, time_t sec)
 {
-	time_t sec = time(NULL);
-	struct tm *lt = localtime(&sec);
+	struct tm tm;
+	struct tm *lt = &tm;
 	int i;
 
+	localtime_r(&sec, lt);
+
 	/* Every hour */
 	wd->rainfall_1hr = (lt->tm_min == 0) ? rain : wd->rainfall_1hr + rain;
 
@@ -70,7 +164,7 @@ void accumulate_rain(weather_data_t *wd, double rain)
 		wd->rainfall_month += rain;
 
 	/* year */
-	if ((lt->tm_mon =- 0) && (lt->tm_mday == 1) && (lt->tm_hour == 0) && (lt->tm_min == 0))
+	if ((lt->tm_mon == 0) && (lt->tm_mday == 1) && (lt->tm_hour == 0) && (lt->tm_min == 0))
 		wd->rainfall_year = rain;
 	else
 		wd->rainfall_year += rain;
@@ -85,47 +179,175 @@ void accumulate_rain(weather_data_t *wd, double rain)
 	for (i = 0; i < 24; i++)
 		wd->rainfall_24hr += rain_24_hr[i];
 
-	/* Save current values */
-	save_rainfall(wd);
+	/* Save current values if they changed */
+	if ((wd->rainfall_1hr != state.hour) || (wd->rainfall_day != state.day) ||
+			(wd->rainfall_month != state.month) ||
+			(wd->rainfall_year != state.year) ||
+			memcmp(rain_60_min, state.rain_60_min, sizeof(rain_60_min)) ||
+			memcmp(rain_24_hr, state.rain_24_hr, sizeof(rain_24_hr)))
+		dirty = 1;
+
+	memcpy(state.rain_60_min, rain_60_min, sizeof(rain_60_min));
+	memcpy(state.rain_24_hr, rain_24_hr, sizeof(rain_24_hr));
+	state.hour = wd->rainfall_1hr;
+	state.day = wd->rainfall_day;
+	state.month = wd->rainfall_month;
+	state.year = wd->rainfall_year;
+	state.saved = sec;
 
+	rainfall_flush(sec, 0);
 }
 
-static void save_rainfall(weather_data_t *wd)
+/*
+ * Read the rainfall.json file written by older versions. It only
+ * has the totals, the minute and hour buckets start out empty.
+ */
+static int read_legacy(struct rain_state *rs)
 {
-	time_t t = time(NULL);
-	struct tm lt;
-	cJSON *rain;
-	cJSON *l_time;
 	FILE *fp;
-	char *output;
-
-	localtime_r(&t, &lt);
-
-	l_time = cJSON_CreateObject();
-	cJSON_AddNumberToObject(l_time, "hour", lt.tm_hour);
-	cJSON_AddNumberToObject(l_time, "day", lt.tm_mday);
-	cJSON_AddNumberToObject(l_time, "month", lt.tm_mon + 1);
-	cJSON_AddNumberToObject(l_time, "year", lt.tm_year + 1900);
-
-	rain = cJSON_CreateObject();
-	cJSON_AddItemToObject(rain, "time", l_time);
-	cJSON_AddNumberToObject(rain, "rain_60", wd->rainfall_60min);
-	cJSON_AddNumberToObject(rain, "rain_24", wd->rainfall_24hr);
-	cJSON_AddNumberToObject(rain, "rain_current_hour", wd->rainfall_1hr);
-	cJSON_AddNumberToObject(rain, "rain_current_day", wd->rainfall_day);
-	cJSON_AddNumberToObject(rain, "rain_current_month", wd->rainfall_month);
-	cJSON_AddNumberToObject(rain, "rain_current_year", wd->rainfall_year);
-
-	fp = fopen("rainfall.json", "w");
-	if (fp < 0) {
-		fprintf(stderr, "Failed to open rainfall.json for writing.\n");
-	} else {
-		output = cJSON_Print(rain);
-		fprintf(fp, "%s\n", output);
-		fclose(fp);
-		free(output);
+	char *json;
+	int len;
+	cJSON *rain_json;
+	cJSON *saved_at;
+	cJSON *tmp;
+	struct tm lt;
+
+	if ((fp = fopen(RAIN_LEGACY_FILE, "r")) == NULL)
+		return -1;
+
+	json = malloc(4096);
+	len = fread(json, 1, 4095, fp);
+	fclose(fp);
+	json[len] = '\0';
+
+	rain_json = cJSON_Parse(json);
+	free(json);
+	if (!rain_json)
+		return -1;
+
+	memset(rs, 0, sizeof(struct rain_state));
+	memset(&lt, 0, sizeof(lt));
+	lt.tm_isdst = -1;
+	saved_at = cJSON_GetObjectItemCaseSensitive(rain_json, "time");
+	if ((tmp = cJSON_GetObjectItemCaseSensitive(saved_at, "year")))
+		lt.tm_year = tmp->valueint - 1900;
+	if ((tmp = cJSON_GetObjectItemCaseSensitive(saved_at, "month")))
+		lt.tm_mon = tmp->valueint - 1;
+	if ((tmp = cJSON_GetObjectItemCaseSensitive(saved_at, "day")))
+		lt.tm_mday = tmp->valueint;
+	if ((tmp = cJSON_GetObjectItemCaseSensitive(saved_at, "hour")))
+		lt.tm_hour = tmp->valueint;
+	rs->saved = mktime(&lt);
+
+	if ((tmp = cJSON_GetObjectItemCaseSensitive(rain_json, "rain_current_hour")))
+		rs->hour = tmp->valuedouble;
+	if ((tmp = cJSON_GetObjectItemCaseSensitive(rain_json, "rain_current_day")))
+		rs->day = tmp->valuedouble;
+	if ((tmp = cJSON_GetObjectItemCaseSensitive(rain_json, "rain_current_month")))
+		rs->month = tmp->valuedouble;
+	if ((tmp = cJSON_GetObjectItemCaseSensitive(rain_json, "rain_current_year")))
+		rs->year = tmp->valuedouble;
+
+	cJSON_Delete(rain_json);
+	return 0;
+}
+
+static int read_state(struct rain_state *rs)
+{
+	int fd;
+	int len;
+
+	if ((fd = open(RAIN_FILE, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	len = read(fd, rs, sizeof(struct rain_state));
+	close(fd);
+
+	if ((len != sizeof(struct rain_state)) || (rs->magic != RAIN_MAGIC) ||
+			(rs->version != RAIN_VERSION) ||
+			(rs->sum != checksum(rs, offsetof(struct rain_state, sum)))) {
+		fprintf(stderr, "Ignoring damaged %s\n", RAIN_FILE);
+		return -1;
 	}
 
-	//cJSON_Delete(l_time);
-	cJSON_Delete(rain);
+	return 0;
+}
+
+/*
+ * Read the saved rainfall data and update the data structure.
+ * The minute and hour buckets that have passed since it was saved
+ * are dropped, as are the totals for calendar periods that have
+ * ended.
+ */
+void rainfall_load(weather_data_t *wd)
+{
+	struct rain_state rs;
+	struct tm now, then;
+	time_t t = time(NULL);
+	time_t saved;
+	long elapsed;
+	int same_year, same_month, same_day;
+	int i;
+
+	printf("Reading rainfall file.\n");
+	if (read_state(&rs) && read_legacy(&rs)) {
+		fprintf(stderr, "No saved rainfall\n");
+		return;
+	}
+
+	saved = (time_t)rs.saved;
+	localtime_r(&t, &now);
+	localtime_r(&saved, &then);
+
+	/*
+	 * Keep the buckets that are still inside their window, the ones
+	 * between when they were saved and now are from the last time
+	 * around. The rolling totals don't care about the calendar.
+	 */
+	elapsed = (t + now.tm_gmtoff) / 60 - (saved + then.tm_gmtoff) / 60;
+	memcpy(rain_60_min, rs.rain_60_min, sizeof(rain_60_min));
+	for (i = 1; (i <= elapsed) && (i <= 60); i++)
+		rain_60_min[(then.tm_min + i) % 60] = 0;
+
+	elapsed = (t + now.tm_gmtoff) / 3600 - (saved + then.tm_gmtoff) / 3600;
+	memcpy(rain_24_hr, rs.rain_24_hr, sizeof(rain_24_hr));
+	for (i = 1; (i <= elapsed) && (i <= 24); i++)
+		rain_24_hr[(then.tm_hour + i) % 24] = 0;
+
+	wd->rainfall_60min = 0;
+	for (i = 0; i < 60; i++)
+		wd->rainfall_60min += rain_60_min[i];
+	wd->rainfall_24hr = 0;
+	for (i = 0; i < 24; i++)
+		wd->rainfall_24hr += rain_24_hr[i];
+
+	/* Calendar totals are only kept if their period hasn't ended. */
+	same_year = (then.tm_year == now.tm_year);
+	same_month = same_year && (then.tm_mon == now.tm_mon);
+	same_day = same_month && (then.tm_mday == now.tm_mday);
+
+	if (same_year)
+		wd->rainfall_year = rs.year;
+	else
+		fprintf(stderr, "Skipping year rain.\n");
+
+	if (same_month)
+		wd->rainfall_month = rs.month;
+	else if (same_year)
+		fprintf(stderr, "Skipping month rain.\n");
+
+	if (same_day)
+		wd->rainfall_day = rs.day;
+	else if (same_month)
+		fprintf(stderr, "Skipping day rain.\n");
+
+	if (same_day && (then.tm_hour == now.tm_hour))
+		wd->rainfall_1hr = rs.hour;
+
+	memcpy(state.rain_60_min, rain_60_min, sizeof(rain_60_min));
+	memcpy(state.rain_24_hr, rain_24_hr, sizeof(rain_24_hr));
+	state.hour = wd->rainfall_1hr;
+	state.day = wd->rainfall_day;
+	state.month = wd->rainfall_month;
+	state.year = wd->rainfall_year;
+	state.saved = rs.saved;
 }
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Service scheduler
+ *
+ * Services that limit how often they'll accept data (CWOP, PWS, etc.)
+ * have an interval. Rather than waking those services on every
+ * sample, the samples are aggregated by the core (see
+ * wfp-aggregate.c) and the service is only sent the aggregate of
+ * its window when its interval is up.
+ *
+ * Due times are kept in a simple timer wheel with one slot per
+ * second. The event loop calls sched_tick() once a second and only
+ * the services in the current slot are looked at.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "wfp.h"
+
+#define WHEEL_SLOTS 64
+
+extern int debug;
+
+static struct service_info *wheel[WHEEL_SLOTS];
+static time_t last_tick = 0;
+
+/*
+ * Work out when a service is next due. Aligned services are due on
+ * the interval boundary in local time, i.e. every 10 minutes on the
+ * 10 minute mark.
+ */
+static time_t next_due(struct service_info *s, time_t now)
+{
+	struct tm lt;
+	time_t local;
+
+	if (!s->align)
+		return now + s->interval;
+
+	localtime_r(&now, &lt);
+	local = now + lt.tm_gmtoff;
+	return now + (s->interval - (local % s->interval));
+}
+
+static void wheel_insert(struct service_info *s)
+{
+	int slot = s->next_due % WHEEL_SLOTS;
+
+	s->wheel_next = wheel[slot];
+	wheel[slot] = s;
+}
+
+/*
+ * Add a service to the schedule.
+ */
+void sched_add(struct service_info *s)
+{
+	time_t now = time(NULL);
+
+	if (s->interval <= 0)
+		return;
+
+	s->next_due = next_due(s, now);
+	wheel_insert(s);
+
+	if (debug)
+		printf("%s scheduled every %d seconds%s\n", s->service,
+				s->interval, s->align ? " (aligned)" : "");
+}
+
+/*
+ * Check one slot of the wheel, dispatching anything that's due.
+ * Entries that are due on a later trip around the wheel stay put.
+ */
+static void sched_slot(time_t t, time_t now)
+{
+	struct service_info **link = &wheel[t % WHEEL_SLOTS];
+	struct service_info *due = NULL;
+	struct service_info *s;
+
+	while ((s = *link) != NULL) {
+		if (s->next_due <= now) {
+			*link = s->wheel_next;
+			s->wheel_next = due;
+			due = s;
+		} else {
+			link = &s->wheel_next;
+		}
+	}
+
+	while (due) {
+		s = due;
+		due = due->wheel_next;
+
+		aggregate_send(s);
+
+		s->next_due = next_due(s, now);
+		wheel_insert(s);
+	}
+}
+
+/*
+ * Advance the wheel to now. If the timer was late, catch up on the
+ * slots that were skipped.
+ */
+void sched_tick(time_t now)
+{
+	time_t t;
+
+	if ((last_tick == 0) || (now - last_tick > WHEEL_SLOTS))
+		last_tick = now - WHEEL_SLOTS;
+
+	for (t = last_tick + 1; t <= now; t++)
+		sched_slot(t, now);
+
+	last_tick = now;
+}
@@ -30,42 +30,262 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <time.h>
 #include "wfp.h"
 
+static weather_data_t *wdcopy(const weather_data_t *wd);
+static void wdclear(weather_data_t *wd);
 static void wdfree(weather_data_t *wd);
 
 extern int debug;
 extern int verbose;
 
-struct thread_info {
-	struct service_info *sinfo;
-	weather_data_t *data;
+#define DEFAULT_QUEUE_DEPTH 4
+#define REPLAY_RETRY 60			/* seconds to wait after a failed send */
+#define BLOCK_WAIT 500			/* msec "block" waits for room */
+
+/*
+ * Each enabled service gets one long lived worker thread and a
+ * bounded ring of weather data snapshots waiting to be sent.
+ */
+struct send_queue {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct wd_snapshot **ring;
+	int depth;
+	int head;
+	int count;
+	int stop;
+	time_t busy_since;		/* when the current send started, 0 if idle */
+	struct send_stats stats;
+	struct spool *spool;	/* failed sends, NULL if not spooling */
+	time_t next_replay;		/* when to send the next spooled sample */
+	struct change_state *change;	/* what was last sent */
+	time_t last_sent;
+	struct wd_snapshot **held;	/* kept back by the service, see flush */
+	int nheld;
+	int held_max;
+	time_t flush_at;		/* when to call flush, 0 if nothing held */
 };
 
-static int send_count = 0;
+/*
+ * Convert a private copy of the data to a service's units.
+ */
+static void convert_units(weather_data_t *wd, enum wd_units units)
+{
+	if (units == UNITS_IMPERIAL)
+		unit_convert(wd, CONVERT_ALL);
+	else if (units == UNITS_CWOP)
+		unit_convert(wd, NO_PRESSURE);
+}
+
+/*
+ * The service has kept this sample back to write out later, hold on
+ * to it until it says it's been written.
+ */
+static void hold_sample(struct service_info *sinfo, struct wd_snapshot *snap)
+{
+	struct send_queue *q = sinfo->queue;
+	struct wd_snapshot **held;
+
+	if (q->nheld == q->held_max) {
+		held = realloc(q->held, (q->held_max + 16) * sizeof(*held));
+		if (!held) {
+			fprintf(stderr, "Failed to allocate memory for held sample\n");
+			return;
+		}
+		q->held = held;
+		q->held_max += 16;
+	}
+
+	q->held[q->nheld++] = snapshot_hold(snap);
+	if (!q->flush_at)
+		q->flush_at = time(NULL) + sinfo->flush_time;
+}
+
+/*
+ * Let go of the held samples, spooling them if they never got
+ * written.
+ */
+static void release_held(struct send_queue *q, int spool)
+{
+	int i;
+
+	for (i = 0; i < q->nheld; i++) {
+		if (spool && q->spool)
+			spool_append(q->spool, q->held[i]->data);
+		snapshot_put(q->held[i]);
+	}
+	q->nheld = 0;
+	q->flush_at = 0;
+}
+
+/*
+ * Ask the service to write out the samples it's holding.
+ */
+static int send_flush(struct service_info *sinfo)
+{
+	struct send_queue *q = sinfo->queue;
+
+	if ((sinfo->funcs.flush)(&sinfo->cfg) == 0) {
+		release_held(q, 0);
+		return 0;
+	}
+
+	q->flush_at = time(NULL) + REPLAY_RETRY;
+	return -1;
+}
+
+/*
+ * Send the oldest spooled sample. Called on the worker thread when
+ * there's nothing new to send. Spooled samples are sent no faster
+ * than the service's replay interval.
+ */
+static void send_replay(struct service_info *sinfo)
+{
+	struct send_queue *q = sinfo->queue;
+	struct wd_snapshot *snap;
+	weather_data_t wd;
+	int ret = -1;
+
+	if (!spool_peek(q->spool, &wd))
+		return;
+
+	/* Old data, so it's all new to the service but not a new baseline */
+	snap = snapshot_create(&wd, UNITS_BIT(sinfo->units));
+	wdclear(&wd);
+	if (snap && snap->view[sinfo->units])
+		ret = (sinfo->funcs.update)(&sinfo->cfg, &sinfo->station,
+				snap->view[sinfo->units], WD_ALL);
+
+	if (ret == 1)
+		hold_sample(sinfo, snap);
+	else if (ret == 0)
+		release_held(q, 0);
+	if (snap)
+		snapshot_put(snap);
+
+	if (ret >= 0) {
+		spool_commit(q->spool);
+		q->next_replay = time(NULL) + sinfo->replay_interval;
+	} else {
+		q->next_replay = time(NULL) + REPLAY_RETRY;
+	}
+}
 
 /*
- * Helper function to call the publisher update function
- * from withing a separate thread.
+ * Worker thread for a service. Pull samples off the queue and
+ * call the publisher update function for each one.
  */
-void *invoke_publisher(void *data)
+static void *send_worker(void *data)
 {
-	struct thread_info *t = (struct thread_info *)data;
+	struct service_info *sinfo = (struct service_info *)data;
+	struct send_queue *q = sinfo->queue;
+	struct wd_snapshot *snap;
+	struct timespec ts;
+	const weather_data_t *wd;
+	uint64_t changed;
+	time_t wake;
+	int replay;
+	int ret;
+
+	pthread_mutex_lock(&q->lock);
+	while (1) {
+		while ((q->count == 0) && !q->stop) {
+			replay = q->spool && spool_count(q->spool);
+			if (!replay && !q->flush_at) {
+				pthread_cond_wait(&q->not_empty, &q->lock);
+				continue;
+			}
+			wake = q->flush_at;
+			if (replay && (!wake || (q->next_replay < wake)))
+				wake = q->next_replay;
+			if (time(NULL) >= wake)
+				break;
+			ts.tv_sec = wake;
+			ts.tv_nsec = 0;
+			pthread_cond_timedwait(&q->not_empty, &q->lock, &ts);
+		}
+
+		if (q->stop)
+			break;
+
+		/* Nothing new, but held samples or a backlog to send */
+		if (q->count == 0) {
+			pthread_mutex_unlock(&q->lock);
+			if (q->flush_at && (time(NULL) >= q->flush_at))
+				send_flush(sinfo);
+			else
+				send_replay(sinfo);
+			pthread_mutex_lock(&q->lock);
+			continue;
+		}
+
+		snap = q->ring[q->head];
+		q->ring[q->head] = NULL;
+		q->head = (q->head + 1) % q->depth;
+		q->count--;
+		q->busy_since = time(NULL);
+		pthread_cond_signal(&q->not_full);
+		pthread_mutex_unlock(&q->lock);
+
+		changed = change_detect(q->change, snap->data);
+		if (!changed && sinfo->skip_unchanged &&
+				(time(NULL) - q->last_sent < sinfo->max_skip)) {
+			snapshot_put(snap);
+			pthread_mutex_lock(&q->lock);
+			q->busy_since = 0;
+			q->stats.skipped++;
+			continue;
+		}
+
+		wd = snap->view[sinfo->units];
+		ret = -1;
+		if (wd)
+			ret = (sinfo->funcs.update)(&sinfo->cfg, &sinfo->station, wd,
+					changed);
+
+		if (ret >= 0) {
+			change_commit(q->change);
+			q->last_sent = time(NULL);
+		}
 
-	(t->sinfo->funcs.update)(&t->sinfo->cfg, &t->sinfo->station, t->data);
+		if (ret == 1)
+			hold_sample(sinfo, snap);
+		else if (ret == 0)
+			release_held(q, 0);
+
+		/* Couldn't send it, keep it to try again later */
+		if ((ret < 0) && q->spool) {
+			spool_append(q->spool, snap->data);
+			q->next_replay = time(NULL) + REPLAY_RETRY;
+		}
+		snapshot_put(snap);
+
+		pthread_mutex_lock(&q->lock);
+		q->busy_since = 0;
+		q->stats.sent++;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	/* Last chance to write what the service is holding */
+	if (q->nheld && send_flush(sinfo))
+		release_held(q, 1);
 
-	wdfree(t->data);
-	free(t);
 	return NULL;
 }
 
 /*
  * Make a copy of the weather data structure.
  */
-static weather_data_t *wdcopy(weather_data_t *wd)
+static weather_data_t *wdcopy(const weather_data_t *wd)
 {
 	weather_data_t *cpy;
 	struct sensor_list *list, *list_cp;
+	struct sensor_list **tail;
 
 	cpy = malloc(sizeof(weather_data_t));
 	if (!cpy) {
@@ -83,6 +303,7 @@ static weather_data_t *wdcopy(weather_data_t *wd)
 
 	/* Copy sensor data */
 	list = wd->tower_list;
+	tail = &cpy->tower_list;
 	while (list) {
 		list_cp = malloc(sizeof(struct sensor_list));
 		list_cp->sensor = malloc(sizeof(struct sensor_data));
@@ -90,9 +311,10 @@ static weather_data_t *wdcopy(weather_data_t *wd)
 
 		/* should we copy the timestamp and sensor_id? */
 
-		/* Add new entry to front of list */
-		list_cp->next = cpy->tower_list;
-		cpy->tower_list = list_cp;
+		/* Add new entry to end of list, keeping the order */
+		list_cp->next = NULL;
+		*tail = list_cp;
+		tail = &list_cp->next;
 
 		list = list->next;
 	}
@@ -100,7 +322,10 @@ static weather_data_t *wdcopy(weather_data_t *wd)
 	return cpy;
 }
 
-static void wdfree(weather_data_t *wd)
+/*
+ * Free what the weather data structure points to.
+ */
+static void wdclear(weather_data_t *wd)
 {
 	struct sensor_list *list;
 
@@ -116,45 +341,268 @@ static void wdfree(weather_data_t *wd)
 		free(list->sensor);
 		free(list);
 	}
+}
 
+static void wdfree(weather_data_t *wd)
+{
+	wdclear(wd);
 	free(wd);
 }
 
+/*
+ * Weather data snapshots
+ *
+ * The main thread is the only writer of the live weather data. Once
+ * per publish cycle, between packets, it takes a copy. The snapshot
+ * is then shared, read-only, by every service's queue and freed when
+ * the last one is done with it.
+ *
+ * views is a mask of UNITS_BIT()s. Each of those unit conversions is
+ * done here, once, rather than by every service that wants it.
+ */
+struct wd_snapshot *snapshot_create(weather_data_t *wd, unsigned int views)
+{
+	struct wd_snapshot *snap;
+	int u;
+
+	snap = calloc(1, sizeof(struct wd_snapshot));
+	if (!snap) {
+		fprintf(stderr, "Failed to allocate memory for snapshot\n");
+		return NULL;
+	}
+
+	snap->data = wdcopy(wd);
+	if (!snap->data) {
+		free(snap);
+		return NULL;
+	}
+	snap->view[UNITS_METRIC] = snap->data;
+	snap->refs = 1;
+
+	for (u = UNITS_METRIC + 1; u < UNITS_VIEWS; u++) {
+		if (!(views & UNITS_BIT(u)))
+			continue;
+		if ((snap->view[u] = wdcopy(snap->data)) != NULL)
+			convert_units(snap->view[u], u);
+	}
+
+	return snap;
+}
+
+struct wd_snapshot *snapshot_hold(struct wd_snapshot *snap)
+{
+	__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+	return snap;
+}
 
-void send_to(struct service_info *sinfo, weather_data_t *wd)
+void snapshot_put(struct wd_snapshot *snap)
 {
-	weather_data_t *wd_copy;
-	pthread_t w_thread;
-	struct thread_info *tinfo;
-	int err = 1;
-	char *ts;
+	int u;
+
+	if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		for (u = UNITS_METRIC + 1; u < UNITS_VIEWS; u++) {
+			if (snap->view[u])
+				wdfree(snap->view[u]);
+		}
+		wdfree(snap->data);
+		free(snap);
+	}
+}
 
-	if (sinfo == NULL)
-		goto end;
+/*
+ * Create the send queue for a service and start its worker thread.
+ */
+int send_start(struct service_info *sinfo)
+{
+	struct send_queue *q;
+	int err;
+
+	q = calloc(1, sizeof(struct send_queue));
+	if (!q) {
+		fprintf(stderr, "Failed to allocate send queue for %s\n",
+				sinfo->service);
+		return -1;
+	}
 
-	send_count++;
+	q->depth = (sinfo->queue_depth > 0) ?
+		sinfo->queue_depth : DEFAULT_QUEUE_DEPTH;
+	q->ring = calloc(q->depth, sizeof(struct wd_snapshot *));
+	if (!q->ring) {
+		fprintf(stderr, "Failed to allocate send queue for %s\n",
+				sinfo->service);
+		free(q);
+		return -1;
+	}
 
-	/* Make a copy of the data so it doesn't get overwritten */
-	wd_copy = wdcopy(wd);
-	if (!wd_copy)
-		return;
+	q->change = change_create(&sinfo->cfg);
+	if (!q->change) {
+		fprintf(stderr, "Failed to allocate send queue for %s\n",
+				sinfo->service);
+		free(q->ring);
+		free(q);
+		return -1;
+	}
 
-	tinfo = malloc(sizeof(struct thread_info));
-	tinfo->sinfo = sinfo;
-	tinfo->data = wd_copy;
+	if (sinfo->spool)
+		q->spool = spool_open(sinfo->service);
 
-	err = pthread_create(&w_thread, NULL, invoke_publisher, (void *)tinfo);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	sinfo->queue = q;
 
+	err = pthread_create(&q->thread, NULL, send_worker, (void *)sinfo);
 	if (err) {
-		free(tinfo);
-		wdfree(wd_copy);
-		ts = time_stamp(0, 1);
-		fprintf(stderr, "%s: Failed to create thread for %s (cnt=%d): %s\n",
-				ts, sinfo->cfg.name, send_count, strerror(err));
-		free(ts);
+		fprintf(stderr, "Failed to create thread for %s: %s\n",
+				sinfo->service, strerror(err));
+		sinfo->queue = NULL;
+		spool_close(q->spool);
+		change_free(q->change);
+		free(q->ring);
+		free(q);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stop the worker thread for a service. Anything still waiting to
+ * be sent is spooled, if the service has a spool, or discarded.
+ */
+void send_stop(struct service_info *sinfo)
+{
+	struct send_queue *q = sinfo->queue;
+	int i;
+
+	if (!q)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_join(q->thread, NULL);
+
+	for (i = 0; i < q->depth; i++) {
+		if (!q->ring[i])
+			continue;
+		if (q->spool)
+			spool_append(q->spool, q->ring[i]->data);
+		snapshot_put(q->ring[i]);
+	}
+
+	spool_close(q->spool);
+	change_free(q->change);
+	free(q->held);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	free(q->ring);
+	free(q);
+	sinfo->queue = NULL;
+}
+
+/*
+ * Queue a snapshot of the weather data for the service's worker thread.
+ *
+ * If the queue is full, the service's overflow policy decides
+ * whether we drop the oldest sample, replace the newest sample,
+ * or wait for room. This is called from the event loop, so the wait
+ * is limited to BLOCK_WAIT, after that the oldest is dropped.
+ */
+void send_to(struct service_info *sinfo, struct wd_snapshot *snap)
+{
+	struct send_queue *q;
+	struct timespec until;
+	int tail;
+	char *ts;
+
+	if ((sinfo == NULL) || (sinfo->queue == NULL))
+		return;
+
+	q = sinfo->queue;
+
+	pthread_mutex_lock(&q->lock);
+
+	if (q->count == q->depth) {
+		switch (sinfo->overflow) {
+			case QUEUE_COALESCE:
+				tail = (q->head + q->count - 1) % q->depth;
+				snapshot_put(q->ring[tail]);
+				q->ring[tail] = snapshot_hold(snap);
+				q->stats.coalesced++;
+				pthread_mutex_unlock(&q->lock);
+				return;
+			case QUEUE_BLOCK:
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_nsec += BLOCK_WAIT * 1000000L;
+				if (until.tv_nsec >= 1000000000L) {
+					until.tv_sec++;
+					until.tv_nsec -= 1000000000L;
+				}
+				while ((q->count == q->depth) && !q->stop) {
+					if (pthread_cond_timedwait(&q->not_full, &q->lock,
+								&until) == ETIMEDOUT)
+						break;
+				}
+				if ((q->count < q->depth) || q->stop)
+					break;
+				/* fall through */
+			case QUEUE_DROP_OLDEST:
+			default:
+				snapshot_put(q->ring[q->head]);
+				q->ring[q->head] = NULL;
+				q->head = (q->head + 1) % q->depth;
+				q->count--;
+				q->stats.dropped++;
+
+				if (verbose || debug) {
+					ts = time_stamp(0, 1);
+					fprintf(stderr, "%s: Send queue for %s is full "
+							"(dropped=%lu)\n",
+							ts, sinfo->service, q->stats.dropped);
+					free(ts);
+				}
+				break;
+		}
+	}
+
+	if (q->stop) {
+		pthread_mutex_unlock(&q->lock);
+		return;
 	}
 
-	pthread_detach(w_thread);
-end:
-	return;
+	tail = (q->head + q->count) % q->depth;
+	q->ring[tail] = snapshot_hold(snap);
+	q->count++;
+	if (q->count > q->stats.high_water)
+		q->stats.high_water = q->count;
+
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Get a snapshot of the send queue counters for a service.
+ */
+void send_stats(struct service_info *sinfo, struct send_stats *st)
+{
+	struct send_queue *q = sinfo->queue;
+
+	memset(st, 0, sizeof(struct send_stats));
+	if (!q)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	*st = q->stats;
+	st->depth = q->count;
+	if (q->busy_since)
+		st->busy = (int)(time(NULL) - q->busy_since);
+	pthread_mutex_unlock(&q->lock);
+
+	if (q->spool)
+		spool_stats(q->spool, st);
 }
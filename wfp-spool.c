@@ -0,0 +1,485 @@
+/*
+ * Copyright (c) 2018 Robert Paauwe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software")
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Spool of failed sends.
+ *
+ * When a service can't be reached, the sample is appended to an
+ * on-disk spool file for that service (<spool_dir>/<service>.spool)
+ * so it isn't lost. The service's send thread replays the spool
+ * when it has nothing else to do (see wfp-send.c).
+ *
+ * The file is a small header followed by fixed size binary records.
+ * The header holds the offset of the next record to replay. Once
+ * everything has been replayed the file is truncated. Records that
+ * were only partly written (a crash in the middle of an append) are
+ * dropped when the file is opened, and each record has a checksum
+ * so a damaged one is skipped rather than sent. When the spool is
+ * full the oldest record is dropped to make room for the new one.
+ *
+ * A record holds every value, the wind direction text and up to
+ * SPOOL_SENSORS tower sensors. The high and low values of the day,
+ * rain totals etc. are as they were when the sample was taken.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "wfp.h"
+
+#define SPOOL_MAGIC 0x53504657		/* "WFPS" */
+#define SPOOL_VERSION 2
+#define SPOOL_SENSORS 4			/* tower sensors kept with a sample */
+
+/*
+ * The values in the order they're stored. Strikes is stored as an
+ * int after them, as it was when it was an int in weather_data_t.
+ */
+static const enum wd_field spool_fields[] = {
+	WD_PRESSURE, WD_PRESSURE_SEALEVEL, WD_TEMPERATURE, WD_HUMIDITY,
+	WD_WINDSPEED, WD_WINDDIRECTION, WD_GUSTSPEED, WD_GUSTDIRECTION,
+	WD_ILLUMINATION, WD_DISTANCE, WD_SOLAR, WD_UV, WD_RAIN,
+	WD_DAILY_RAIN, WD_RAINFALL_1HR, WD_RAINFALL_DAY, WD_RAINFALL_MONTH,
+	WD_RAINFALL_YEAR, WD_RAINFALL_60MIN, WD_RAINFALL_24HR,
+	WD_TEMPERATURE_HIGH, WD_TEMPERATURE_LOW, WD_DEWPOINT, WD_HEATINDEX,
+	WD_WINDCHILL, WD_TREND, WD_FEELSLIKE, WD_PRESSURE_CHANGE, WD_TENDENCY,
+};
+
+#define SPOOL_FIELDS (sizeof(spool_fields) / sizeof(spool_fields[0]))
+
+struct spool_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t offset;			/* next record to replay */
+};
+
+/* Sensors are replayed by location, without their id */
+struct spool_sensor {
+	char location[50];
+	double temperature;
+	double humidity;
+	double temperature_high;
+	double temperature_low;
+};
+
+struct spool_record {
+	uint32_t magic;
+	uint32_t sum;				/* checksum of everything after this */
+	int64_t time;
+	double value[SPOOL_FIELDS];
+	int32_t strikes;
+	char wind_dir[4];
+	int32_t sensors;
+	struct spool_sensor sensor[SPOOL_SENSORS];
+};
+
+struct spool {
+	pthread_mutex_t lock;
+	int fd;
+	char *path;
+	off_t offset;				/* next record to replay */
+	off_t size;
+	time_t oldest;				/* time of the record at offset */
+	time_t last_sync;
+	unsigned long replayed;
+	unsigned long expired;
+	unsigned long dropped;
+};
+
+static char *spool_dir = "spool";
+static int spool_sync = 0;			/* seconds between fsyncs, -1 never */
+static int spool_max = 10000;		/* records */
+static int spool_age = 86400;		/* seconds, older records are dropped */
+
+/*
+ * Set from the config file, before any spools are opened.
+ */
+void spool_config(const char *dir, int sync, int max, int age)
+{
+	if (dir)
+		spool_dir = strdup(dir);
+	spool_sync = sync;
+	if (max > 0)
+		spool_max = max;
+	if (age > 0)
+		spool_age = age;
+}
+
+static uint32_t spool_sum(struct spool_record *rec)
+{
+	return checksum(&rec->time, (char *)(rec + 1) - (char *)&rec->time);
+}
+
+static int spool_write_offset(struct spool *sp)
+{
+	uint64_t offset = sp->offset;
+
+	if (pwrite(sp->fd, &offset, sizeof(offset),
+				offsetof(struct spool_header, offset)) != sizeof(offset))
+		return -1;
+	return 0;
+}
+
+/*
+ * Once everything has been replayed, truncate the file back to just
+ * the header. Called with the lock held.
+ */
+static void spool_reset_if_empty(struct spool *sp)
+{
+	if ((sp->offset >= sp->size) &&
+			(sp->offset > (off_t)sizeof(struct spool_header))) {
+		sp->offset = sizeof(struct spool_header);
+		sp->size = sp->offset;
+		ftruncate(sp->fd, sp->size);
+	}
+}
+
+/*
+ * Move the waiting records back to the start of the file. Called
+ * with the lock held, once dropping old records has left at least as
+ * much space in front of them as they take up, so the copy never
+ * overwrites a record that hasn't been copied yet. The offset isn't
+ * moved until the copy is on disk; a crash after that can only send
+ * some records twice.
+ */
+static void spool_compact(struct spool *sp)
+{
+	struct spool_record rec[16];
+	off_t from = sp->offset;
+	off_t to = sizeof(struct spool_header);
+	ssize_t n;
+
+	while (from < sp->size) {
+		n = sp->size - from;
+		if (n > (ssize_t)sizeof(rec))
+			n = sizeof(rec);
+		if ((pread(sp->fd, rec, n, from) != n) ||
+				(pwrite(sp->fd, rec, n, to) != n))
+			return;
+		from += n;
+		to += n;
+	}
+
+	fdatasync(sp->fd);
+	sp->offset = sizeof(struct spool_header);
+	if (spool_write_offset(sp) == 0) {
+		sp->size = to;
+		ftruncate(sp->fd, sp->size);
+	}
+}
+
+/*
+ * Read the time of the oldest record waiting, for the stats.
+ */
+static void spool_update_oldest(struct spool *sp)
+{
+	int64_t t;
+
+	sp->oldest = 0;
+	if ((sp->offset < sp->size) &&
+			(pread(sp->fd, &t, sizeof(t), sp->offset +
+				   offsetof(struct spool_record, time)) == sizeof(t)))
+		sp->oldest = (time_t)t;
+}
+
+/*
+ * Open (or create) the spool file for a service.
+ */
+struct spool *spool_open(const char *service)
+{
+	struct spool_header hdr;
+	struct spool *sp;
+	struct stat st;
+	off_t whole;
+
+	mkdir(spool_dir, 0755);
+
+	sp = calloc(1, sizeof(struct spool));
+	if (!sp)
+		return NULL;
+
+	sp->path = malloc(strlen(spool_dir) + strlen(service) + 8);
+	if (!sp->path) {
+		free(sp);
+		return NULL;
+	}
+	sprintf(sp->path, "%s/%s.spool", spool_dir, service);
+
+	sp->fd = open(sp->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if ((sp->fd < 0) || fstat(sp->fd, &st)) {
+		fprintf(stderr, "Failed to open spool %s: %s\n", sp->path,
+				strerror(errno));
+		goto fail;
+	}
+
+	if ((st.st_size < (off_t)sizeof(hdr)) ||
+			(pread(sp->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+			(hdr.magic != SPOOL_MAGIC) || (hdr.version != SPOOL_VERSION)) {
+		/* New (or unusable) file, start over */
+		hdr.magic = SPOOL_MAGIC;
+		hdr.version = SPOOL_VERSION;
+		hdr.offset = sizeof(hdr);
+		if ((ftruncate(sp->fd, 0) < 0) ||
+				(pwrite(sp->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))) {
+			fprintf(stderr, "Failed to create spool %s: %s\n", sp->path,
+					strerror(errno));
+			goto fail;
+		}
+		st.st_size = sizeof(hdr);
+	}
+
+	/* Drop a partly written record at the end */
+	whole = sizeof(hdr) + ((st.st_size - sizeof(hdr)) /
+			sizeof(struct spool_record)) * sizeof(struct spool_record);
+	if (whole != st.st_size)
+		ftruncate(sp->fd, whole);
+
+	sp->size = whole;
+	sp->offset = hdr.offset;
+	if ((sp->offset < (off_t)sizeof(hdr)) || (sp->offset > sp->size))
+		sp->offset = sp->size;
+	spool_update_oldest(sp);
+	pthread_mutex_init(&sp->lock, NULL);
+
+	if (sp->offset < sp->size)
+		printf("%s has %d samples waiting to be sent\n", sp->path,
+				(int)((sp->size - sp->offset) / sizeof(struct spool_record)));
+
+	return sp;
+
+fail:
+	if (sp->fd >= 0)
+		close(sp->fd);
+	free(sp->path);
+	free(sp);
+	return NULL;
+}
+
+void spool_close(struct spool *sp)
+{
+	if (!sp)
+		return;
+
+	fsync(sp->fd);
+	close(sp->fd);
+	pthread_mutex_destroy(&sp->lock);
+	free(sp->path);
+	free(sp);
+}
+
+/*
+ * Add a sample to the end of the spool.
+ */
+int spool_append(struct spool *sp, weather_data_t *wd)
+{
+	struct spool_record rec;
+	struct spool_sensor *ss;
+	struct sensor_list *list;
+	time_t now = time(NULL);
+	unsigned int i;
+	int ret = 0;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = SPOOL_MAGIC;
+	rec.time = wd->time ? wd->time : now;
+	for (i = 0; i < SPOOL_FIELDS; i++)
+		rec.value[i] = wd->value[spool_fields[i]];
+	rec.strikes = (int32_t)wd->strikes;
+	memcpy(rec.wind_dir, wd->wind_dir, sizeof(rec.wind_dir));
+
+	for (list = wd->tower_list; list && (rec.sensors < SPOOL_SENSORS);
+			list = list->next) {
+		ss = &rec.sensor[rec.sensors++];
+		memcpy(ss->location, list->sensor->location, sizeof(ss->location));
+		ss->location[sizeof(ss->location) - 1] = '\0';
+		ss->temperature = list->sensor->temperature;
+		ss->humidity = list->sensor->humidity;
+		ss->temperature_high = list->sensor->temperature_high;
+		ss->temperature_low = list->sensor->temperature_low;
+	}
+	rec.sum = spool_sum(&rec);
+
+	pthread_mutex_lock(&sp->lock);
+
+	/*
+	 * Full, drop the oldest to make room. Appends and replays are
+	 * both done on the service's send thread, so this can't move
+	 * past a record that's being sent.
+	 */
+	if ((sp->size - sp->offset) / (off_t)sizeof(rec) >= spool_max) {
+		sp->offset += sizeof(rec);
+		sp->dropped++;
+		if (sp->offset - (off_t)sizeof(struct spool_header) >=
+				sp->size - sp->offset)
+			spool_compact(sp);
+		else
+			spool_write_offset(sp);
+	}
+
+	if (pwrite(sp->fd, &rec, sizeof(rec), sp->size) != sizeof(rec)) {
+		fprintf(stderr, "Failed to write to spool %s: %s\n", sp->path,
+				strerror(errno));
+		ftruncate(sp->fd, sp->size);
+		ret = -1;
+		goto out;
+	}
+
+	sp->size += sizeof(rec);
+	spool_update_oldest(sp);
+
+	if ((spool_sync == 0) ||
+			((spool_sync > 0) && (now - sp->last_sync >= spool_sync))) {
+		fdatasync(sp->fd);
+		sp->last_sync = now;
+	}
+
+out:
+	pthread_mutex_unlock(&sp->lock);
+	return ret;
+}
+
+/*
+ * Get the next sample to replay, without removing it. Samples too
+ * old to be worth sending are dropped here. Returns 1 if wd was
+ * filled in or 0 if there's nothing waiting.
+ *
+ * wd->timestamp and wd->tower_list are allocated, the caller frees
+ * them.
+ */
+int spool_peek(struct spool *sp, weather_data_t *wd)
+{
+	struct spool_record rec;
+	struct sensor_list *list;
+	struct sensor_list **tail;
+	time_t now = time(NULL);
+	struct tm lt;
+	unsigned int i;
+	int found = 0;
+
+	pthread_mutex_lock(&sp->lock);
+	while (!found && (sp->offset < sp->size)) {
+		if ((pread(sp->fd, &rec, sizeof(rec), sp->offset) != sizeof(rec)) ||
+				(rec.magic != SPOOL_MAGIC) || (rec.sum != spool_sum(&rec))) {
+			fprintf(stderr, "Skipping damaged record in %s\n", sp->path);
+			sp->offset += sizeof(rec);
+			continue;
+		}
+
+		if (now - rec.time > spool_age) {
+			sp->expired++;
+			sp->offset += sizeof(rec);
+			continue;
+		}
+
+		found = 1;
+	}
+	spool_reset_if_empty(sp);
+	spool_write_offset(sp);
+	spool_update_oldest(sp);
+	pthread_mutex_unlock(&sp->lock);
+
+	if (!found)
+		return 0;
+
+	memset(wd, 0, sizeof(weather_data_t));
+	wd->time = (time_t)rec.time;
+	for (i = 0; i < SPOOL_FIELDS; i++)
+		wd->value[spool_fields[i]] = rec.value[i];
+	wd->strikes = rec.strikes;
+	memcpy(wd->wind_dir, rec.wind_dir, sizeof(rec.wind_dir));
+	wd->wind_dir[3] = '\0';
+
+	tail = &wd->tower_list;
+	for (i = 0; (i < (unsigned int)rec.sensors) && (i < SPOOL_SENSORS); i++) {
+		list = calloc(1, sizeof(struct sensor_list));
+		if (!list)
+			break;
+		list->sensor = calloc(1, sizeof(struct sensor_data));
+		if (!list->sensor) {
+			free(list);
+			break;
+		}
+		memcpy(list->sensor->location, rec.sensor[i].location,
+				sizeof(list->sensor->location));
+		list->sensor->location[sizeof(list->sensor->location) - 1] = '\0';
+		list->sensor->temperature = rec.sensor[i].temperature;
+		list->sensor->humidity = rec.sensor[i].humidity;
+		list->sensor->temperature_high = rec.sensor[i].temperature_high;
+		list->sensor->temperature_low = rec.sensor[i].temperature_low;
+		*tail = list;
+		tail = &list->next;
+	}
+
+	localtime_r(&wd->time, &lt);
+	wd->timestamp = malloc(25);
+	if (wd->timestamp)
+		strftime(wd->timestamp, 25, "%Y-%m-%d %H:%M:%S", &lt);
+
+	return 1;
+}
+
+/*
+ * The sample from spool_peek() was sent, move past it. When the
+ * spool is empty, the file is truncated back to just the header.
+ */
+void spool_commit(struct spool *sp)
+{
+	pthread_mutex_lock(&sp->lock);
+	if (sp->offset < sp->size) {
+		sp->offset += sizeof(struct spool_record);
+		sp->replayed++;
+	}
+	spool_reset_if_empty(sp);
+	spool_write_offset(sp);
+	spool_update_oldest(sp);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+int spool_count(struct spool *sp)
+{
+	int count;
+
+	pthread_mutex_lock(&sp->lock);
+	count = (sp->size - sp->offset) / sizeof(struct spool_record);
+	pthread_mutex_unlock(&sp->lock);
+
+	return count;
+}
+
+/*
+ * Fill in the spool part of a service's send stats.
+ */
+void spool_stats(struct spool *sp, struct send_stats *st)
+{
+	pthread_mutex_lock(&sp->lock);
+	st->spooled = (sp->size - sp->offset) / sizeof(struct spool_record);
+	st->spool_age = sp->oldest ? (int)(time(NULL) - sp->oldest) : 0;
+	st->replayed = sp->replayed;
+	st->expired = sp->expired;
+	st->dropped += sp->dropped;
+	pthread_mutex_unlock(&sp->lock);
+}
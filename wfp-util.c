@@ -23,174 +23,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
 #include <sys/time.h>
-#include <netdb.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <math.h>
+#include "cJSON.h"
 #include "wfp.h"
 
 char *time_stamp(int gmt, int mode);
-void send_url(char *host, int port, char *url, char *ident, int response);
-char *resolve_host(char *host);
-char *resolve_host_ip6(char *host);
 double TempC(double tempf);
 
-static int verbose = 0;
-
-void send_url(char *host, int port, char *url, char *ident, int response)
-{
-	int sock;
-	struct sockaddr_in *remote;
-	int tmpres;
-	char *ip_addr;
-	char *buf;
-	char *ts;
-
-	if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-		fprintf(stderr, "ERROR: Failed to create TCP socket.\n");
-		return;
-	}
-
-	ip_addr = resolve_host(host);
-	if (!ip_addr) {
-		fprintf(stderr, "ERROR: Failed to resolve %s\n", host);
-		close(sock);
-		return;
-	}
-
-	if (strcmp(ip_addr, "127.0.1.1") == 0) {
-		free(ip_addr);
-		ip_addr = resolve_host_ip6(host);
-		if (strcmp(ip_addr, "127.0.1.1") == 0) {
-			fprintf(stderr, "ERROR: failed to resolve ip address for %s\n",
-					host);
-			close(sock);
-			free(ip_addr);
-			return;
-		}
-	}
-
-
-	remote = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in *));
-	remote->sin_family = AF_INET;
-	tmpres = inet_pton(AF_INET, ip_addr, (void *)(&(remote->sin_addr.s_addr)));
-	if (tmpres) {
-	}
-
-	remote->sin_port = htons(port);
-
-	if (connect(sock, (struct sockaddr *)remote, sizeof(struct sockaddr)) < 0) {
-		ts = time_stamp(0, 1);
-		fprintf(stderr, "ERROR: %s %s(%s) failed: %m\n", ts, host, ip_addr);
-		free(ts);
-		free(remote);
-		free(ip_addr);
-		return;
-	}
-
-	if (ident) {
-		send(sock, ident, strlen(ident), 0);
-		sleep(2);
-	}
-
-	//printf("Sending: %s\n", url);
-	send(sock, url, strlen(url), 0);
-
-	/* should we wait for a response from the server? */
-	if (response) {
-		if (verbose > 1)
-			fprintf(stderr, "\nRemote returned:\n");
-		buf = (char *)malloc(4096);
-		while ((tmpres = recv(sock, buf, 4095, 0)) > 0) {
-			buf[tmpres] = '\0';
-			if (verbose > 1)
-				fprintf(stderr, "%s", buf);
-		}
-		free(buf);
-	}
-
-	if (verbose > 1)
-		fprintf(stderr, "Closing connection.\n");
-
-	close(sock);
-	free(remote);
-	free(ip_addr);
-}
-
-char *resolve_host(char *host)
-{
-	struct hostent *hent;
-	struct in_addr **addr_list;
-	int iplen = 15;
-	char *ip = (char *)malloc(iplen + 1);
-	int i;
-
-	memset(ip, 0, iplen+1);
-
-	if ((hent = gethostbyname(host)) == NULL) {
-		fprintf(stderr, "Failed to resolve host name.\n");
-		free(ip);
-		return NULL;
-	}
-
-	addr_list = (struct in_addr **) hent->h_addr_list;
-
-	if (verbose > 1) {
-		for (i = 0; addr_list[i] != NULL; i++) {
-			fprintf(stderr, "RESOLVE: %s[%d] = %s\n",
-					host, i, inet_ntoa(*addr_list[i]));
-		}
-	}
-
-	if (inet_ntop(AF_INET, (void *)hent->h_addr_list[0], ip, iplen) == NULL) {
-		fprintf(stderr, "Failed to resolve host name.\n");
-		free(ip);
-		return NULL;
-	}
-
-	return ip;
-}
-
-
-/*
- * Really should be using this but since it seems to want a service
- * and I'm not sure if the 'http' service is valid for all weather
- * services, I'm only going to call this if gethostbyname() fails.
- */
-char *resolve_host_ip6(char *host)
-{
-	struct addrinfo hints, *servinfo, *p;
-	struct sockaddr_in *h;
-	int rv;
-	char *ip;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	if ((rv = getaddrinfo(host, "http", &hints, &servinfo)) != 0) {
-		fprintf(stderr, "resolve_host: %s\n", gai_strerror(rv));
-		return NULL;
-	}
-
-	for (p = servinfo; p != NULL; p = p->ai_next) {
-		h = (struct sockaddr_in *)p->ai_addr;
-		ip = malloc(strlen(inet_ntoa(h->sin_addr)));
-		if (!ip)
-			goto out;
-		strcpy(ip, inet_ntoa(h->sin_addr));
-		goto out;
-	}
-
-out:
-	freeaddrinfo(servinfo);
-	return ip;
-}
-
-
 /*
  * Generate a readable time stamp string.
  *
@@ -200,7 +44,14 @@ out:
 
 char *time_stamp(int gmt, int mode)
 {
-	time_t t = time(NULL);
+	return time_stamp_at(time(NULL), gmt, mode);
+}
+
+/*
+ * Same as time_stamp() but for time t.
+ */
+char *time_stamp_at(time_t t, int gmt, int mode)
+{
 	struct tm gt;
 	char *ts = (char *)malloc(25);;
 
@@ -223,8 +74,25 @@ char *time_stamp(int gmt, int mode)
 	return ts;
 }
 
+/*
+ * Publisher specific settings from the service's config entry.
+ */
+int cfg_int(struct cfg_info *cfg, const char *name, int def)
+{
+	cJSON *item = cJSON_GetObjectItemCaseSensitive(cfg->options, name);
+
+	return cJSON_IsNumber(item) ? item->valueint : def;
+}
+
+const char *cfg_string(struct cfg_info *cfg, const char *name, const char *def)
+{
+	cJSON *item = cJSON_GetObjectItemCaseSensitive(cfg->options, name);
+
+	return cJSON_IsString(item) ? item->valuestring : def;
+}
+
 char *DegreesToCardinal(double deg) {
-	if (deg > 348.75 && deg < 11.25)
+	if (deg >= 348.75 || deg < 11.25)
 		return "N";
 	else if (deg >= 11.25 && deg < 33.75)
 		return "NNE";
@@ -264,74 +132,170 @@ char *DegreesToCardinal(double deg) {
 
 
 /*
- * Calculate the pressure trend
- *   - raising / falling / steady
+ * Pressure trend and tendency.
+ *
+ * Station pressure is kept for the last three hours in a ring of one
+ * minute slots, indexed by the sample's minute. Adding a sample just
+ * overwrites its slot, and slots left over from before the window are
+ * recognised by their minute and skipped, so nothing is ever
+ * allocated or removed. Samples that arrive late, say after the hub
+ * catches up, land in the right slot.
+ *
+ * The change over three hours is the least-squares slope over the
+ * window. The tendency is the WMO/NWS code (0-8) for how it changed,
+ * worked out from the slopes of the older and newer halves.
  */
-struct trend_data {
-	time_t t;
+#define TREND_SLOTS 180				/* minutes */
+#define TREND_MIN_SPAN 60			/* minutes of data before there's a trend */
+#define TREND_STEADY 0.1			/* mb over three hours */
+#define TREND_HALF_STEADY 0.05		/* mb over an hour and a half */
+
+static struct {
+	long minute;				/* 0 if never used */
 	double p;
-	struct trend_data *next;
-	struct trend_data *prev;
+} trend_ring[TREND_SLOTS];
+
+static long trend_newest;
+
+struct trend_fit {
+	int n;
+	double sx, sy, sxy, sxx;
 };
 
-static struct trend_data *trend = NULL;
-static struct trend_data *trend_tail = NULL;
+static void fit_add(struct trend_fit *fit, double x, double y)
+{
+	fit->n++;
+	fit->sx += x;
+	fit->sy += y;
+	fit->sxy += x * y;
+	fit->sxx += x * x;
+}
 
-int calc_pressure_trend(double pressure) {
-	struct trend_data *td;
-	int p_trend = 0;
-	int count = 0;
+/* Slope in mb per minute, 0 if there aren't enough points */
+static double fit_slope(const struct trend_fit *fit)
+{
+	double d = fit->n * fit->sxx - fit->sx * fit->sx;
 
-	td = (struct trend_data *)malloc(sizeof(struct trend_data));
-	td->t = time(NULL);
-	td->p = pressure;
-	td->next = trend;
-	td->prev = NULL;
+	if ((fit->n < 2) || (d <= 0))
+		return 0;
+	return (fit->n * fit->sxy - fit->sx * fit->sy) / d;
+}
 
-	/* if first reading, mark it as tail */
-	if (trend)
-		trend->prev = td;
-	else
-		trend_tail = td;
+/*
+ * Pick the tendency code from the net change and the change over
+ * each half of the window, all in mb.
+ */
+static int tendency_code(double net, double first, double second)
+{
+	double eps = TREND_HALF_STEADY;
+
+	if (fabs(net) < TREND_STEADY) {
+		if ((first > eps) && (second < -eps))
+			return 0;		/* rising then falling, same as before */
+		if ((first < -eps) && (second > eps))
+			return 5;		/* falling then rising, same as before */
+		return 4;			/* steady */
+	}
 
-	trend = td;
+	if (net > 0) {
+		if (second < -eps)
+			return 0;		/* rising then falling */
+		if (first <= eps)
+			return 3;		/* steady or falling, then rising */
+		if (second <= eps)
+			return 1;		/* rising then steady */
+		if (second < first / 2)
+			return 1;		/* rising, then more slowly */
+		if (second > first * 2)
+			return 3;		/* rising, then more quickly */
+		return 2;			/* rising */
+	}
 
+	if (second > eps)
+		return 5;			/* falling then rising */
+	if (first >= -eps)
+		return 8;			/* steady or rising, then falling */
+	if (second >= -eps)
+		return 6;			/* falling then steady */
+	if (second > first / 2)
+		return 6;			/* falling, then more slowly */
+	if (second < first * 2)
+		return 8;			/* falling, then more quickly */
+	return 7;				/* falling */
+}
 
-	/* Calculate trend. Not really valid until 3 hours worth, but... */
-	if (trend_tail->p < pressure)
-		p_trend = 1;
-	else if (trend_tail->p > pressure)
-		p_trend = -1;
+/*
+ * Add the sample in wd and set its trend (-1, 0 or 1), three hour
+ * pressure change and tendency code.
+ */
+void calc_pressure_trend(weather_data_t *wd)
+{
+	struct trend_fit all, half[2];
+	time_t t = wd->time ? wd->time : time(NULL);
+	long minute = t / 60;
+	long oldest = minute;
+	double net, first, second;
+	double x;
+	int i;
 
-	/* Check the tail's time, if it is older than 3 hours dequeue it */
-	if ((time(NULL) - trend_tail->t) >= (60 * 60 * 3)) {
-		td = trend_tail->prev;
-		free(trend_tail);
-		td->next = NULL;
-		trend_tail = td;
+	if (minute > trend_newest)
+		trend_newest = minute;
+	if (minute > trend_newest - TREND_SLOTS) {
+		trend_ring[minute % TREND_SLOTS].minute = minute;
+		trend_ring[minute % TREND_SLOTS].p = wd->pressure;
 	}
 
-	/* Validate / count the trend list */
-	td = trend;
-	while (td) {
-		count++;
-		td = td->next;
+	memset(&all, 0, sizeof(all));
+	memset(half, 0, sizeof(half));
+	for (i = 0; i < TREND_SLOTS; i++) {
+		if (trend_ring[i].minute <= trend_newest - TREND_SLOTS)
+			continue;
+		x = trend_ring[i].minute - trend_newest;	/* -179 to 0 */
+		fit_add(&all, x, trend_ring[i].p);
+		fit_add(&half[x >= -TREND_SLOTS / 2], x, trend_ring[i].p);
+		if (trend_ring[i].minute < oldest)
+			oldest = trend_ring[i].minute;
 	}
-	printf("** Pressure Trend data has %d records\n", count);
 
+	if (trend_newest - oldest < TREND_MIN_SPAN) {
+		wd->trend = 0;
+		wd->pressure_change = 0;
+		wd->tendency = 4;
+		return;
+	}
 
-	return p_trend;
+	net = fit_slope(&all) * TREND_SLOTS;
+	first = fit_slope(&half[0]) * TREND_SLOTS / 2;
+	second = fit_slope(&half[1]) * TREND_SLOTS / 2;
+
+	wd->pressure_change = net;
+	wd->tendency = tendency_code(net, first, second);
+	if (net >= TREND_STEADY)
+		wd->trend = 1;
+	else if (net <= -TREND_STEADY)
+		wd->trend = -1;
+	else
+		wd->trend = 0;
 }
 
-void free_trend(void)
-{
-	struct trend_data *td = trend;
+/* Indexed by the tendency code */
+static const char *tendency_names[] = {
+	"rising then falling",
+	"rising then steady",
+	"rising",
+	"steady or falling then rising",
+	"steady",
+	"falling then rising",
+	"falling then steady",
+	"falling",
+	"steady or rising then falling",
+};
 
-	while(trend) {
-		td = trend;
-		trend = trend->next;
-		free(td);
-	}
+const char *tendency_name(int code)
+{
+	if ((code < 0) || (code > 8))
+		return "";
+	return tendency_names[code];
 }
 
 /*
@@ -438,43 +402,46 @@ double mm2inch(double mm) {
 /*
  * Convert all data from metric to english units. The conversion
  * is done in-place on the data structure.
+ *
+ * Every conversion is a scale and an offset that depend only on the
+ * value's unit class, so the tables are built from the field list
+ * at compile time and all the values are converted in one loop the
+ * compiler can vectorize.
  */
+#define TO_IMPERIAL_UNIT_NONE		1, 0
+#define TO_IMPERIAL_UNIT_TEMP		1.8, 32				/* C to F */
+#define TO_IMPERIAL_UNIT_HUMIDITY	1, 0
+#define TO_IMPERIAL_UNIT_PRESSURE	0.02952998751, 0	/* mb to inHg */
+#define TO_IMPERIAL_UNIT_SPEED		1 / 0.44704, 0		/* m/s to mph */
+#define TO_IMPERIAL_UNIT_DIRECTION	1, 0
+#define TO_IMPERIAL_UNIT_LIGHT		1, 0
+#define TO_IMPERIAL_UNIT_SOLAR		1, 0
+#define TO_IMPERIAL_UNIT_COUNT		1, 0
+#define TO_IMPERIAL_UNIT_DISTANCE	1 / 1.609344, 0		/* km to miles */
+#define TO_IMPERIAL_UNIT_RAIN		0.03937, 0			/* mm to inches */
+
+#define CONV_SCALE_(s, a) (s)
+#define CONV_ADD_(s, a) (a)
+#define CONV_SCALE(s) CONV_SCALE_(s)
+#define CONV_ADD(s) CONV_ADD_(s)
+#define SCALE_ENTRY(m, e, u, p, d) CONV_SCALE(TO_IMPERIAL_##u),
+#define ADD_ENTRY(m, e, u, p, d) CONV_ADD(TO_IMPERIAL_##u),
+
+static const double conv_scale[WD_VALUES] = { WD_FIELD_LIST(SCALE_ENTRY) };
+static const double conv_add[WD_VALUES] = { WD_FIELD_LIST(ADD_ENTRY) };
+
 void unit_convert(weather_data_t *wd, unsigned int skip)
 {
 	struct sensor_list *list = wd->tower_list;
+	int i;
 
-	/* convert temperature from C to F */
-	wd->temperature = TempF(wd->temperature);
-	wd->temperature_high = TempF(wd->temperature_high);
-	wd->temperature_low = TempF(wd->temperature_low);
-	wd->dewpoint = TempF(wd->dewpoint);
-	wd->heatindex = TempF(wd->heatindex);
-	wd->windchill = TempF(wd->windchill);
-	wd->feelslike = TempF(wd->feelslike);
-
-	/* convert speeds from m/s to mph */
-	wd->windspeed = MS2MPH(wd->windspeed);
-	wd->gustspeed = MS2MPH(wd->gustspeed);
-
-	if (!(skip & NO_PRESSURE)) {
-		/* Pressure from mb to in/hg */
-		wd->pressure = mb2in(wd->pressure);
-		wd->pressure_sealevel = mb2in(wd->pressure_sealevel);
+	for (i = 0; i < WD_VALUES; i++) {
+		/* Pressure, its sea level value and its change all stay metric */
+		if ((skip & NO_PRESSURE) && (wd_fields[i].unit == UNIT_PRESSURE))
+			continue;
+		wd->value[i] = wd->value[i] * conv_scale[i] + conv_add[i];
 	}
 
-	/* distance from km to miles */
-	wd->distance = km2miles(wd->distance);
-
-	/* rain from mm to inches */
-	wd->rain = mm2inch(wd->rain);
-	wd->daily_rain = mm2inch(wd->daily_rain);
-	wd->rainfall_1hr = mm2inch(wd->rainfall_1hr);
-	wd->rainfall_day = mm2inch(wd->rainfall_day);
-	wd->rainfall_month = mm2inch(wd->rainfall_month);
-	wd->rainfall_year = mm2inch(wd->rainfall_year);
-	wd->rainfall_60min = mm2inch(wd->rainfall_60min);
-	wd->rainfall_24hr = mm2inch(wd->rainfall_24hr);
-
 	/* convert temperature from C to F for extra sensors */
 	while (list) {
 		list->sensor->temperature = TempF(list->sensor->temperature);
@@ -484,3 +451,17 @@ void unit_convert(weather_data_t *wd, unsigned int skip)
 	}
 }
 
+
+/*
+ * FNV-1a hash, used to check records read back from disk.
+ */
+uint32_t checksum(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+
+	return h;
+}
@@ -31,26 +31,44 @@
 #include <unistd.h>
 #include "wfp.h"
 
-extern void send_url(char *host, int port, char *url, char *ident, int resp);
+#define WU_REQUEST_SIZE 1024
 
 static int debug;
-static char *tpl = "GET /%s HTTP/1.0\r\nHost: %s\r\nUser-Agent: %s\r\n\r\n";
+static struct http_conn *conn = NULL;
+
+static const struct {
+	const char *name;
+	enum wd_field field;
+} wu_params[] = {
+	{ "&baromin=",      WD_PRESSURE_SEALEVEL },
+	{ "&dailyrainin=",  WD_RAINFALL_DAY },
+	{ "&rainin=",       WD_RAIN },
+	{ "&windgustdir=",  WD_GUSTDIRECTION },
+	{ "&winddir=",      WD_WINDDIRECTION },
+	{ "&windgustmph=",  WD_GUSTSPEED },
+	{ "&windspeedmph=", WD_WINDSPEED },
+	{ "&humidity=",     WD_HUMIDITY },
+	{ "&dewptf=",       WD_DEWPOINT },
+	{ "&tempf=",        WD_TEMPERATURE },
+};
+
+#define WU_PARAMS (sizeof(wu_params) / sizeof(wu_params[0]))
 
 /*
  * Weather Underground publisher.
  */
-void send_to_wunderground(struct cfg_info *cfg, struct station_info *station,
-						weather_data_t *wd)
+int send_to_wunderground(struct cfg_info *cfg, struct station_info *station,
+						const weather_data_t *wd, uint64_t changed)
 {
-	char *str;
 	char *request;
 	struct timeval start, end;
 	char *ts_start, *ts_end;
+	unsigned int i;
+	int ret = -1;
+	int len;
 
 	gettimeofday(&start, NULL);
 
-	if (!cfg->metric)
-		unit_convert(wd, CONVERT_ALL);
 
 	if (debug) {
 		ts_start = time_stamp(0, 1);
@@ -58,59 +76,32 @@ void send_to_wunderground(struct cfg_info *cfg, struct station_info *station,
 		free(ts_start);
 	}
 
-	ts_start = time_stamp(1, 0);
-	request = (char *)malloc(1024);
-	sprintf(request, "weatherstation/updateweatherstation.php?"
+	ts_start = time_stamp_at(wd->time ? wd->time : time(NULL), 1, 0);
+	request = (char *)malloc(WU_REQUEST_SIZE);
+	len = snprintf(request, WU_REQUEST_SIZE,
+			"weatherstation/updateweatherstation.php?"
 			"ID=%s"
 			"&PASSWORD=%s"
 			"&dateutc=%s"
 			"&softwaretype=Experimental"
-			"&action=updateraw"
-			"&baromin=%f"
-			"&dailyrainin=%f"
-			"&rainin=%f"
-			"&windgustdir=%f"
-			"&winddir=%f"
-			"&windgustmph=%f"
-			"&windspeedmph=%f"
-			"&humidity=%f"
-			"&dewptf=%f"
-			"&tempf=%f",
+			"&action=updateraw",
 			cfg->name,
 			cfg->pass,
-			ts_start,
-			wd->pressure_sealevel,
-			wd->rainfall_day,
-			wd->rain,
-			wd->gustdirection,
-			wd->winddirection,
-			wd->gustspeed,
-			wd->windspeed,
-			wd->humidity,
-			wd->dewpoint,
-			wd->temperature
-			);
+			ts_start);
+	for (i = 0; (i < WU_PARAMS) && (len < WU_REQUEST_SIZE); i++)
+		len += fmt_param(request + len, WU_REQUEST_SIZE - len,
+				wu_params[i].name, cfg, wd, wu_params[i].field);
 
 	/*
-	 * Build url string using tpl as a template
-	 * sprintf(query, tpl, <page>, <host>, <USERAGENT>)
-	 *
-	 * <page> is the full string with data
-	 * <host> is the host name
-	 * <USERAGENT is the user agent string
+	 * The connection is opened on the first upload and kept open.
+	 * In debug mode, send to a test server instead.
 	 */
-
-	str = (char *)malloc(4096);
-
-	sprintf(str, tpl, request, cfg->host, "acu-link");
-	if (!debug) {
-		send_url(cfg->host, 80, str, NULL, 1);
-	} else {
-		send_url("www.bobshome.net", 80, str, NULL, 0);
-	}
+	if (!conn)
+		conn = http_open(debug ? "www.bobshome.net" : cfg->host, 80);
+	if (conn && ((http_get(conn, request, "acu-link") / 100) == 2))
+		ret = 0;
 
 	free(ts_start);
-	free(str);
 	free(request);
 
 	gettimeofday(&end, NULL);
@@ -127,7 +118,7 @@ void send_to_wunderground(struct cfg_info *cfg, struct station_info *station,
 		free(ts_end);
 	}
 
-	return;
+	return ret;
 }
 
 static int wu_init(struct cfg_info *cfg, int d)
@@ -137,15 +128,28 @@ static int wu_init(struct cfg_info *cfg, int d)
 }
 
 
+static void wu_cleanup(void)
+{
+	http_close(conn);
+	conn = NULL;
+}
+
 static const struct publisher_funcs wunderground_funcs = {
 	.init = wu_init,
 	.update = send_to_wunderground,
-	.cleanup = NULL
+	.cleanup = wu_cleanup
 };
 
 void wunderground_setup(struct service_info *sinfo)
 {
 	sinfo->funcs = wunderground_funcs;
+
+	/* Keep uploads that fail and send them when the site is back */
+	if (sinfo->spool < 0)
+		sinfo->spool = 1;
+	/* Look the host up ahead of the first upload, if it's going to be used */
+	if (sinfo->enabled)
+		dns_prefetch(sinfo->cfg.host);
 	return;
 }
 
@@ -23,6 +23,10 @@
 #ifndef _WFP_H_
 #define _WFP_H_
 
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
 struct sensor_data {
 	char *sensor_id;
 	char *timestamp;
@@ -40,44 +44,167 @@ struct sensor_list {
 };
 
 
+/*
+ * The weather values. Each one is a double member of weather_data_t
+ * and also value[WD_xxx], so code that handles every value the same
+ * way (unit conversion, change detection, aggregation, the JSON and
+ * MQTT output) can walk them with the registry in wfp-fields.c
+ * rather than naming each member.
+ *
+ * X(member, ENUM, unit class, decimal places, default deadband)
+ *
+ * The deadband is in metric units, see wfp-change.c. The order is
+ * the index; files that store values (spool, history) map them
+ * explicitly, so adding one doesn't change their layout.
+ */
+#define WD_FIELD_LIST(X) \
+	X(pressure,          PRESSURE,          UNIT_PRESSURE,  2, 0.1) \
+	X(pressure_sealevel, PRESSURE_SEALEVEL, UNIT_PRESSURE,  2, 0.1) \
+	X(temperature,       TEMPERATURE,       UNIT_TEMP,      1, 0.1) \
+	X(humidity,          HUMIDITY,          UNIT_HUMIDITY,  0, 1) \
+	X(windspeed,         WINDSPEED,         UNIT_SPEED,     1, 0.2) \
+	X(winddirection,     WINDDIRECTION,     UNIT_DIRECTION, 0, 10) \
+	X(gustspeed,         GUSTSPEED,         UNIT_SPEED,     1, 0.2) \
+	X(gustdirection,     GUSTDIRECTION,     UNIT_DIRECTION, 0, 10) \
+	X(illumination,      ILLUMINATION,      UNIT_LIGHT,     0, 100) \
+	X(distance,          DISTANCE,          UNIT_DISTANCE,  1, 0) \
+	X(solar,             SOLAR,             UNIT_SOLAR,     0, 5) \
+	X(uv,                UV,                UNIT_NONE,      1, 0.1) \
+	X(strikes,           STRIKES,           UNIT_COUNT,     0, 0) \
+	X(rain,              RAIN,              UNIT_RAIN,      2, 0) \
+	X(daily_rain,        DAILY_RAIN,        UNIT_RAIN,      2, 0) \
+	X(rainfall_1hr,      RAINFALL_1HR,      UNIT_RAIN,      2, 0) \
+	X(rainfall_day,      RAINFALL_DAY,      UNIT_RAIN,      2, 0) \
+	X(rainfall_month,    RAINFALL_MONTH,    UNIT_RAIN,      2, 0) \
+	X(rainfall_year,     RAINFALL_YEAR,     UNIT_RAIN,      2, 0) \
+	X(rainfall_60min,    RAINFALL_60MIN,    UNIT_RAIN,      2, 0) \
+	X(rainfall_24hr,     RAINFALL_24HR,     UNIT_RAIN,      2, 0) \
+	X(temperature_high,  TEMPERATURE_HIGH,  UNIT_TEMP,      1, 0) \
+	X(temperature_low,   TEMPERATURE_LOW,   UNIT_TEMP,      1, 0) \
+	X(dewpoint,          DEWPOINT,          UNIT_TEMP,      1, 0.1) \
+	X(heatindex,         HEATINDEX,         UNIT_TEMP,      1, 0.1) \
+	X(windchill,         WINDCHILL,         UNIT_TEMP,      1, 0.1) \
+	X(trend,             TREND,             UNIT_NONE,      0, 0) \
+	X(feelslike,         FEELSLIKE,         UNIT_TEMP,      1, 0.1) \
+	X(pressure_change,   PRESSURE_CHANGE,   UNIT_PRESSURE,  2, 0.1) \
+	X(tendency,          TENDENCY,          UNIT_NONE,      0, 0)
+
+/*
+ * What a value measures. The unit conversion and the unit labels
+ * (wfp-fields.c) go by this.
+ */
+enum wd_unit {
+	UNIT_NONE = 0,
+	UNIT_TEMP,
+	UNIT_HUMIDITY,
+	UNIT_PRESSURE,
+	UNIT_SPEED,
+	UNIT_DIRECTION,
+	UNIT_LIGHT,
+	UNIT_SOLAR,
+	UNIT_COUNT,
+	UNIT_DISTANCE,
+	UNIT_RAIN,
+	UNIT_CLASSES
+};
+
+/*
+ * WD_VALUES is the number of values. The change detection
+ * (wfp-change.c) also uses WD_SENSORS to stand for all of the tower
+ * sensors.
+ */
+#define WD_ENUM(m, e, u, p, d) WD_##e,
+enum wd_field {
+	WD_FIELD_LIST(WD_ENUM)
+	WD_VALUES,
+	WD_SENSORS = WD_VALUES,
+	WD_FIELDS
+};
+#undef WD_ENUM
+
+#define WD_BIT(f) ((uint64_t)1 << (f))
+#define WD_ALL (WD_BIT(WD_FIELDS) - 1)
+
 /*
  * This structure holds a data record. It is built from the current
  * database record, calculated values, and the data collected from the bridge.
  */
+#define WD_MEMBER(m, e, u, p, d) double m;
 typedef struct _wd {
 	char *timestamp;
-	double pressure;
-	double pressure_sealevel;
-	double temperature;
-	double humidity;
-	double windspeed;
-	double winddirection;
-	double gustspeed;
-	double gustdirection;
-	double illumination;
-	double distance;
-	double solar;
-	double uv;
-	int strikes;
-	double rain;
-	double daily_rain;
-	double rainfall_1hr;
-	double rainfall_day;
-	double rainfall_month;
-	double rainfall_year;
-	double rainfall_60min;
-	double rainfall_24hr;
-	double temperature_high;
-	double temperature_low;
-	double dewpoint;
-	double heatindex;
-	double windchill;
-	double trend;
-	double feelslike;
+	time_t time;			/* when the sample was taken */
+	union {
+		struct {
+			WD_FIELD_LIST(WD_MEMBER)
+		};
+		double value[WD_VALUES];
+	};
 	char wind_dir[4];
 	struct sensor_list *tower_list;
 } weather_data_t;
+#undef WD_MEMBER
 
+/*
+ * Per value metadata, indexed by enum wd_field.
+ */
+struct wd_field_info {
+	const char *name;
+	enum wd_unit unit;
+	int precision;
+	double deadband;
+};
+
+/*
+ * The units a service wants its data in. Each snapshot is converted
+ * once for every set of units in use.
+ */
+enum wd_units {
+	UNITS_METRIC = 0,
+	UNITS_IMPERIAL,
+	UNITS_CWOP,				/* imperial, but pressure stays in mb */
+	UNITS_VIEWS
+};
+
+#define UNITS_BIT(u) (1 << (u))
+
+
+/*
+ * A WeatherFlow UDP packet, as decoded by wf_packet_scan(). The
+ * "obs" array is stored row by row, "ob" and "evt" arrays are
+ * stored as a single row.
+ */
+#define WF_MAX_ROWS 8
+#define WF_MAX_VALUES 20
+
+enum wf_type {
+	WF_UNKNOWN = 0,
+	WF_OBS_AIR,
+	WF_OBS_SKY,
+	WF_OBS_TOWER,
+	WF_RAPID_WIND,
+	WF_EVT_STRIKE,
+	WF_EVT_PRECIP,
+	WF_DEVICE_STATUS,
+	WF_HUB_STATUS
+};
+
+struct wf_packet {
+	enum wf_type type;
+	char serial_number[32];
+	char hub_sn[32];
+	int rows;
+	int cols[WF_MAX_ROWS];
+	double obs[WF_MAX_ROWS][WF_MAX_VALUES];
+	/* device_status and hub_status values */
+	double timestamp;
+	double uptime;
+	double voltage;
+	double rssi;
+	double hub_rssi;
+	double sensor_status;
+	double firmware_revision;
+	double seq;
+};
 
 struct mapping_info {
 	char *serial_number;
@@ -96,6 +223,8 @@ struct cfg_info {
 	char *pass;
 	char *extra;
 	int metric;
+	struct cJSON *options;	/* the service's config, for cfg_int() etc. */
+	int precision[WD_VALUES];	/* decimal places sent, see wfp-format.c */
 };
 
 struct station_info {
@@ -106,21 +235,100 @@ struct station_info {
 	int elevation;
 };
 
+/*
+ * update is given the data already in the service's units, it's
+ * shared with the other services so it mustn't be changed. It
+ * returns -1 if the data couldn't be sent and should be
+ * tried again later (see wfp-spool.c). changed has a WD_BIT() set
+ * for each value that has changed since the service last sent
+ * successfully (see wfp-change.c).
+ *
+ * update can also return 1 to say it has kept the data to write out
+ * later with others. The send thread holds on to those samples and
+ * calls flush, flush_time seconds after the first, until it returns
+ * 0. A 0 from update means everything held has been written too.
+ * Whatever is still held when the service stops is spooled.
+ *
+ * event, if set, gets rapid_wind, evt_strike and evt_precip packets
+ * as they arrive. It's called on the main thread so it must not
+ * block.
+ */
 struct publisher_funcs {
 	int (*init)(struct cfg_info *info, int debug);
-	void (*update)(struct cfg_info *info, struct station_info *station,
-					weather_data_t *data);
+	int (*update)(struct cfg_info *info, struct station_info *station,
+					const weather_data_t *data, uint64_t changed);
+	void (*event)(struct cfg_info *info, const struct wf_packet *pkt);
+	int (*flush)(struct cfg_info *info);
 	void (*cleanup)(void);
 };
 
+/*
+ * What to do when a service's send queue is full. A slow or hung
+ * service never holds up the others, it only backs up its own queue.
+ */
+enum queue_policy {
+	QUEUE_DROP_OLDEST = 0,	/* discard the oldest queued sample */
+	QUEUE_COALESCE,			/* replace the newest queued sample */
+	QUEUE_BLOCK				/* wait a little, then drop the oldest */
+};
+
+struct send_queue;
+struct aggregate;
+
 struct service_info {
 	char *service;
 	int enabled;
 	int index;
+	int queue_depth;
+	enum queue_policy overflow;
+	int timeout;			/* seconds before a send is reported stuck */
+	int stuck;				/* the current send has been reported */
+	int interval;			/* seconds between sends, 0 for every sample */
+	int align;				/* send on the interval boundary */
+	int window;				/* seconds of data to average, 0 for none */
+	int spool;				/* keep failed sends on disk and retry them */
+	int replay_interval;	/* seconds between replayed sends */
+	int flush_time;			/* seconds a held sample waits for flush */
+	int skip_unchanged;		/* don't send if nothing changed */
+	int max_skip;			/* but do send at least this often */
+	enum wd_units units;	/* what the service is sent */
+	time_t next_due;
 	struct station_info station;
 	struct cfg_info cfg;
 	struct service_info *next;
+	struct service_info *wheel_next;
 	struct publisher_funcs funcs;
+	struct send_queue *queue;
+	struct aggregate *agg;
+};
+
+/*
+ * Send queue counters, used to see if a service is falling behind.
+ */
+struct send_stats {
+	int depth;				/* samples waiting right now */
+	int high_water;			/* most samples ever waiting */
+	unsigned long sent;
+	unsigned long dropped;
+	unsigned long coalesced;
+	int busy;				/* seconds the current send has been running */
+	int spooled;			/* failed sends waiting in the spool */
+	int spool_age;			/* seconds since the oldest was taken */
+	unsigned long replayed;
+	unsigned long expired;	/* too old to replay */
+	unsigned long skipped;	/* nothing changed */
+};
+
+/*
+ * A point returned by history_query(). Minute values have min, max
+ * and mean all the same.
+ */
+struct hist_point {
+	time_t time;			/* start of the minute, hour or day */
+	double min;
+	double max;
+	double mean;
+	int count;				/* minutes in the rollup */
 };
 
 
@@ -162,20 +370,146 @@ extern void cwop_setup(struct service_info *s);
 extern void mqtt_setup(struct service_info *s);
 extern void mysql_setup(struct service_info *s);
 extern void display_setup(struct service_info *s);
+extern void history_setup(struct service_info *s);
+extern void httpd_setup(struct service_info *s);
+
+/*
+ * A read-only copy of the weather data, shared by all of the
+ * services that it's queued for. data is metric, view[] has the
+ * same data in the units asked for when it was created, with
+ * view[UNITS_METRIC] being data.
+ */
+struct wd_snapshot {
+	int refs;
+	weather_data_t *data;
+	weather_data_t *view[UNITS_VIEWS];
+};
+
+/*
+ * Resolved addresses from the host name cache (wfp-dns.c)
+ */
+#define DNS_MAX_ADDRS 4
+
+struct dns_addr {
+	struct sockaddr_storage sa;
+	socklen_t len;
+};
+
+struct dns_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long refreshes;
+	unsigned long failures;
+	int entries;
+};
+
+/* wfp-send.c */
+extern int send_start(struct service_info *sinfo);
+extern void send_stop(struct service_info *sinfo);
+extern void send_to(struct service_info *sinfo, struct wd_snapshot *snap);
+extern struct wd_snapshot *snapshot_create(weather_data_t *wd,
+		unsigned int views);
+extern struct wd_snapshot *snapshot_hold(struct wd_snapshot *snap);
+extern void snapshot_put(struct wd_snapshot *snap);
+extern void send_stats(struct service_info *sinfo, struct send_stats *st);
+
+/* wfp-change.c */
+struct change_state;
+extern struct change_state *change_create(struct cfg_info *cfg);
+extern void change_free(struct change_state *cs);
+extern uint64_t change_detect(struct change_state *cs,
+		const weather_data_t *wd);
+extern void change_commit(struct change_state *cs);
+
+/* wfp-fields.c */
+extern const struct wd_field_info wd_fields[WD_VALUES];
+extern int wd_field_lookup(const char *name);
+extern const char *wd_unit_label(enum wd_unit unit, int imperial);
+
+/* wfp-format.c */
+extern int fmt_double(char *buf, int size, double v, int prec);
+extern int fmt_field(char *buf, int size, const struct cfg_info *cfg,
+		const weather_data_t *wd, enum wd_field f);
+extern int fmt_param(char *buf, int size, const char *name,
+		const struct cfg_info *cfg, const weather_data_t *wd, enum wd_field f);
+extern void format_config(struct cfg_info *cfg);
+
+/* wfp-dns.c */
+extern int dns_start(int ttl);
+extern void dns_stop(void);
+extern int dns_lookup(const char *host, int port, struct dns_addr *addr,
+		int max);
+extern void dns_prefetch(const char *host);
+extern void dns_stats(struct dns_stats *st);
+
+/* wfp-spool.c */
+struct spool;
+extern struct spool *spool_open(const char *service);
+extern void spool_close(struct spool *sp);
+extern int spool_append(struct spool *sp, weather_data_t *wd);
+extern int spool_peek(struct spool *sp, weather_data_t *wd);
+extern void spool_commit(struct spool *sp);
+extern int spool_count(struct spool *sp);
+extern void spool_stats(struct spool *sp, struct send_stats *st);
+extern void spool_config(const char *dir, int sync, int max, int age);
+
+/* wfp-history.c */
+extern int history_query(const char *field, time_t from, time_t to, int step,
+		struct hist_point *out, int max);
+
+/* wfp-sched.c */
+extern void sched_add(struct service_info *s);
+extern void sched_tick(time_t now);
+
+/* wfp-aggregate.c */
+extern void aggregate_add(struct service_info *s, struct wd_snapshot *snap);
+extern void aggregate_send(struct service_info *s);
+extern void aggregate_free(struct service_info *s);
+
+/* wfp-log.c */
+extern void log_tick(time_t now);
+extern void log_reopen(void);
+
+/* wfp-event.c */
+typedef void (*event_cb)(int fd, void *arg);
+extern int event_init(void);
+extern int event_add(int fd, event_cb cb, void *arg);
+extern int event_timer(int msec, event_cb cb, void *arg);
+extern int event_signal(int signo, event_cb cb, void *arg);
+extern void event_remove(int fd);
+extern void event_run(void);
+extern void event_stop(void);
+extern void event_cleanup(void);
+
+/* wfp-http.c */
+struct http_conn;
+extern struct http_conn *http_open(const char *host, int port);
+extern int http_get(struct http_conn *c, const char *path, const char *agent);
+extern void http_close(struct http_conn *c);
+extern int tcp_connect(const char *host, int port, int timeout);
+
+/* wfp-parse.c */
+extern int wf_packet_scan(const char *msg, int len, struct wf_packet *pkt);
 
 /* wfp-utils.c */
+extern int cfg_int(struct cfg_info *cfg, const char *name, int def);
+extern const char *cfg_string(struct cfg_info *cfg, const char *name,
+		const char *def);
 extern double calc_heatindex(double, double);
 extern double calc_dewpoint(double, double);
 extern double calc_windchill(double, double);
 extern double mb2in(double mb);
 extern double MS2MPH(double ms);
+extern double km2miles(double km);
 extern double TempF(double tempc);
 extern char *DegreesToCardinal(double deg);
 extern double station_2_sealevel(double, double);
-extern int calc_pressure_trend(double);
-extern void free_trend(void);
+extern void calc_pressure_trend(weather_data_t *wd);
+extern const char *tendency_name(int code);
 extern double calc_feelslike(double, double, double);
 extern char *time_stamp(int gmt, int mode);
+extern char *time_stamp_at(time_t t, int gmt, int mode);
+extern uint32_t checksum(const void *data, size_t len);
 #define CONVERT_ALL 0x00
 #define NO_PRESSURE 0x01
 extern void unit_convert(weather_data_t *wd, unsigned int skip);
@@ -51,26 +51,37 @@
 #include <time.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include "wfp.h"
 #include "cJSON.h"
 
 #define GUST_INTERVAL 30 /* Seconds for gust tracking */
 
-static int wf_message_parse(char *msg);
-static void wfp_air_parse(cJSON *air);
-static void wfp_sky_parse(cJSON *sky);
-static void wfp_wind_parse(cJSON *wind);
-static void wfp_tower_parse(cJSON *tower);
+static int wf_message_parse(char *msg, int len, time_t arrival);
+static int wf_unknown_parse(char *msg);
+static void wfp_air_parse(const struct wf_packet *air);
+static void wfp_sky_parse(const struct wf_packet *sky, time_t arrival);
+static void wfp_wind_parse(const struct wf_packet *wind);
+static void wfp_tower_parse(const struct wf_packet *tower);
 static void read_config(void);
-static void *publish(void *args);
+static void publish(void);
+static void udp_receive(int sock, void *arg);
+static void shutdown_event(int fd, void *arg);
+static void reopen_event(int fd, void *arg);
+static void service_timers(int fd, void *arg);
 static void initialize_publishers(void);
 static void cleanup_publishers(void);
-static void read_rainfall(void);
 static void sinfo_free(struct service_info *info);
+static void queue_report(void);
+static void publish_event(const struct wf_packet *pkt);
+static time_t packet_time(struct msghdr *msg);
 
-extern void send_to(struct service_info *sinfo, weather_data_t *wd);
 extern void rainfall(double amount);
-extern void accumulate_rain(weather_data_t *wd, double rain);
+extern void accumulate_rain(weather_data_t *wd, double rain, time_t t);
+extern void rainfall_load(weather_data_t *wd);
+extern void rainfall_flush(time_t now, int force);
+extern void rainfall_config(int flush);
 extern int mqtt_init(void);
 extern void mqtt_disconnect(void);
 
@@ -83,25 +94,43 @@ struct service_info *sinfo = NULL;
 struct station_info station;
 cJSON *sensor_mapping = NULL;
 
-static pthread_mutex_t data_event_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  data_event_trigger = PTHREAD_COND_INITIALIZER;
-
 #define AIRDATA 0x01
 #define SKYDATA 0x02
 
+/*
+ * UDP packets are read in batches with recvmmsg(). Each packet is
+ * stamped by the kernel when it arrives so that a backlog of
+ * packets is still processed with the time it was received.
+ */
+#define PACKET_SIZE 1024
+#define RECV_BATCH_MAX 64
+#define RECV_CONTROL_SIZE (CMSG_SPACE(sizeof(struct timespec)) + \
+		CMSG_SPACE(sizeof(uint32_t)))
+
+static int recv_batch = 16;		/* packets per recvmmsg() call */
+static int recv_buffer = 0;		/* SO_RCVBUF size, 0 for system default */
+static int dns_ttl = 0;			/* host name cache time, 0 for default */
+static char *spool_dir = NULL;	/* where failed sends are kept */
+static int spool_sync = 0;		/* seconds between syncs, 0 every record */
+static int spool_max = 0;		/* records per service, 0 for default */
+static int spool_age = 0;		/* discard records older than this */
+
+static unsigned long rx_packets = 0;	/* packets received */
+static unsigned long rx_calls = 0;		/* recvmmsg() calls */
+static unsigned long rx_dropped = 0;	/* packets dropped by the kernel */
+
+static int data_ready = 0;		/* AIRDATA/SKYDATA seen this cycle */
+static unsigned int snapshot_views = 0;	/* units the services want */
+static struct tm day_start;		/* for resetting the daily high/low */
+
 int main (int argc, char **argv)
 {
-	char line[1024];
 	int i;
-	int bytes;
-	pthread_t send_thread;
 	int sock;
 	struct sockaddr_in s;
 	int optval;
-	int st = 0;
+	socklen_t optlen;
 	time_t t = time(NULL);
-	struct tm now;
-	struct tm start;
 
 	/* process command line arguments */
 	if (argc > 1) {
@@ -117,14 +146,15 @@ int main (int argc, char **argv)
 						 * *   want to have different debug levels though
 						 * */
 						verbose = 1;
-						if (strcmp(argv[i], "vv") == 0)
+						if (strcmp(argv[i], "-vv") == 0)
 							verbose = 2;
-						if (strcmp(argv[i], "vvv") == 0)
+						if (strcmp(argv[i], "-vvv") == 0)
 							verbose = 3;
 						break;
 					default:
-						printf("usage: %s [-d]\n", argv[0]);
+						printf("usage: %s [-d] [-v|-vv|-vvv]\n", argv[0]);
 						printf("        -v verbose output\n");
+						printf("        -vv also show the send queues\n");
 						printf("        -d turns on debugging\n");
 						printf("\n");
 
@@ -135,33 +165,55 @@ int main (int argc, char **argv)
 		}
 	}
 
-	localtime_r(&t, &start);
+	localtime_r(&t, &day_start);
 	memset(&wd, 0, sizeof(weather_data_t));
 	wd.temperature_high = -100;
 	wd.temperature_low = 150;
 
 	read_config();
-	read_rainfall();
-
-	initialize_publishers();
+	rainfall_load(&wd);
 
 	/*
-	 * Start a thread to publish the data. The thread will wake up
-	 * and start new threads to send the data to each of the enabled
-	 * services.
+	 * Signals are handled by the event loop, they need to be
+	 * blocked before the service worker threads are started.
 	 */
-	pthread_create(&send_thread, NULL, publish, NULL);
+	if (event_init())
+		exit(1);
+	event_signal(SIGINT, shutdown_event, NULL);
+	event_signal(SIGTERM, shutdown_event, NULL);
+	event_signal(SIGHUP, reopen_event, NULL);
+
+	dns_start(dns_ttl);
+	spool_config(spool_dir, spool_sync, spool_max, spool_age);
+	initialize_publishers();
 
 	/*
-	 * The main loop will just wait for UDP packets on port
-	 * 50222. Each packet is parsed and the data stored, overwriting
-	 * any previous value.
+	 * The main loop waits for UDP packets on port 50222. Each
+	 * packet is parsed and the data stored, overwriting any
+	 * previous value. When a full set of data is ready, it's
+	 * queued for each of the enabled services.
 	 */
-	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
 	optval = 1;
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
 		(const void *)&optval , sizeof(int));
+	setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS,
+		(const void *)&optval , sizeof(int));
+	setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL,
+		(const void *)&optval , sizeof(int));
 
+	if (recv_buffer > 0) {
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+			(const void *)&recv_buffer , sizeof(int));
+		optlen = sizeof(int);
+		if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &optval, &optlen) == 0)
+			printf("UDP receive buffer is %d bytes\n", optval);
+	}
+
+	if (recv_batch < 1)
+		recv_batch = 1;
+	else if (recv_batch > RECV_BATCH_MAX)
+		recv_batch = RECV_BATCH_MAX;
 
 	memset(&s, 0, sizeof(struct sockaddr_in));
 	s.sin_family = AF_INET;
@@ -170,38 +222,22 @@ int main (int argc, char **argv)
 
 	bind(sock, (struct sockaddr *)&s, sizeof(s));
 
-	while ((bytes = read(sock, line, 1024)) > 0) {
-		t = time(NULL);
-		localtime_r(&t, &now);
-		if (now.tm_mday != start.tm_mday) {
-			wd.temperature_high = -100;
-			wd.temperature_low = 150;
-			localtime_r(&t, &start);
-		}
+	event_add(sock, udp_receive, NULL);
+	event_timer(1000, service_timers, NULL);
 
-		line[bytes] = '\0';
-		st |= wf_message_parse(line);
-		//printf("recv: %s\n", line);
-
-		/* If we have data to publish */
-		if (st == (AIRDATA | SKYDATA)) {
-			pthread_mutex_lock(&data_event_mutex);
-			pthread_cond_signal(&data_event_trigger);
-			pthread_mutex_unlock(&data_event_mutex);
-			st = 0;
-		}
-	}
+	event_run();
 
 	close(sock);
-	pthread_cancel(send_thread);
+	rainfall_flush(time(NULL), 1);
 	cleanup_publishers();
+	dns_stop();
+	event_cleanup();
 	cJSON_Delete(sensor_mapping);
 	sinfo_free(sinfo);
 	free(station.name);
 	free(station.location);
 	free(station.latitude);
 	free(station.longitude);
-	free_trend();
 
 	free(wd.timestamp);
 	while (wd.tower_list) {
@@ -218,105 +254,288 @@ int main (int argc, char **argv)
 	exit(0);
 }
 
-static int wf_message_parse(char *msg) {
-	cJSON *msg_json;
-	const cJSON *type = NULL;
-	int ret = 0;
+/*
+ * Handle a packet. Called with the kernel's receive time for the
+ * packet.
+ */
+static void ingest(char *line, int bytes, time_t t)
+{
+	struct tm now;
 
-	msg_json = cJSON_Parse(msg);
-	if (msg == NULL) {
-		const char *error_ptr = cJSON_GetErrorPtr();
-		if (error_ptr != NULL) {
-			fprintf(stderr, "Error before: %s\n", error_ptr);
+	localtime_r(&t, &now);
+	if (now.tm_mday != day_start.tm_mday) {
+		wd.temperature_high = -100;
+		wd.temperature_low = 150;
+		localtime_r(&t, &day_start);
+	}
+
+	data_ready |= wf_message_parse(line, bytes, t);
+	//printf("recv: %s\n", line);
+
+	/* If we have data to publish */
+	if (data_ready == (AIRDATA | SKYDATA)) {
+		publish();
+		data_ready = 0;
+	}
+}
+
+/*
+ * The UDP socket is readable. Drain it in batches with recvmmsg(),
+ * but give up after a few batches so a flood of packets can't
+ * starve the timers.
+ */
+static void udp_receive(int sock, void *arg)
+{
+	static char line[RECV_BATCH_MAX][PACKET_SIZE + 1];
+	static char control[RECV_BATCH_MAX][RECV_CONTROL_SIZE];
+	static struct mmsghdr msgs[RECV_BATCH_MAX];
+	static struct iovec iov[RECV_BATCH_MAX];
+	int batches;
+	int bytes;
+	int n;
+	int i;
+
+	for (batches = 0; batches < 4; batches++) {
+		for (i = 0; i < recv_batch; i++) {
+			iov[i].iov_base = line[i];
+			iov[i].iov_len = PACKET_SIZE;
+			memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = control[i];
+			msgs[i].msg_hdr.msg_controllen = RECV_CONTROL_SIZE;
 		}
-		goto end;
+
+		n = recvmmsg(sock, msgs, recv_batch, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				fprintf(stderr, "Failed to read UDP packets: %s\n",
+						strerror(errno));
+			return;
+		}
+		rx_calls++;
+
+		for (i = 0; i < n; i++) {
+			bytes = msgs[i].msg_len;
+			line[i][bytes] = '\0';
+			rx_packets++;
+			ingest(line[i], bytes, packet_time(&msgs[i].msg_hdr));
+		}
+
+		/* A short batch means the socket is empty */
+		if (n < recv_batch)
+			return;
 	}
+}
 
-	type = cJSON_GetObjectItemCaseSensitive(msg_json, "type");
-	if (cJSON_IsString(type) && (type->valuestring != NULL)) {
-		if (strcmp(type->valuestring, "obs_air") == 0) {
+static void shutdown_event(int fd, void *arg)
+{
+	printf("Shutting down.\n");
+	event_stop();
+}
+
+/*
+ * SIGHUP, reopen the log file.
+ */
+static void reopen_event(int fd, void *arg)
+{
+	log_reopen();
+}
+
+/*
+ * Once a second housekeeping. Send to any services that are due,
+ * save the rain totals if they've changed, write out buffered log
+ * lines and report any service that has been stuck on one send for
+ * longer than its timeout.
+ */
+static void service_timers(int fd, void *arg)
+{
+	struct service_info *sitr;
+	struct send_stats st;
+	char *ts;
+
+	sched_tick(time(NULL));
+	rainfall_flush(time(NULL), 0);
+	log_tick(time(NULL));
+
+	for (sitr = sinfo; sitr != NULL; sitr = sitr->next) {
+		if (!sitr->queue || (sitr->timeout <= 0))
+			continue;
+
+		/* Once per stuck send, the timer can run late and skip a second */
+		send_stats(sitr, &st);
+		if (st.busy < sitr->timeout) {
+			sitr->stuck = 0;
+		} else if (!sitr->stuck) {
+			sitr->stuck = 1;
+			ts = time_stamp(0, 1);
+			fprintf(stderr, "%s: %s has been sending for %d seconds, "
+					"%d samples waiting\n",
+					ts, sitr->service, st.busy, st.depth);
+			free(ts);
+		}
+	}
+}
+
+/*
+ * Get the kernel's receive time for a packet, and pick up the
+ * count of packets the kernel had to drop because our receive
+ * buffer was full.
+ */
+static time_t packet_time(struct msghdr *msg)
+{
+	static uint32_t last_drops = 0;
+	struct cmsghdr *cmsg;
+	struct timespec ts;
+	uint32_t drops;
+
+	ts.tv_sec = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(struct timespec));
+		} else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+			rx_dropped += (uint32_t)(drops - last_drops);
+			last_drops = drops;
+		}
+	}
+
+	if (ts.tv_sec == 0)
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ts.tv_sec;
+}
+
+static int wf_message_parse(char *msg, int len, time_t arrival) {
+	struct wf_packet pkt;
+	int ret = 0;
+
+	/*
+	 * The known packet types are decoded in place without building
+	 * a JSON tree. Anything else falls back to cJSON.
+	 */
+	if (wf_packet_scan(msg, len, &pkt) || (pkt.type == WF_UNKNOWN))
+		return wf_unknown_parse(msg);
+
+	switch (pkt.type) {
+		case WF_OBS_AIR:
 			if (verbose) printf("-> Air packet\n");
-			wfp_air_parse(msg_json);
+			wfp_air_parse(&pkt);
 			ret = AIRDATA;
-		} else if (strcmp(type->valuestring, "obs_sky") == 0) {
+			break;
+		case WF_OBS_SKY:
 			if (verbose) printf("-> Sky packet\n");
-			wfp_sky_parse(msg_json);
+			wfp_sky_parse(&pkt, arrival);
 			ret = SKYDATA;
-		} else if (strcmp(type->valuestring, "rapid_wind") == 0) {
+			break;
+		case WF_RAPID_WIND:
 			if (verbose) printf("-> Rapid Wind packet\n");
-			wfp_wind_parse(msg_json);
-		} else if (strcmp(type->valuestring, "evt_strike") == 0) {
+			wfp_wind_parse(&pkt);
+			publish_event(&pkt);
+			break;
+		case WF_EVT_STRIKE:
 			if (verbose) printf("-> Lightning strike packet\n");
-		} else if (strcmp(type->valuestring, "evt_precip") == 0) {
+			publish_event(&pkt);
+			break;
+		case WF_EVT_PRECIP:
 			if (verbose) printf("-> Rain start packet\n");
-		} else if (strcmp(type->valuestring, "device_status") == 0) {
+			publish_event(&pkt);
+			break;
+		case WF_DEVICE_STATUS:
 			if (verbose) printf("-> Device status packet\n");
-		} else if (strcmp(type->valuestring, "hub_status") == 0) {
+			break;
+		case WF_HUB_STATUS:
 			if (verbose) printf("-> Hub status packet\n");
-		} else if (strcmp(type->valuestring, "obs_tower") == 0) {
+			break;
+		case WF_OBS_TOWER:
 			if (verbose) printf("-> Tower packet\n");
-			wfp_tower_parse(msg_json);
-		} else {
-			if (verbose) printf("-> Unknown packet type: %s\n", type->valuestring);
-			printf("-> Unknown packet type: %s\n", type->valuestring);
-		}
-
-		//printf("%s\n", cJSON_Print(msg_json));
+			wfp_tower_parse(&pkt);
+			break;
+		default:
+			break;
 	}
 
-end:
-	cJSON_Delete(msg_json);
 	return ret;
 }
 
-#define SETWD(j, w, v) { \
-	tmp = cJSON_GetArrayItem(j, v); \
-	w = tmp->valuedouble; \
-	}
+/*
+ * Packets that the scanner doesn't know about (or can't make sense
+ * of) get a full JSON parse so we can at least report what they are.
+ */
+static int wf_unknown_parse(char *msg) {
+	cJSON *msg_json;
+	const cJSON *type = NULL;
 
-#define SETWI(j, w, v) { \
-	tmp = cJSON_GetArrayItem(j, v); \
-	w = tmp->valueint; \
+	msg_json = cJSON_Parse(msg);
+	if (msg_json == NULL) {
+		const char *error_ptr = cJSON_GetErrorPtr();
+		if (error_ptr != NULL) {
+			fprintf(stderr, "Error before: %s\n", error_ptr);
+		}
+		return 0;
 	}
 
-static void wfp_air_parse(cJSON *air) {
-	cJSON *obs;
-	cJSON *ob;
-	cJSON *tmp;
+	type = cJSON_GetObjectItemCaseSensitive(msg_json, "type");
+	if (cJSON_IsString(type) && (type->valuestring != NULL))
+		printf("-> Unknown packet type: %s\n", type->valuestring);
+	else
+		printf("-> Unrecognized packet: %s\n", msg);
+
+	cJSON_Delete(msg_json);
+	return 0;
+}
+
+/*
+ * Format an observation time as the last update time stamp.
+ */
+static void set_timestamp(char **ts, double epoch)
+{
+	time_t t = (time_t)epoch;
+	struct tm lt;
+
+	localtime_r(&t, &lt);
+	if (*ts == NULL)
+		*ts = (char *)malloc(25);
+	strftime(*ts, 25, "%Y-%m-%d %H:%M:%S", &lt);
+}
+
+static void wfp_air_parse(const struct wf_packet *air) {
+	const double *ob;
 	int i;
-	struct tm *lt;
 
-	if (debug) {
-		tmp = cJSON_GetObjectItemCaseSensitive(air, "serial_number");
-		printf("AIR data serial number: %s\n", tmp->valuestring);
-	}
+	if (debug)
+		printf("AIR data serial number: %s\n", air->serial_number);
 
 	/* this is a 2 dimensional array [[v,v,v,v,v,v,v]] */
-	obs = cJSON_GetObjectItemCaseSensitive(air, "obs");
-	for (i = 0 ; i < cJSON_GetArraySize(obs) ; i++) {
-		ob = cJSON_GetArrayItem(obs, i);
+	for (i = 0 ; i < air->rows ; i++) {
+		ob = air->obs[i];
+		if (air->cols[i] < 6) {
+			fprintf(stderr, "Short AIR observation (%d values)\n",
+					air->cols[i]);
+			continue;
+		}
 
 		/* First item is a timestamp, lets use it for last update */
-		tmp = cJSON_GetArrayItem(ob, 0);
-		lt = localtime((long *)&tmp->valueint);
-		if (wd.timestamp == NULL)
-			wd.timestamp = (char *)malloc(25);
-		sprintf(wd.timestamp, "%4d-%02d-%02d %02d:%02d:%02d",
-				lt->tm_year + 1900, lt->tm_mon + 1, lt->tm_mday,
-				lt->tm_hour, lt->tm_min, lt->tm_sec);
-
-		SETWD(ob, wd.pressure, 1);		// millibars
-		SETWD(ob, wd.temperature, 2)	// Celsius
-		SETWD(ob, wd.humidity, 3)		// percent
-		SETWI(ob, wd.strikes, 4)		// count
-		SETWD(ob, wd.distance, 5)		// kilometers
+		set_timestamp(&wd.timestamp, ob[0]);
+		wd.time = (time_t)ob[0];
+
+		wd.pressure = ob[1];		// millibars
+		wd.temperature = ob[2];		// Celsius
+		wd.humidity = ob[3];		// percent
+		wd.strikes = (int)ob[4];	// count
+		wd.distance = ob[5];		// kilometers
 
 		/* derrived values */
 		wd.pressure_sealevel = station_2_sealevel(wd.pressure,
 				(station.elevation * .3048));
 		wd.dewpoint = calc_dewpoint(wd.temperature, wd.humidity);	// farhenhi
 		wd.heatindex = calc_heatindex(wd.temperature, wd.humidity);// Celsius
-		wd.trend = calc_pressure_trend(wd.pressure);
+		calc_pressure_trend(&wd);
 		if (wd.temperature > wd.temperature_high)
 			wd.temperature_high = wd.temperature;
 		if (wd.temperature < wd.temperature_low)
@@ -324,30 +543,28 @@ static void wfp_air_parse(cJSON *air) {
 	}
 }
 
-static void wfp_sky_parse(cJSON *sky) {
-	cJSON *obs;
-	cJSON *ob;
-	cJSON *tmp;
+static void wfp_sky_parse(const struct wf_packet *sky, time_t arrival) {
+	const double *ob;
 	int i;
 
-	if (debug) {
-		tmp = cJSON_GetObjectItemCaseSensitive(sky, "serial_number");
-		printf("SKY data serial number: %s\n", tmp->valuestring);
-	}
+	if (debug)
+		printf("SKY data serial number: %s\n", sky->serial_number);
 
 	/* this is a 2 dimensional array [[v,v,v,v,v,v,v]] */
-	obs = cJSON_GetObjectItemCaseSensitive(sky, "obs");
-	for (i = 0 ; i < cJSON_GetArraySize(obs) ; i++) {
-		ob = cJSON_GetArrayItem(obs, i);
-
-		tmp = cJSON_GetArrayItem(ob, 0);
+	for (i = 0 ; i < sky->rows ; i++) {
+		ob = sky->obs[i];
+		if (sky->cols[i] < 11) {
+			fprintf(stderr, "Short SKY observation (%d values)\n",
+					sky->cols[i]);
+			continue;
+		}
 
-		SETWD(ob, wd.illumination, 1);
-		SETWI(ob, wd.uv, 2);
-		SETWD(ob, wd.rain, 3);     // over reporting interval
-		SETWD(ob, wd.windspeed, 5); // m/s
-		SETWD(ob, wd.winddirection, 7);
-		SETWD(ob, wd.solar, 10);
+		wd.illumination = ob[1];
+		wd.uv = (int)ob[2];
+		wd.rain = ob[3];			// over reporting interval
+		wd.windspeed = ob[5];		// m/s
+		wd.winddirection = ob[7];
+		wd.solar = ob[10];
 
 
 		/* derrived values */
@@ -357,20 +574,19 @@ static void wfp_sky_parse(cJSON *sky) {
 
 		/* Track maximum gust over 10 intervals */
 		if (interval == GUST_INTERVAL) {
-			SETWD(ob, wd.gustspeed, 6); // m/s
+			wd.gustspeed = ob[6];	// m/s
 			wd.gustdirection = wd.winddirection;
 			interval = 0;
 		} else {
-			tmp = cJSON_GetArrayItem(ob, 6);
-			if (tmp->valuedouble > wd.gustspeed) {
-				wd.gustspeed = tmp->valuedouble;
+			if (ob[6] > wd.gustspeed) {
+				wd.gustspeed = ob[6];
 				wd.gustdirection = wd.winddirection;
 			}
 			interval++;
 		}
 
 		/* Track rainfall over time */
-		accumulate_rain(&wd, wd.rain);
+		accumulate_rain(&wd, wd.rain, arrival);
 
 	}
 }
@@ -379,47 +595,43 @@ static void wfp_sky_parse(cJSON *sky) {
  * parse the rapid wind messages.  Use these to
  * update the gust information.
  */
-static void wfp_wind_parse(cJSON *wind) {
-	cJSON *obs;
-	cJSON *ob;
+static void wfp_wind_parse(const struct wf_packet *wind) {
+	const double *ob = wind->obs[0];
 	int direction;
 
 	/* this is a 1 dimensional array [v,v,v,v,v,v,v] */
 	/* ob":[1493322445,2.3,128] */
-	obs = cJSON_GetObjectItemCaseSensitive(wind, "ob");
+	if ((wind->rows < 1) || (wind->cols[0] < 3))
+		return;
 
-	ob = cJSON_GetArrayItem(obs, 2); /* wind direction */
-	direction = ob->valueint;
+	direction = (int)ob[2]; /* wind direction */
 
-	ob = cJSON_GetArrayItem(obs, 1); /* wind speed */
+	/* ob[1] is wind speed */
 	if (interval == GUST_INTERVAL) {
-		wd.gustspeed = ob->valuedouble;
+		wd.gustspeed = ob[1];
 		wd.gustdirection = direction;
 		interval = 0;
 	} else {
-		if (ob->valuedouble > wd.gustspeed) {
-			wd.gustspeed = ob->valuedouble;
+		if (ob[1] > wd.gustspeed) {
+			wd.gustspeed = ob[1];
 			wd.gustdirection = direction;
 		}
 	}
 }
 
-static void wfp_tower_parse(cJSON *tower) {
-	cJSON *obs;
-	cJSON *ob;
+static void wfp_tower_parse(const struct wf_packet *tower) {
+	const double *ob;
 	cJSON *tmp;
 	cJSON *cfg;
 	int i;
-	struct tm *lt;
 	struct sensor_list *list;
 
-	tmp = cJSON_GetObjectItemCaseSensitive(tower, "serial_number");
 	if (debug)
-		printf("Tower data serial number: %s\n", tmp->valuestring);
+		printf("Tower data serial number: %s\n", tower->serial_number);
 
 	list = wd.tower_list;
 	while(list) {
-		if (strcmp(list->sensor->sensor_id, tmp->valuestring) == 0)
+		if (strcmp(list->sensor->sensor_id, tower->serial_number) == 0)
 			break;
 		list = list->next;
 	}
@@ -432,7 +644,7 @@ static void wfp_tower_parse(cJSON *tower) {
 		}
 		list->sensor = (struct sensor_data *)malloc(sizeof(struct sensor_data));
 		memset (list->sensor, 0, sizeof(struct sensor_data));
-		list->sensor->sensor_id = strdup(tmp->valuestring);
+		list->sensor->sensor_id = strdup(tower->serial_number);
 		list->sensor->temperature_high = -100;
 		list->sensor->temperature_low = 100;
 		list->next = NULL;
@@ -456,21 +668,19 @@ static void wfp_tower_parse(cJSON *tower) {
 		wd.tower_list = list;
 	}
 
-	obs = cJSON_GetObjectItemCaseSensitive(tower, "obs");
-	for (i = 0 ; i < cJSON_GetArraySize(obs) ; i++) {
-		ob = cJSON_GetArrayItem(obs, i);
+	for (i = 0 ; i < tower->rows ; i++) {
+		ob = tower->obs[i];
+		if (tower->cols[i] < 4) {
+			fprintf(stderr, "Short tower observation (%d values)\n",
+					tower->cols[i]);
+			continue;
+		}
 
 		/* First item is a timestamp, lets use it for last update */
-		tmp = cJSON_GetArrayItem(ob, 0);
-		lt = localtime((long *)&tmp->valueint);
-		if (list->sensor->timestamp == NULL)
-			list->sensor->timestamp = (char *)malloc(25);
-		sprintf(list->sensor->timestamp, "%4d-%02d-%02d %02d:%02d:%02d",
-				lt->tm_year + 1900, lt->tm_mon + 1, lt->tm_mday,
-				lt->tm_hour, lt->tm_min, lt->tm_sec);
+		set_timestamp(&list->sensor->timestamp, ob[0]);
 
-		SETWD(ob, list->sensor->temperature, 2)	// Celsius
-		SETWD(ob, list->sensor->humidity, 3)		// percent
+		list->sensor->temperature = ob[2];	// Celsius
+		list->sensor->humidity = ob[3];		// percent
 
 		if (list->sensor->temperature > list->sensor->temperature_high)
 			list->sensor->temperature_high = list->sensor->temperature;
@@ -504,6 +714,10 @@ static void service_setup(struct service_info *s)
 		mysql_setup(s);
 	else if (strcmp(s->service, "Display") == 0)
 		display_setup(s);
+	else if (strcmp(s->service, "history") == 0)
+		history_setup(s);
+	else if (strcmp(s->service, "httpd") == 0)
+		httpd_setup(s);
 	else
 		printf("Unknown publishing service %s\n", s->service);
 }
@@ -544,6 +758,22 @@ static void read_config(void) {
 			station.longitude = strdup(type->valuestring);
 		if ((type = cJSON_GetObjectItemCaseSensitive(cfg_json, "elevation")))
 			station.elevation = type->valueint;
+		if ((type = cJSON_GetObjectItemCaseSensitive(cfg_json, "receive_buffer")))
+			recv_buffer = type->valueint;
+		if ((type = cJSON_GetObjectItemCaseSensitive(cfg_json, "receive_batch")))
+			recv_batch = type->valueint;
+		if ((type = cJSON_GetObjectItemCaseSensitive(cfg_json, "dns_ttl")))
+			dns_ttl = type->valueint;
+		if ((type = cJSON_GetObjectItemCaseSensitive(cfg_json, "rain_flush")))
+			rainfall_config(type->valueint);
+		if ((type = cJSON_GetObjectItemCaseSensitive(cfg_json, "spool_dir")))
+			spool_dir = strdup(type->valuestring);
+		if ((type = cJSON_GetObjectItemCaseSensitive(cfg_json, "spool_sync")))
+			spool_sync = type->valueint;
+		if ((type = cJSON_GetObjectItemCaseSensitive(cfg_json, "spool_max")))
+			spool_max = type->valueint;
+		if ((type = cJSON_GetObjectItemCaseSensitive(cfg_json, "spool_age")))
+			spool_age = type->valueint;
 
 		services = cJSON_GetObjectItemCaseSensitive(cfg_json, "services");
 		for (i = 0 ; i < cJSON_GetArraySize(services) ; i++) {
@@ -552,6 +782,7 @@ static void read_config(void) {
 			s = malloc(sizeof(struct service_info));
 			memset(s, 0, sizeof(struct service_info));
 			s->cfg.metric = 0;
+			s->cfg.options = cJSON_Duplicate(cfg, 1);
 
 			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "service")))
 				s->service = strdup(type->valuestring);
@@ -570,10 +801,51 @@ static void read_config(void) {
 
 			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "metric")))
 				s->cfg.metric = type->valueint;
+			format_config(&s->cfg);
 
 			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "enabled")))
 				s->enabled = type->valueint;
 
+			s->interval = -1;
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "interval")))
+				s->interval = type->valueint;
+
+			s->align = -1;
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "align")))
+				s->align = type->valueint;
+
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "window")))
+				s->window = type->valueint;
+
+			s->timeout = 120;
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "timeout")))
+				s->timeout = type->valueint;
+
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "queue_depth")))
+				s->queue_depth = type->valueint;
+
+			s->spool = -1;
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "spool")))
+				s->spool = type->valueint;
+
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "replay_interval")))
+				s->replay_interval = type->valueint;
+
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "skip_unchanged")))
+				s->skip_unchanged = type->valueint;
+
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "max_skip")))
+				s->max_skip = type->valueint;
+
+			if ((type = cJSON_GetObjectItemCaseSensitive(cfg, "overflow"))) {
+				if (strcmp(type->valuestring, "coalesce") == 0)
+					s->overflow = QUEUE_COALESCE;
+				else if (strcmp(type->valuestring, "block") == 0)
+					s->overflow = QUEUE_BLOCK;
+				else
+					s->overflow = QUEUE_DROP_OLDEST;
+			}
+
 			if (station.name)
 				s->station.name = strdup(station.name);
 			if (station.location)
@@ -597,8 +869,23 @@ static void read_config(void) {
 			 * we then need to have a bunch of .so files sitting around
 			 * with the executable for it to functon properly.
 			 */
+			s->units = s->cfg.metric ? UNITS_METRIC : UNITS_IMPERIAL;
 			service_setup(s);
 
+			/* Use the service's defaults if not configured */
+			if (s->interval < 0)
+				s->interval = 0;
+			if (s->align < 0)
+				s->align = 0;
+			if ((s->window <= 0) && (s->interval > 0))
+				s->window = s->interval;
+			if (s->spool < 0)
+				s->spool = 0;
+			if (s->replay_interval <= 0)
+				s->replay_interval = 10;
+			if (s->max_skip <= 0)
+				s->max_skip = 900;
+
 			s->next = sinfo;
 			sinfo = s;
 		}
@@ -632,6 +919,7 @@ static void sinfo_free(struct service_info *info)
 		free(list->cfg.name);
 		free(list->cfg.pass);
 		free(list->cfg.extra);
+		cJSON_Delete(list->cfg.options);
 		free(list->station.name);
 		free(list->station.location);
 		free(list->station.latitude);
@@ -640,96 +928,11 @@ static void sinfo_free(struct service_info *info)
 	}
 }
 
-/*
- * Read the saved rainfall data and update the data structure
- */
-static void read_rainfall(void) {
-	FILE *fp;
-	char *json;
-	int len;
-	cJSON *rain_json;
-	cJSON *saved_at;
-	cJSON *tmp;
-	time_t t = time(NULL);
-	struct tm gt;
-
-	localtime_r(&t, &gt);
-
-	printf("Reading rainfall file.\n");
-	json = malloc(4096);
-	fp = fopen("rainfall.json", "r");
-	len = fread(json, 1, 4096, fp);
-	fclose (fp);
-
-	json[len] = '\0';
-
-	if (len > 0) {
-		rain_json = cJSON_Parse(json);
-		saved_at = cJSON_GetObjectItemCaseSensitive(rain_json, "time");
-		tmp = cJSON_GetObjectItemCaseSensitive(saved_at, "year");
-		if (tmp) {
-			if (tmp->valueint != gt.tm_year + 1900) {
-				/* Year doesn't match so skip everything */
-				fprintf(stderr, "Skipping rain, year doesn't match\n");
-				free(json);
-				return;
-			}
-		}
-
-		/* Set saved yearly value */
-		tmp = cJSON_GetObjectItemCaseSensitive(rain_json, "rain_current_year");
-		wd.rainfall_year = tmp->valuedouble;
-
-		tmp = cJSON_GetObjectItemCaseSensitive(saved_at, "month");
-		if (tmp) {
-			if (tmp->valueint == gt.tm_mon + 1) {
-				tmp = cJSON_GetObjectItemCaseSensitive(rain_json,
-						"rain_current_month");
-				wd.rainfall_month = tmp->valuedouble;
-			} else {
-				/* month doesn't match, skip everything else */
-				fprintf(stderr, "Skipping month rain.\n");
-				free(json);
-				return;
-			}
-		}
-
-		tmp = cJSON_GetObjectItemCaseSensitive(saved_at, "day");
-		if (tmp) {
-			if (tmp->valueint == gt.tm_mday) {
-				tmp = cJSON_GetObjectItemCaseSensitive(rain_json,
-						"rain_current_day");
-				wd.rainfall_day = tmp->valuedouble;
-				tmp = cJSON_GetObjectItemCaseSensitive(rain_json, "rain_24");
-				wd.rainfall_24hr = tmp->valuedouble;
-			} else {
-				fprintf(stderr, "Skipping day rain.\n");
-				free(json);
-				return;
-			}
-		}
-
-		tmp = cJSON_GetObjectItemCaseSensitive(saved_at, "hour");
-		if (tmp) {
-			if (tmp->valueint == gt.tm_hour) {
-				tmp = cJSON_GetObjectItemCaseSensitive(rain_json,
-						"rain_current_hour");
-				wd.rainfall_1hr = tmp->valuedouble;
-				tmp = cJSON_GetObjectItemCaseSensitive(rain_json, "rain_60");
-				wd.rainfall_60min = tmp->valuedouble;
-			}
-		}
-
-	}
-	cJSON_Delete(rain_json);
-	free(json);
-}
-
-
 /*
  * initialize_publishers
  *
- * Call the publisher's initialization function
+ * Call the publisher's initialization function and start the
+ * worker thread that sends data to each enabled service.
  */
 static void initialize_publishers(void)
 {
@@ -738,6 +941,11 @@ static void initialize_publishers(void)
 	for (sitr = sinfo; sitr != NULL; sitr = sitr->next) {
 		if (sitr->funcs.init)
 			(sitr->funcs.init)(&sitr->cfg, debug);
+		if (sitr->enabled && sitr->funcs.update) {
+			send_start(sitr);
+			sched_add(sitr);
+			snapshot_views |= UNITS_BIT(sitr->units);
+		}
 	}
 }
 
@@ -746,52 +954,100 @@ static void cleanup_publishers(void)
 	struct service_info *sitr;
 
 	for (sitr = sinfo; sitr != NULL; sitr = sitr->next) {
+		send_stop(sitr);
+		aggregate_free(sitr);
 		if (sitr->funcs.cleanup)
 			(sitr->funcs.cleanup)();
 	}
 }
 
+/*
+ * Show how far behind each service's send queue is.
+ */
+static void queue_report(void)
+{
+	struct service_info *sitr;
+	struct send_stats st;
+	struct dns_stats ds;
+
+	printf("UDP: %lu packets in %lu reads, %lu dropped\n",
+			rx_packets, rx_calls, rx_dropped);
+
+	dns_stats(&ds);
+	printf("DNS: %d names, %lu hits %lu misses %lu refreshes %lu failures\n",
+			ds.entries, ds.hits, ds.misses, ds.refreshes, ds.failures);
+
+	for (sitr = sinfo; sitr != NULL; sitr = sitr->next) {
+		if (!sitr->queue)
+			continue;
+		send_stats(sitr, &st);
+		printf("%s queue: depth %d (max %d) sent %lu dropped %lu "
+				"coalesced %lu skipped %lu\n", sitr->service, st.depth,
+				st.high_water, st.sent, st.dropped, st.coalesced, st.skipped);
+		if (sitr->spool)
+			printf("%s spool: %d waiting (oldest %ds) replayed %lu "
+					"expired %lu\n", sitr->service, st.spooled, st.spool_age,
+					st.replayed, st.expired);
+	}
+}
+
 /*
  * Publish the weather data to the various services
  *
- * This function is invoked as a separate pthread. It waits for an
- * event from the main thread that indicates that new data is available.
- * When new data is ready, it loops through the configured publishing
- * services and sends the data to those that are enabled.
+ * Called from the event loop when a new set of data is ready. Take
+ * a snapshot of the data and queue it for each enabled service.
+ * The services' worker threads do the actual sending, so this
+ * never waits on the network.
+ *
+ * Services that want averaged data have the snapshot added to
+ * their window. If they also have a send interval, the scheduler
+ * sends them the aggregate when due, otherwise it's sent now.
  */
-static void *publish(void *args)
+static void publish(void)
 {
 	struct service_info *sitr;
+	struct wd_snapshot *snap;
 
-	while (1) {
-		int res_wait;
+	if (debug) fprintf(stderr, "Data available event happened\n");
 
-		/* Wait for an event saying we've got new data */
-		if (debug) fprintf(stderr, "Waiting on data available event\n");
-		res_wait = pthread_cond_wait(&data_event_trigger, &data_event_mutex);
-		if (res_wait == EINVAL) {
-			fprintf(stderr, "Error waiting on event\n");
-			continue;
-		}
-		if (debug) fprintf(stderr, "Data available event happened\n");
-
-		/* Send the data to each enabled service */
-		for (sitr = sinfo; sitr != NULL; sitr = sitr->next) {
-			if (verbose)
-				printf("%s is %s\n", sitr->service,
-						(sitr->enabled ? "enabled" : "disabled"));
-			if (sitr->enabled) {
-				if (debug)
-					printf("Sending weather data to service %s\n",
-							sitr->cfg.host);
-				send_to(sitr, &wd);
+	snap = snapshot_create(&wd, snapshot_views);
+	if (!snap)
+		return;
+
+	/* Send the data to each enabled service */
+	for (sitr = sinfo; sitr != NULL; sitr = sitr->next) {
+		if (verbose)
+			printf("%s is %s\n", sitr->service,
+					(sitr->enabled ? "enabled" : "disabled"));
+		if (sitr->enabled) {
+			if (sitr->window > 0) {
+				aggregate_add(sitr, snap);
+				if (sitr->interval == 0)
+					aggregate_send(sitr);
+				continue;
 			}
+			if (debug)
+				printf("Sending weather data to service %s\n",
+						sitr->cfg.host);
+			send_to(sitr, snap);
 		}
 	}
+	snapshot_put(snap);
 
-	return 0;
+	if (verbose > 1)
+		queue_report();
 }
 
+/*
+ * Pass rapid wind, lightning and rain start events straight to the
+ * services that want them.
+ */
+static void publish_event(const struct wf_packet *pkt)
+{
+	struct service_info *sitr;
 
-
-
+	for (sitr = sinfo; sitr != NULL; sitr = sitr->next) {
+		if (sitr->enabled && sitr->funcs.event)
+			(sitr->funcs.event)(&sitr->cfg, pkt);
+	}
+}